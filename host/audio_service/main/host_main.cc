@@ -0,0 +1,139 @@
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <nvs_flash.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+
+#include <cstdlib>
+#include <string>
+
+#include "audio_service.h"
+#include "wav_audio_codec.h"
+#include "loopback_protocol.h"
+
+#define TAG "host_main"
+
+#define HOST_EVENT_SEND_AUDIO (1 << 0)
+
+static int GetEnvInt(const char* name, int default_value) {
+    auto value = getenv(name);
+    return value != nullptr ? atoi(value) : default_value;
+}
+
+static std::string GetEnvString(const char* name, const char* default_value) {
+    auto value = getenv(name);
+    return value != nullptr ? value : default_value;
+}
+
+/*
+ * Runs AudioService between a WAV file and a loopback server:
+ * the input file is captured, processed, Opus encoded, sent through the simulated network, received back,
+ * jitter buffered, decoded and played into the output file.
+ * Application is not built for the host, the send loop below follows its MAIN_EVENT_SEND_AUDIO handling.
+ */
+extern "C" void app_main(void)
+{
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        ret = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(ret);
+
+    auto input_path = GetEnvString("AUDIO_INPUT", "input.wav");
+    auto output_path = GetEnvString("AUDIO_OUTPUT", "output.wav");
+    int output_sample_rate = GetEnvInt("AUDIO_OUTPUT_SAMPLE_RATE", 24000);
+    bool realtime = GetEnvInt("AUDIO_REALTIME", 1) != 0;
+    int max_seconds = GetEnvInt("AUDIO_MAX_SECONDS", 600);
+
+    LoopbackNetwork network;
+    network.delay_ms = GetEnvInt("NETWORK_DELAY_MS", network.delay_ms);
+    network.jitter_ms = GetEnvInt("NETWORK_JITTER_MS", network.jitter_ms);
+    network.loss_percent = GetEnvInt("NETWORK_LOSS_PERCENT", network.loss_percent);
+    network.server_frame_duration = GetEnvInt("SERVER_FRAME_DURATION", network.server_frame_duration);
+
+    auto codec = new WavAudioCodec(input_path, output_path, output_sample_rate, realtime);
+    if (!codec->IsOpen()) {
+        ESP_LOGE(TAG, "Failed to open %s / %s", input_path.c_str(), output_path.c_str());
+        exit(1);
+    }
+
+    auto event_group = xEventGroupCreate();
+    auto audio_service = new AudioService();
+    audio_service->Initialize(codec);
+    audio_service->Start();
+
+    AudioServiceCallbacks callbacks;
+    callbacks.on_send_queue_available = [event_group]() {
+        xEventGroupSetBits(event_group, HOST_EVENT_SEND_AUDIO);
+    };
+    audio_service->SetCallbacks(callbacks);
+
+    // The protocol callbacks follow Application::InitializeProtocol()
+    auto protocol = new LoopbackProtocol(network);
+    protocol->SetPacketPool(&audio_service->packet_pool());
+    protocol->OnIncomingAudio([audio_service](std::unique_ptr<AudioStreamPacket> packet) {
+        audio_service->PushPacketToDecodeQueue(std::move(packet));
+    });
+    protocol->SetPreferredFrameDuration(GetEnvInt("AUDIO_UPLINK_FRAME_DURATION", CONFIG_AUDIO_UPLINK_FRAME_DURATION));
+    protocol->OnAudioChannelOpened([audio_service, protocol]() {
+        audio_service->SetFrameDuration(protocol->uplink_frame_duration());
+    });
+    protocol->Start();
+    protocol->OpenAudioChannel();
+    audio_service->EnableVoiceProcessing(true);
+
+    // The send loop of Application::MainEventLoop()
+    int64_t start_time = esp_timer_get_time();
+    int64_t last_statistics_time = start_time;
+    while (true) {
+        auto bits = xEventGroupWaitBits(event_group, HOST_EVENT_SEND_AUDIO, pdTRUE, pdFALSE, pdMS_TO_TICKS(100));
+        if (bits & HOST_EVENT_SEND_AUDIO) {
+            while (auto packet = audio_service->PopPacketFromSendQueue()) {
+                bool sent = protocol->SendAudio(*packet);
+                if (sent) {
+                    audio_service->latency_tracer().TraceSent(*packet, esp_timer_get_time());
+                }
+                audio_service->RecyclePacket(std::move(packet));
+                if (!sent) {
+                    break;
+                }
+            }
+        }
+
+        int64_t now = esp_timer_get_time();
+        if (now - last_statistics_time >= 10 * 1000 * 1000) {
+            last_statistics_time = now;
+            audio_service->latency_tracer().PrintStatistics();
+        }
+        if (codec->input_finished()) {
+            // Let the last frames through the pipeline and the network
+            if (audio_service->IsAudioProcessorRunning()) {
+                audio_service->EnableVoiceProcessing(false);
+            }
+            if (audio_service->IsIdle() && protocol->IsIdle()) {
+                vTaskDelay(pdMS_TO_TICKS(500));
+                if (audio_service->IsIdle() && protocol->IsIdle()) {
+                    break;
+                }
+            }
+        }
+        if (now - start_time >= max_seconds * 1000000LL) {
+            ESP_LOGW(TAG, "Stopped after %d seconds", max_seconds);
+            break;
+        }
+    }
+
+    audio_service->PrintDebugStatistics();
+    auto latency = audio_service->latency_tracer().GetJson();
+    auto json = cJSON_PrintUnformatted(latency);
+    // One line for scripts to pick up
+    printf("AUDIO_LATENCY %s\n", json);
+    cJSON_free(json);
+    cJSON_Delete(latency);
+
+    protocol->CloseAudioChannel();
+    audio_service->Stop();
+    codec->Close();
+    exit(0);
+}
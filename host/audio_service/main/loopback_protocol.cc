@@ -0,0 +1,135 @@
+#include "loopback_protocol.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "LoopbackProtocol"
+
+
+LoopbackProtocol::LoopbackProtocol(const LoopbackNetwork& network)
+    : network_(network), random_(1) {
+}
+
+LoopbackProtocol::~LoopbackProtocol() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+    }
+    if (delivery_task_ != nullptr) {
+        xTaskNotifyGive(delivery_task_);
+    }
+}
+
+bool LoopbackProtocol::Start() {
+    xTaskCreate([](void* arg) {
+        auto protocol = (LoopbackProtocol*)arg;
+        protocol->DeliveryTask();
+        vTaskDelete(NULL);
+    }, "loopback_network", 4096, this, 5, &delivery_task_);
+    return true;
+}
+
+bool LoopbackProtocol::OpenAudioChannel() {
+    // Answer the hello like a server would
+    auto audio_params = cJSON_CreateObject();
+    if (network_.server_frame_duration > 0) {
+        cJSON_AddNumberToObject(audio_params, "uplink_frame_duration", network_.server_frame_duration);
+    }
+    NegotiateFrameDuration(audio_params);
+    cJSON_Delete(audio_params);
+
+    // The server sends back what it receives, so the downlink runs at the uplink format
+    server_sample_rate_ = 16000;
+    server_frame_duration_ = uplink_frame_duration_;
+    session_id_ = "loopback";
+    channel_opened_ = true;
+    ESP_LOGI(TAG, "Audio channel opened, %d ms frames, delay %d ms, jitter %d ms, loss %d%%",
+        uplink_frame_duration_, network_.delay_ms, network_.jitter_ms, network_.loss_percent);
+    if (on_audio_channel_opened_ != nullptr) {
+        on_audio_channel_opened_();
+    }
+    return true;
+}
+
+void LoopbackProtocol::CloseAudioChannel() {
+    channel_opened_ = false;
+    if (on_audio_channel_closed_ != nullptr) {
+        on_audio_channel_closed_();
+    }
+}
+
+bool LoopbackProtocol::IsAudioChannelOpened() const {
+    return channel_opened_;
+}
+
+bool LoopbackProtocol::SendText(const std::string& text) {
+    ESP_LOGD(TAG, "Send text: %s", text.c_str());
+    return true;
+}
+
+bool LoopbackProtocol::SendAudio(const AudioStreamPacket& packet) {
+    if (!channel_opened_) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t sequence = ++sequence_;
+    if (network_.loss_percent > 0 && (int)(random_() % 100) < network_.loss_percent) {
+        return true;
+    }
+    int64_t delay_us = network_.delay_ms * 1000LL;
+    if (network_.jitter_ms > 0) {
+        delay_us += random_() % (network_.jitter_ms * 1000);
+    }
+
+    auto echo = AcquirePacket();
+    echo->sample_rate = server_sample_rate_;
+    echo->frame_duration = server_frame_duration_;
+    echo->sequence = sequence;
+    echo->payload.assign(packet.payload.begin(), packet.payload.end());
+    in_flight_.emplace(esp_timer_get_time() + delay_us, std::move(echo));
+    xTaskNotifyGive(delivery_task_);
+    return true;
+}
+
+bool LoopbackProtocol::IsIdle() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return in_flight_.empty();
+}
+
+void LoopbackProtocol::DeliveryTask() {
+    while (true) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (stopped_) {
+            break;
+        }
+        TickType_t wait_ticks = portMAX_DELAY;
+        if (!in_flight_.empty()) {
+            auto first = in_flight_.begin();
+            int64_t now = esp_timer_get_time();
+            if (first->first <= now) {
+                auto packet = std::move(first->second);
+                in_flight_.erase(first);
+                lock.unlock();
+                // Stamped when it "arrives", like the real transports do
+                packet->origin_time_us = now;
+                if (on_incoming_audio_ != nullptr) {
+                    on_incoming_audio_(std::move(packet));
+                } else {
+                    RecyclePacket(std::move(packet));
+                }
+                continue;
+            }
+            wait_ticks = pdMS_TO_TICKS((first->first - now + 999) / 1000);
+        }
+        lock.unlock();
+        ulTaskNotifyTake(pdTRUE, wait_ticks);
+    }
+
+    // Drop what is still on the way
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& entry : in_flight_) {
+        RecyclePacket(std::move(entry.second));
+    }
+    in_flight_.clear();
+}
@@ -0,0 +1,54 @@
+#ifndef LOOPBACK_PROTOCOL_H
+#define LOOPBACK_PROTOCOL_H
+
+#include "protocol.h"
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <random>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+struct LoopbackNetwork {
+    int delay_ms = 40;              // One-way delay
+    int jitter_ms = 0;              // Extra random delay per packet (0..jitter_ms), reorders packets
+    int loss_percent = 0;           // Packets dropped on the way
+    int server_frame_duration = 0;  // Uplink frame duration answered in the hello, 0 accepts the requested one
+};
+
+/*
+ * Protocol that plays the server: every uplink packet is numbered like the MQTT/UDP transport
+ * and sent back as downlink audio after the simulated network delay, jitter and loss.
+ */
+class LoopbackProtocol : public Protocol {
+public:
+    explicit LoopbackProtocol(const LoopbackNetwork& network);
+    ~LoopbackProtocol();
+
+    bool Start() override;
+    bool OpenAudioChannel() override;
+    void CloseAudioChannel() override;
+    bool IsAudioChannelOpened() const override;
+    bool SendAudio(const AudioStreamPacket& packet) override;
+
+    // No packet is on the way
+    bool IsIdle();
+
+private:
+    LoopbackNetwork network_;
+    std::mt19937 random_;
+    std::mutex mutex_;
+    // Packets on the way, by delivery time
+    std::multimap<int64_t, std::unique_ptr<AudioStreamPacket>> in_flight_;
+    TaskHandle_t delivery_task_ = nullptr;
+    bool channel_opened_ = false;
+    bool stopped_ = false;
+    uint32_t sequence_ = 0;
+
+    void DeliveryTask();
+    bool SendText(const std::string& text) override;
+};
+
+#endif // LOOPBACK_PROTOCOL_H
@@ -0,0 +1,141 @@
+#include "opus_encoder.h"
+#include "opus_decoder.h"
+#include "opus_resampler.h"
+
+#include <opus.h>
+#include <esp_log.h>
+
+#define TAG "OpusHost"
+
+#define MAX_OPUS_PACKET_BYTES 1500
+
+
+OpusEncoderWrapper::OpusEncoderWrapper(int sample_rate, int channels, int duration_ms)
+    : sample_rate_(sample_rate), duration_ms_(duration_ms) {
+    int error;
+    encoder_ = opus_encoder_create(sample_rate, channels, OPUS_APPLICATION_VOIP, &error);
+    if (encoder_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", error);
+        return;
+    }
+    SetDtx(false);
+    SetComplexity(0);
+    frame_size_ = sample_rate / 1000 * channels * duration_ms;
+}
+
+OpusEncoderWrapper::~OpusEncoderWrapper() {
+    if (encoder_ != nullptr) {
+        opus_encoder_destroy(encoder_);
+    }
+}
+
+void OpusEncoderWrapper::SetDtx(bool enable) {
+    opus_encoder_ctl(encoder_, OPUS_SET_DTX(enable ? 1 : 0));
+}
+
+void OpusEncoderWrapper::SetComplexity(int complexity) {
+    opus_encoder_ctl(encoder_, OPUS_SET_COMPLEXITY(complexity));
+}
+
+bool OpusEncoderWrapper::Encode(std::vector<int16_t>&& pcm, std::vector<uint8_t>& opus) {
+    if (encoder_ == nullptr || (int)pcm.size() != frame_size_) {
+        ESP_LOGE(TAG, "Audio data size %zu does not match the frame size %d", pcm.size(), frame_size_);
+        return false;
+    }
+    opus.resize(MAX_OPUS_PACKET_BYTES);
+    int ret = opus_encode(encoder_, pcm.data(), frame_size_, opus.data(), opus.size());
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
+        return false;
+    }
+    opus.resize(ret);
+    return true;
+}
+
+void OpusEncoderWrapper::Encode(std::vector<int16_t>&& pcm, std::function<void(std::vector<uint8_t>&& opus)> handler) {
+    in_buffer_.insert(in_buffer_.end(), pcm.begin(), pcm.end());
+    while ((int)in_buffer_.size() >= frame_size_) {
+        std::vector<int16_t> frame(in_buffer_.begin(), in_buffer_.begin() + frame_size_);
+        in_buffer_.erase(in_buffer_.begin(), in_buffer_.begin() + frame_size_);
+        std::vector<uint8_t> opus;
+        if (Encode(std::move(frame), opus) && handler) {
+            handler(std::move(opus));
+        }
+    }
+}
+
+void OpusEncoderWrapper::ResetState() {
+    if (encoder_ != nullptr) {
+        opus_encoder_ctl(encoder_, OPUS_RESET_STATE);
+    }
+    in_buffer_.clear();
+}
+
+
+OpusDecoderWrapper::OpusDecoderWrapper(int sample_rate, int channels, int duration_ms)
+    : sample_rate_(sample_rate), duration_ms_(duration_ms) {
+    int error;
+    decoder_ = opus_decoder_create(sample_rate, channels, &error);
+    if (decoder_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", error);
+        return;
+    }
+    frame_size_ = sample_rate / 1000 * channels * duration_ms;
+}
+
+OpusDecoderWrapper::~OpusDecoderWrapper() {
+    if (decoder_ != nullptr) {
+        opus_decoder_destroy(decoder_);
+    }
+}
+
+bool OpusDecoderWrapper::Decode(std::vector<uint8_t>&& opus, std::vector<int16_t>& pcm) {
+    if (decoder_ == nullptr) {
+        return false;
+    }
+    pcm.resize(frame_size_);
+    // An empty packet runs packet loss concealment, like the firmware wrapper
+    int ret = opus_decode(decoder_, opus.empty() ? nullptr : opus.data(), opus.size(), pcm.data(), pcm.size(), 0);
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Failed to decode audio, error code: %d", ret);
+        return false;
+    }
+    pcm.resize(ret);
+    return true;
+}
+
+void OpusDecoderWrapper::ResetState() {
+    if (decoder_ != nullptr) {
+        opus_decoder_ctl(decoder_, OPUS_RESET_STATE);
+    }
+}
+
+
+void OpusResampler::Configure(int input_sample_rate, int output_sample_rate) {
+    input_sample_rate_ = input_sample_rate;
+    output_sample_rate_ = output_sample_rate;
+    last_sample_ = 0;
+}
+
+int OpusResampler::GetOutputSamples(int input_samples) const {
+    if (input_sample_rate_ == 0) {
+        return input_samples;
+    }
+    return (int64_t)input_samples * output_sample_rate_ / input_sample_rate_;
+}
+
+void OpusResampler::Process(const int16_t* input, int input_samples, int16_t* output) {
+    int output_samples = GetOutputSamples(input_samples);
+    for (int i = 0; i < output_samples; i++) {
+        // Position in the input, 16.16 fixed point; sample -1 is the last sample of the previous block
+        int64_t position = ((int64_t)i << 16) * input_sample_rate_ / output_sample_rate_;
+        int index = position >> 16;
+        int fraction = position & 0xFFFF;
+        int32_t a = index == 0 ? last_sample_ : input[index - 1];
+        int32_t b = input[index];
+        output[i] = a + (((b - a) * fraction) >> 16);
+    }
+    if (input_samples > 0) {
+        last_sample_ = input[input_samples - 1];
+    }
+}
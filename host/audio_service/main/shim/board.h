@@ -0,0 +1,6 @@
+#ifndef HOST_SHIM_BOARD_H
+#define HOST_SHIM_BOARD_H
+
+// The audio pipeline does not use the board on the host, audio_codec.h / .cc only include this header
+
+#endif // HOST_SHIM_BOARD_H
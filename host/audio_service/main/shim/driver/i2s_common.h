@@ -0,0 +1,12 @@
+#ifndef HOST_SHIM_I2S_COMMON_H
+#define HOST_SHIM_I2S_COMMON_H
+
+#include <esp_err.h>
+
+// Host codecs do not use I2S, the handles stay nullptr
+typedef struct i2s_channel_obj_t* i2s_chan_handle_t;
+
+static inline esp_err_t i2s_channel_enable(i2s_chan_handle_t handle) { return ESP_OK; }
+static inline esp_err_t i2s_channel_disable(i2s_chan_handle_t handle) { return ESP_OK; }
+
+#endif // HOST_SHIM_I2S_COMMON_H
@@ -0,0 +1,28 @@
+#ifndef HOST_SHIM_OPUS_DECODER_H
+#define HOST_SHIM_OPUS_DECODER_H
+
+#include <vector>
+#include <cstdint>
+
+struct OpusDecoder;
+
+// Same interface as the esp-opus-encoder component, implemented with the system libopus
+class OpusDecoderWrapper {
+public:
+    OpusDecoderWrapper(int sample_rate, int channels, int duration_ms = 60);
+    ~OpusDecoderWrapper();
+
+    inline int sample_rate() const { return sample_rate_; }
+    inline int duration_ms() const { return duration_ms_; }
+
+    bool Decode(std::vector<uint8_t>&& opus, std::vector<int16_t>& pcm);
+    void ResetState();
+
+private:
+    OpusDecoder* decoder_ = nullptr;
+    int sample_rate_;
+    int duration_ms_;
+    int frame_size_;
+};
+
+#endif // HOST_SHIM_OPUS_DECODER_H
@@ -0,0 +1,34 @@
+#ifndef HOST_SHIM_OPUS_ENCODER_H
+#define HOST_SHIM_OPUS_ENCODER_H
+
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+struct OpusEncoder;
+
+// Same interface as the esp-opus-encoder component, implemented with the system libopus
+class OpusEncoderWrapper {
+public:
+    OpusEncoderWrapper(int sample_rate, int channels, int duration_ms = 60);
+    ~OpusEncoderWrapper();
+
+    inline int sample_rate() const { return sample_rate_; }
+    inline int duration_ms() const { return duration_ms_; }
+
+    void SetDtx(bool enable);
+    void SetComplexity(int complexity);
+    bool Encode(std::vector<int16_t>&& pcm, std::vector<uint8_t>& opus);
+    void Encode(std::vector<int16_t>&& pcm, std::function<void(std::vector<uint8_t>&& opus)> handler);
+    bool IsBufferEmpty() const { return in_buffer_.empty(); }
+    void ResetState();
+
+private:
+    OpusEncoder* encoder_ = nullptr;
+    int sample_rate_;
+    int duration_ms_;
+    int frame_size_;
+    std::vector<int16_t> in_buffer_;
+};
+
+#endif // HOST_SHIM_OPUS_ENCODER_H
@@ -0,0 +1,25 @@
+#ifndef HOST_SHIM_OPUS_RESAMPLER_H
+#define HOST_SHIM_OPUS_RESAMPLER_H
+
+#include <cstdint>
+
+// Same interface as the esp-opus-encoder component, a linear interpolator is enough for the host benchmarks
+class OpusResampler {
+public:
+    OpusResampler() = default;
+    ~OpusResampler() = default;
+
+    void Configure(int input_sample_rate, int output_sample_rate);
+    void Process(const int16_t* input, int input_samples, int16_t* output);
+    int GetOutputSamples(int input_samples) const;
+
+    inline int input_sample_rate() const { return input_sample_rate_; }
+    inline int output_sample_rate() const { return output_sample_rate_; }
+
+private:
+    int input_sample_rate_ = 0;
+    int output_sample_rate_ = 0;
+    int16_t last_sample_ = 0;
+};
+
+#endif // HOST_SHIM_OPUS_RESAMPLER_H
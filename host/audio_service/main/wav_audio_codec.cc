@@ -0,0 +1,158 @@
+#include "wav_audio_codec.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <cstring>
+
+#define TAG "WavAudioCodec"
+
+struct WavChunkHeader {
+    char id[4];
+    uint32_t size;
+};
+
+struct WavFormat {
+    uint16_t audio_format;
+    uint16_t channels;
+    uint32_t sample_rate;
+    uint32_t byte_rate;
+    uint16_t block_align;
+    uint16_t bits_per_sample;
+};
+
+
+WavAudioCodec::WavAudioCodec(const std::string& input_path, const std::string& output_path, int output_sample_rate, bool realtime)
+    : realtime_(realtime) {
+    duplex_ = true;
+    output_sample_rate_ = output_sample_rate;
+
+    input_file_ = fopen(input_path.c_str(), "rb");
+    if (input_file_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to open %s", input_path.c_str());
+    } else if (!ReadHeader()) {
+        ESP_LOGE(TAG, "%s is not a 16-bit PCM WAV file", input_path.c_str());
+        fclose(input_file_);
+        input_file_ = nullptr;
+    }
+    input_reference_ = input_channels_ == 2;
+
+    output_file_ = fopen(output_path.c_str(), "wb");
+    if (output_file_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create %s", output_path.c_str());
+    } else {
+        WriteHeader();
+    }
+    ESP_LOGI(TAG, "Input %s: %d Hz, %d channels, output %s: %d Hz", input_path.c_str(), input_sample_rate_,
+        input_channels_, output_path.c_str(), output_sample_rate_);
+}
+
+WavAudioCodec::~WavAudioCodec() {
+    Close();
+}
+
+void WavAudioCodec::Close() {
+    if (input_file_ != nullptr) {
+        fclose(input_file_);
+        input_file_ = nullptr;
+    }
+    if (output_file_ != nullptr) {
+        // Now that the size is known, write the header again
+        fseek(output_file_, 0, SEEK_SET);
+        WriteHeader();
+        fclose(output_file_);
+        output_file_ = nullptr;
+    }
+}
+
+bool WavAudioCodec::ReadHeader() {
+    char riff[12];
+    if (fread(riff, 1, sizeof(riff), input_file_) != sizeof(riff) || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+        return false;
+    }
+    bool has_format = false;
+    WavChunkHeader chunk;
+    while (fread(&chunk, 1, sizeof(chunk), input_file_) == sizeof(chunk)) {
+        if (memcmp(chunk.id, "fmt ", 4) == 0) {
+            WavFormat format;
+            if (chunk.size < sizeof(format) || fread(&format, 1, sizeof(format), input_file_) != sizeof(format)) {
+                return false;
+            }
+            fseek(input_file_, chunk.size - sizeof(format), SEEK_CUR);
+            if (format.audio_format != 1 || format.bits_per_sample != 16 || format.channels < 1 || format.channels > 2) {
+                return false;
+            }
+            input_sample_rate_ = format.sample_rate;
+            input_channels_ = format.channels;
+            has_format = true;
+        } else if (memcmp(chunk.id, "data", 4) == 0) {
+            // Leave the file at the first sample
+            return has_format;
+        } else {
+            fseek(input_file_, chunk.size + (chunk.size & 1), SEEK_CUR);
+        }
+    }
+    return false;
+}
+
+void WavAudioCodec::WriteHeader() {
+    WavFormat format = {
+        .audio_format = 1,
+        .channels = (uint16_t)output_channels_,
+        .sample_rate = (uint32_t)output_sample_rate_,
+        .byte_rate = (uint32_t)(output_sample_rate_ * output_channels_ * sizeof(int16_t)),
+        .block_align = (uint16_t)(output_channels_ * sizeof(int16_t)),
+        .bits_per_sample = 16,
+    };
+    uint32_t riff_size = 4 + sizeof(WavChunkHeader) + sizeof(format) + sizeof(WavChunkHeader) + output_data_bytes_;
+    fwrite("RIFF", 1, 4, output_file_);
+    fwrite(&riff_size, sizeof(riff_size), 1, output_file_);
+    fwrite("WAVE", 1, 4, output_file_);
+    WavChunkHeader format_header = {{'f', 'm', 't', ' '}, sizeof(format)};
+    fwrite(&format_header, sizeof(format_header), 1, output_file_);
+    fwrite(&format, sizeof(format), 1, output_file_);
+    WavChunkHeader data_header = {{'d', 'a', 't', 'a'}, output_data_bytes_};
+    fwrite(&data_header, sizeof(data_header), 1, output_file_);
+}
+
+void WavAudioCodec::WaitForStream(int64_t& start_us, uint64_t& frames, int new_frames, int sample_rate) {
+    if (!realtime_) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    if (start_us == 0 || now - (start_us + (int64_t)(frames * 1000000 / sample_rate)) > 200 * 1000) {
+        // First call, or the stream was idle: start counting again
+        start_us = now;
+        frames = 0;
+    }
+    frames += new_frames;
+    int64_t due = start_us + (int64_t)(frames * 1000000 / sample_rate);
+    if (due > now) {
+        vTaskDelay(pdMS_TO_TICKS((due - now) / 1000) + 1);
+    }
+}
+
+int WavAudioCodec::Read(int16_t* dest, int samples) {
+    WaitForStream(input_start_us_, input_frames_, samples / input_channels_, input_sample_rate_);
+
+    size_t read = input_file_ ? fread(dest, sizeof(int16_t), samples, input_file_) : 0;
+    if (read < (size_t)samples) {
+        if (!input_finished_) {
+            ESP_LOGI(TAG, "End of the input file");
+            input_finished_ = true;
+        }
+        memset(dest + read, 0, (samples - read) * sizeof(int16_t));
+    }
+    return samples;
+}
+
+int WavAudioCodec::Write(const int16_t* data, int samples) {
+    WaitForStream(output_start_us_, output_frames_, samples / output_channels_, output_sample_rate_);
+
+    if (output_file_ != nullptr) {
+        fwrite(data, sizeof(int16_t), samples, output_file_);
+        output_data_bytes_ += samples * sizeof(int16_t);
+    }
+    return samples;
+}
@@ -0,0 +1,46 @@
+#ifndef WAV_AUDIO_CODEC_H
+#define WAV_AUDIO_CODEC_H
+
+#include "audio_codec.h"
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+
+/*
+ * AudioCodec backed by WAV files: the microphone reads a 16-bit PCM WAV file (its sample rate and
+ * channel count become the input format, 2 channels are mic + reference), the speaker writes one.
+ *
+ * In realtime mode, Read / Write block like the I2S DMA does, at the rate of the stream. Otherwise
+ * they return at once, so a benchmark runs as fast as the pipeline allows.
+ */
+class WavAudioCodec : public AudioCodec {
+public:
+    WavAudioCodec(const std::string& input_path, const std::string& output_path, int output_sample_rate, bool realtime);
+    virtual ~WavAudioCodec();
+
+    bool IsOpen() const { return input_file_ != nullptr && output_file_ != nullptr; }
+    // The whole input file has been read, the microphone returns silence from now on
+    bool input_finished() const { return input_finished_; }
+    void Close();
+
+private:
+    FILE* input_file_ = nullptr;
+    FILE* output_file_ = nullptr;
+    bool realtime_;
+    std::atomic<bool> input_finished_{false};
+    uint32_t output_data_bytes_ = 0;
+    uint64_t input_frames_ = 0;
+    uint64_t output_frames_ = 0;
+    int64_t input_start_us_ = 0;
+    int64_t output_start_us_ = 0;
+
+    bool ReadHeader();
+    void WriteHeader();
+    void WaitForStream(int64_t& start_us, uint64_t& frames, int new_frames, int sample_rate);
+
+    virtual int Read(int16_t* dest, int samples) override;
+    virtual int Write(const int16_t* data, int samples) override;
+};
+
+#endif // WAV_AUDIO_CODEC_H
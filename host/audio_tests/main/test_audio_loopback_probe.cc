@@ -0,0 +1,59 @@
+#include <unity.h>
+#include <unity_test_runner.h>
+
+#include "audio_loopback_probe.h"
+
+#include <cstdint>
+#include <vector>
+
+/*
+ * The probe is buried in noise at every lag of a calibration window, including both ends and odd
+ * lags that the 8 kHz pass cannot see, and must be found to the sample.
+ */
+
+#define TEST_WINDOW_SAMPLES (16000 * 520 / 1000)
+
+static uint32_t seed_ = 1;
+
+static int16_t RandomNoise(int amplitude) {
+    seed_ = seed_ * 1103515245 + 12345;
+    return (int16_t)((int)(seed_ >> 16) % (2 * amplitude + 1) - amplitude);
+}
+
+static void MakeWindow(int lag, int noise, std::vector<int16_t>& mic) {
+    std::vector<int16_t> probe;
+    AudioLoopbackProbe::Generate(16000, probe);
+    mic.resize(TEST_WINDOW_SAMPLES);
+    for (auto& sample : mic) {
+        sample = RandomNoise(noise);
+    }
+    for (size_t i = 0; i < probe.size() && lag + i < mic.size(); i++) {
+        mic[lag + i] += probe[i] / 2;
+    }
+}
+
+TEST_CASE("Find locates the probe to the sample", "[loopback_probe]")
+{
+    const int lags[] = {0, 1, 2, 333, 1234, 4001, TEST_WINDOW_SAMPLES - 16000 * LOOPBACK_PROBE_MS / 1000};
+    std::vector<int16_t> mic;
+    for (int lag : lags) {
+        MakeWindow(lag, 1000, mic);
+        float score;
+        TEST_ASSERT_EQUAL_INT(lag, AudioLoopbackProbe::Find(mic.data(), mic.size(), score));
+        TEST_ASSERT_TRUE(score > LOOPBACK_PROBE_MIN_SCORE);
+    }
+}
+
+TEST_CASE("Find does not score noise", "[loopback_probe]")
+{
+    std::vector<int16_t> mic(TEST_WINDOW_SAMPLES);
+    for (auto& sample : mic) {
+        sample = RandomNoise(8000);
+    }
+    float score;
+    AudioLoopbackProbe::Find(mic.data(), mic.size(), score);
+    TEST_ASSERT_TRUE(score < LOOPBACK_PROBE_MIN_SCORE);
+
+    // Shorter than the probe
+    TEST_ASSERT_EQUAL_INT(-1, AudioLoopbackProbe::Find(mic.data(), 100, score));
+}
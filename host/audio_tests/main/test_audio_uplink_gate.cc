@@ -0,0 +1,107 @@
+#include <unity.h>
+#include <unity_test_runner.h>
+
+#include "audio_uplink_gate.h"
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#define TEST_FRAME_MS 20
+
+/*
+ * Feeds the gate numbered frames and records the numbers it sends, the frames must reach the send
+ * queue in capture order whatever the gate holds back.
+ */
+struct GateRecorder {
+    AudioUplinkGate gate;
+    std::vector<uint32_t> sent;
+    uint32_t released = 0;
+    uint32_t next = 0;
+
+    GateRecorder(int preroll_ms, int hangover_ms, int keepalive_ms)
+        : gate(true, preroll_ms, hangover_ms, keepalive_ms) {
+        gate.SetHandlers([this](std::unique_ptr<AudioStreamPacket>&& packet) {
+            sent.push_back(packet->timestamp);
+        }, [this](std::unique_ptr<AudioStreamPacket>&& packet) {
+            released++;
+        });
+    }
+
+    void Feed(int frames, bool voice) {
+        for (int i = 0; i < frames; i++) {
+            auto packet = std::make_unique<AudioStreamPacket>();
+            packet->frame_duration = TEST_FRAME_MS;
+            packet->timestamp = next++;
+            packet->payload.resize(40);
+            gate.Process(std::move(packet), voice, true);
+        }
+    }
+
+    void AssertInOrder() {
+        for (size_t i = 1; i < sent.size(); i++) {
+            TEST_ASSERT_LESS_THAN(sent[i], sent[i - 1]);
+        }
+    }
+};
+
+TEST_CASE("Uplink gate keeps capture order across a keep-alive and the onset", "[audio_uplink_gate]")
+{
+    // The pre-roll (300ms) is longer than the keep-alive interval (100ms), so frames are held when it fires
+    GateRecorder recorder(300, 0, 100);
+    recorder.Feed(1, false);
+    TEST_ASSERT_EQUAL(1, recorder.sent.size());
+
+    recorder.Feed(40, false);
+    size_t keepalives = recorder.sent.size() - 1;
+    TEST_ASSERT_GREATER_THAN(0, keepalives);
+    recorder.AssertInOrder();
+
+    // The onset sends everything still held, then the frame that triggered it
+    recorder.Feed(1, true);
+    recorder.AssertInOrder();
+    TEST_ASSERT_EQUAL(41, recorder.sent.back());
+    // Every frame was either sent or dropped, none twice
+    TEST_ASSERT_EQUAL(recorder.next, recorder.sent.size() + recorder.released);
+    // The frames just before the onset were all sent (300ms of pre-roll minus the keep-alives among them)
+    size_t onset = recorder.sent.size() - 1;
+    TEST_ASSERT_EQUAL(40, recorder.sent[onset - 1]);
+    TEST_ASSERT_GREATER_OR_EQUAL(300 / TEST_FRAME_MS - 1, onset - keepalives);
+}
+
+TEST_CASE("Uplink gate sends the hangover, then gates with keep-alives", "[audio_uplink_gate]")
+{
+    GateRecorder recorder(100, 60, 200);
+    recorder.Feed(5, true);
+    TEST_ASSERT_EQUAL(5, recorder.sent.size());
+    // 60ms of hangover passes untouched
+    recorder.Feed(3, false);
+    TEST_ASSERT_EQUAL(8, recorder.sent.size());
+
+    // 1s of silence: one keep-alive per 200ms, the rest held or dropped
+    recorder.Feed(50, false);
+    TEST_ASSERT_EQUAL(8 + 1000 / 200, recorder.sent.size());
+    recorder.AssertInOrder();
+
+    recorder.Feed(2, true);
+    recorder.AssertInOrder();
+    TEST_ASSERT_EQUAL(recorder.next, recorder.sent.size() + recorder.released);
+    TEST_ASSERT_EQUAL(recorder.next - 1, recorder.sent.back());
+}
+
+TEST_CASE("Uplink gate passes everything without a VAD", "[audio_uplink_gate]")
+{
+    AudioUplinkGate gate(true, 300, 0, 100);
+    uint32_t sent = 0;
+    gate.SetHandlers([&sent](std::unique_ptr<AudioStreamPacket>&& packet) {
+        sent++;
+    }, [](std::unique_ptr<AudioStreamPacket>&& packet) {
+        TEST_FAIL_MESSAGE("dropped a frame");
+    });
+    for (int i = 0; i < 20; i++) {
+        auto packet = std::make_unique<AudioStreamPacket>();
+        packet->frame_duration = TEST_FRAME_MS;
+        gate.Process(std::move(packet), false, false);
+    }
+    TEST_ASSERT_EQUAL(20, sent);
+}
@@ -0,0 +1,11 @@
+#include <unity.h>
+#include <unity_test_runner.h>
+
+#include <cstdlib>
+
+// Runs every TEST_CASE of the app, the exit code is the number of failures
+extern "C" void app_main(void) {
+    UNITY_BEGIN();
+    unity_run_all_tests();
+    exit(UNITY_END());
+}
@@ -0,0 +1,258 @@
+#include <unity.h>
+#include <unity_test_runner.h>
+
+#include "pcm_kernels.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+/*
+ * Every kernel is checked against a per-sample reference, for lengths around the 8-sample vector
+ * block and for buffers that start off the 16-byte alignment, so the head / block / tail split of
+ * the PIE path is covered when the app is built for the ESP32-S3 as well.
+ */
+
+#define TEST_MAX_SAMPLES 1024
+
+static const size_t kLengths[] = {0, 1, 2, 7, 8, 9, 15, 16, 17, 31, 960, 961};
+static const size_t kOffsets[] = {0, 1, 3, 7, 8};
+
+alignas(16) static int16_t s16_a[TEST_MAX_SAMPLES * 2 + 16];
+alignas(16) static int16_t s16_b[TEST_MAX_SAMPLES * 2 + 16];
+alignas(16) static int16_t s16_c[TEST_MAX_SAMPLES * 2 + 16];
+alignas(16) static int32_t s32_a[TEST_MAX_SAMPLES + 16];
+
+static uint32_t seed_ = 1;
+
+static int16_t Random16() {
+    seed_ = seed_ * 1103515245 + 12345;
+    return (int16_t)(seed_ >> 16);
+}
+
+static int32_t Random32() {
+    seed_ = seed_ * 1103515245 + 12345;
+    uint32_t high = seed_ >> 16;
+    seed_ = seed_ * 1103515245 + 12345;
+    return (int32_t)((high << 16) | (seed_ >> 16));
+}
+
+// Random samples with the rails mixed in, so the saturation paths run in the vector blocks too
+static void Fill16(int16_t* data, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        switch (i % 11) {
+        case 3: data[i] = INT16_MAX; break;
+        case 7: data[i] = INT16_MIN; break;
+        default: data[i] = Random16(); break;
+        }
+    }
+}
+
+static int16_t Saturate16(int64_t value) {
+    return value > INT16_MAX ? INT16_MAX : (value < INT16_MIN ? INT16_MIN : (int16_t)value);
+}
+
+TEST_CASE("ConvertS32ToS16 shifts and saturates", "[pcm_kernels]")
+{
+    for (size_t length : kLengths) {
+        for (size_t offset : kOffsets) {
+            int32_t* src = s32_a + offset;
+            int16_t* dst = s16_a + offset;
+            for (size_t i = 0; i < length; i++) {
+                src[i] = i % 5 == 0 ? INT32_MAX : (i % 5 == 1 ? INT32_MIN : Random32());
+            }
+            dst[length] = 0x5A5A;
+            PcmKernels::ConvertS32ToS16(src, dst, length, 12);
+            for (size_t i = 0; i < length; i++) {
+                TEST_ASSERT_EQUAL_INT16(Saturate16(src[i] >> 12), dst[i]);
+            }
+            TEST_ASSERT_EQUAL_INT16(0x5A5A, dst[length]);
+        }
+    }
+
+    int32_t edges[] = {INT32_MAX, INT32_MIN, 0x7FFF0000, -0x7FFF0000, 0x8000, -1};
+    int16_t out[6];
+    PcmKernels::ConvertS32ToS16(edges, out, 6, 16);
+    int16_t expected[] = {INT16_MAX, INT16_MIN, INT16_MAX, -INT16_MAX, 0, -1};
+    TEST_ASSERT_EQUAL_INT16_ARRAY(expected, out, 6);
+    // A small shift saturates a 24-bit sample
+    int32_t loud[] = {0x00800000, -0x00800000};
+    PcmKernels::ConvertS32ToS16(loud, out, 2, 4);
+    TEST_ASSERT_EQUAL_INT16(INT16_MAX, out[0]);
+    TEST_ASSERT_EQUAL_INT16(INT16_MIN, out[1]);
+}
+
+TEST_CASE("ConvertS16ToS32 keeps the full product", "[pcm_kernels]")
+{
+    const int16_t gains[] = {0, 1, 3, 327, PcmKernels::VolumeToGain(10), PcmKernels::VolumeToGain(70), INT16_MAX};
+    for (int16_t gain : gains) {
+        for (size_t length : kLengths) {
+            for (size_t offset : kOffsets) {
+                int16_t* src = s16_a + offset;
+                int32_t* dst = s32_a + offset;
+                Fill16(src, length);
+                dst[length] = 0x5A5A5A5A;
+                PcmKernels::ConvertS16ToS32(src, dst, length, gain);
+                for (size_t i = 0; i < length; i++) {
+                    TEST_ASSERT_EQUAL_INT32((int32_t)((int64_t)src[i] * gain * 2), dst[i]);
+                }
+                TEST_ASSERT_EQUAL_INT32(0x5A5A5A5A, dst[length]);
+            }
+        }
+    }
+
+    // Low volume keeps the bits below the 16-bit sample instead of rounding them away
+    int16_t quiet[] = {1, -1, 100};
+    int32_t out[3];
+    PcmKernels::ConvertS16ToS32(quiet, out, 3, 3);
+    TEST_ASSERT_EQUAL_INT32(6, out[0]);
+    TEST_ASSERT_EQUAL_INT32(-6, out[1]);
+    TEST_ASSERT_EQUAL_INT32(600, out[2]);
+    // The extremes stay within 32 bits
+    int16_t rails[] = {INT16_MAX, INT16_MIN};
+    PcmKernels::ConvertS16ToS32(rails, out, 2, INT16_MAX);
+    TEST_ASSERT_EQUAL_INT32(2147352578, out[0]);
+    TEST_ASSERT_EQUAL_INT32(-2147418112, out[1]);
+}
+
+TEST_CASE("ApplyGain scales in Q15", "[pcm_kernels]")
+{
+    const int16_t gains[] = {0, 1, 16384, PcmKernels::VolumeToGain(50), INT16_MAX};
+    for (int16_t gain : gains) {
+        for (size_t length : kLengths) {
+            for (size_t offset : kOffsets) {
+                int16_t* data = s16_a + offset;
+                Fill16(data, length);
+                memcpy(s16_b, data, length * sizeof(int16_t));
+                PcmKernels::ApplyGain(data, length, gain);
+                for (size_t i = 0; i < length; i++) {
+                    TEST_ASSERT_EQUAL_INT16(Saturate16(((int32_t)s16_b[i] * gain) >> 15), data[i]);
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("Deinterleave splits stereo frames", "[pcm_kernels]")
+{
+    for (size_t length : kLengths) {
+        for (size_t offset : kOffsets) {
+            int16_t* src = s16_a + offset;
+            int16_t* left = s16_b + offset;
+            int16_t* right = s16_c + offset;
+            Fill16(src, length * 2);
+            left[length] = 0x5A5A;
+            right[length] = 0x5A5A;
+            PcmKernels::Deinterleave(src, left, right, length);
+            for (size_t i = 0; i < length; i++) {
+                TEST_ASSERT_EQUAL_INT16(src[2 * i], left[i]);
+                TEST_ASSERT_EQUAL_INT16(src[2 * i + 1], right[i]);
+            }
+            TEST_ASSERT_EQUAL_INT16(0x5A5A, left[length]);
+            TEST_ASSERT_EQUAL_INT16(0x5A5A, right[length]);
+        }
+    }
+}
+
+TEST_CASE("Deinterleave keeps the left channel only, in place", "[pcm_kernels]")
+{
+    for (size_t length : kLengths) {
+        for (size_t offset : kOffsets) {
+            // Into a separate buffer
+            int16_t* src = s16_a + offset;
+            int16_t* left = s16_b + offset;
+            Fill16(src, length * 2);
+            left[length] = 0x5A5A;
+            PcmKernels::Deinterleave(src, left, nullptr, length);
+            for (size_t i = 0; i < length; i++) {
+                TEST_ASSERT_EQUAL_INT16(src[2 * i], left[i]);
+            }
+            TEST_ASSERT_EQUAL_INT16(0x5A5A, left[length]);
+
+            // Over the source, like NoAudioProcessor does
+            memcpy(s16_c, src, length * 2 * sizeof(int16_t));
+            PcmKernels::Deinterleave(src, src, nullptr, length);
+            for (size_t i = 0; i < length; i++) {
+                TEST_ASSERT_EQUAL_INT16(s16_c[2 * i], src[i]);
+            }
+        }
+    }
+}
+
+TEST_CASE("Interleave merges two channels", "[pcm_kernels]")
+{
+    for (size_t length : kLengths) {
+        for (size_t offset : kOffsets) {
+            int16_t* left = s16_a + offset;
+            int16_t* right = s16_b + offset;
+            int16_t* dst = s16_c + offset;
+            Fill16(left, length);
+            Fill16(right, length);
+            dst[length * 2] = 0x5A5A;
+            PcmKernels::Interleave(left, right, dst, length);
+            for (size_t i = 0; i < length; i++) {
+                TEST_ASSERT_EQUAL_INT16(left[i], dst[2 * i]);
+                TEST_ASSERT_EQUAL_INT16(right[i], dst[2 * i + 1]);
+            }
+            TEST_ASSERT_EQUAL_INT16(0x5A5A, dst[length * 2]);
+        }
+    }
+}
+
+TEST_CASE("Mix adds with saturation", "[pcm_kernels]")
+{
+    const int16_t gains[] = {0, PcmKernels::VolumeToGain(60), INT16_MAX};
+    for (int16_t gain : gains) {
+        for (size_t length : kLengths) {
+            for (size_t offset : kOffsets) {
+                int16_t* dst = s16_a + offset;
+                int16_t* src = s16_b + offset;
+                Fill16(dst, length);
+                Fill16(src, length);
+                memcpy(s16_c, dst, length * sizeof(int16_t));
+                PcmKernels::Mix(dst, src, length, gain);
+                for (size_t i = 0; i < length; i++) {
+                    int32_t gained = ((int32_t)src[i] * gain) >> 15;
+                    TEST_ASSERT_EQUAL_INT16(Saturate16((int32_t)s16_c[i] + gained), dst[i]);
+                }
+            }
+        }
+    }
+
+    // Q15 rounds toward minus infinity, so -100 at full gain is -100
+    int16_t dst[] = {30000, -30000, 100, 100};
+    int16_t src[] = {30000, -30000, -100, 100};
+    PcmKernels::Mix(dst, src, 4, INT16_MAX);
+    TEST_ASSERT_EQUAL_INT16(INT16_MAX, dst[0]);
+    TEST_ASSERT_EQUAL_INT16(INT16_MIN, dst[1]);
+    TEST_ASSERT_EQUAL_INT16(0, dst[2]);
+    TEST_ASSERT_EQUAL_INT16(199, dst[3]);
+}
+
+TEST_CASE("Measure returns peak and RMS", "[pcm_kernels]")
+{
+    PcmLevel level = PcmKernels::Measure(nullptr, 0);
+    TEST_ASSERT_EQUAL_INT16(0, level.peak);
+    TEST_ASSERT_EQUAL_INT16(0, level.rms);
+
+    int16_t square[] = {1000, -1000, 1000, -1000, 1000};
+    level = PcmKernels::Measure(square, 5);
+    TEST_ASSERT_EQUAL_INT16(1000, level.peak);
+    TEST_ASSERT_EQUAL_INT16(1000, level.rms);
+
+    // The peak of INT16_MIN does not fit, it saturates
+    std::vector<int16_t> rail(960, INT16_MIN);
+    level = PcmKernels::Measure(rail.data(), rail.size());
+    TEST_ASSERT_EQUAL_INT16(INT16_MAX, level.peak);
+    TEST_ASSERT_EQUAL_INT16(INT16_MAX, level.rms);
+}
+
+TEST_CASE("VolumeToGain follows a squared curve", "[pcm_kernels]")
+{
+    TEST_ASSERT_EQUAL_INT16(0, PcmKernels::VolumeToGain(-5));
+    TEST_ASSERT_EQUAL_INT16(0, PcmKernels::VolumeToGain(0));
+    TEST_ASSERT_EQUAL_INT16(INT16_MAX / 4, PcmKernels::VolumeToGain(50));
+    TEST_ASSERT_EQUAL_INT16(INT16_MAX, PcmKernels::VolumeToGain(100));
+    TEST_ASSERT_EQUAL_INT16(INT16_MAX, PcmKernels::VolumeToGain(150));
+}
@@ -8,6 +8,7 @@
 #include "font_awesome_symbols.h"
 #include "assets/lang_config.h"
 #include "mcp_server.h"
+#include "local_intents.h"
 
 #include <cstring>
 #include <esp_log.h>
@@ -192,14 +193,14 @@ void Application::ShowActivationCode(const std::string& code, const std::string&
         digit_sound{'9', Lang::Sounds::P3_9}
     }};
 
-    // This sentence uses 9KB of SRAM, so we need to wait for it to finish
+    // The digits are queued on the alert voice, so they play after the activation sentence
     Alert(Lang::Strings::ACTIVATION, message.c_str(), "happy", Lang::Sounds::P3_ACTIVATION);
 
     for (const auto& digit : code) {
         auto it = std::find_if(digit_sounds.begin(), digit_sounds.end(),
             [digit](const digit_sound& ds) { return ds.digit == digit; });
         if (it != digit_sounds.end()) {
-            audio_service_.PlaySound(it->sound);
+            audio_service_.PlaySound(it->sound, kAudioVoiceAlert);
         }
     }
 }
@@ -211,7 +212,7 @@ void Application::Alert(const char* status, const char* message, const char* emo
     display->SetEmotion(emotion);
     display->SetChatMessage("system", message);
     if (!sound.empty()) {
-        audio_service_.PlaySound(sound);
+        audio_service_.PlaySound(sound, kAudioVoiceAlert);
     }
 }
 
@@ -336,6 +337,28 @@ void Application::Start() {
     audio_service_.Initialize(codec);
     audio_service_.Start();
 
+#if CONFIG_USE_CUSTOM_WAKE_WORD
+    /* Bind the local commands to MCP tools, they work without the network */
+    LocalIntents::GetInstance().Initialize();
+#endif
+
+#if CONFIG_AUDIO_SOUND_CACHE_SIZE > 0
+    /* Decode the frequently played sounds into the sound cache in the background */
+    std::string_view warmup_list = CONFIG_AUDIO_SOUND_CACHE_WARMUP;
+    while (!warmup_list.empty()) {
+        size_t end = warmup_list.find(' ');
+        auto name = warmup_list.substr(0, end);
+        if (!name.empty()) {
+            auto sound = Lang::Sounds::Find(name);
+            if (sound.empty()) {
+                ESP_LOGW(TAG, "Unknown sound in the cache warm-up list: %.*s", (int)name.size(), name.data());
+            }
+            audio_service_.CacheSound(sound);
+        }
+        warmup_list = end == std::string_view::npos ? std::string_view() : warmup_list.substr(end + 1);
+    }
+#endif
+
     AudioServiceCallbacks callbacks;
     callbacks.on_send_queue_available = [this]() {
         xEventGroupSetBits(event_group_, MAIN_EVENT_SEND_AUDIO);
@@ -376,17 +399,24 @@ void Application::Start() {
         protocol_ = std::make_unique<MqttProtocol>();
     }
 
+    protocol_->SetPacketPool(&audio_service_.packet_pool());
     protocol_->OnNetworkError([this](const std::string& message) {
         last_error_message_ = message;
         xEventGroupSetBits(event_group_, MAIN_EVENT_ERROR);
     });
     protocol_->OnIncomingAudio([this](std::unique_ptr<AudioStreamPacket> packet) {
-        if (device_state_ == kDeviceStateSpeaking) {
+        // After a barge-in, the rest of the aborted turn is dropped until the next tts start
+        if (device_state_ == kDeviceStateSpeaking && !aborted_) {
             audio_service_.PushPacketToDecodeQueue(std::move(packet));
+        } else {
+            audio_service_.RecyclePacket(std::move(packet));
         }
     });
+    protocol_->SetPreferredFrameDuration(CONFIG_AUDIO_UPLINK_FRAME_DURATION);
     protocol_->OnAudioChannelOpened([this, codec, &board]() {
         board.SetPowerSaveMode(false);
+        audio_service_.SetFrameDuration(protocol_->uplink_frame_duration());
+        audio_service_.WarmUpDecoder(protocol_->server_sample_rate(), protocol_->server_frame_duration());
         if (protocol_->server_sample_rate() != codec->output_sample_rate()) {
             ESP_LOGW(TAG, "Server sample rate %d does not match device output sample rate %d, resampling may cause distortion",
                 protocol_->server_sample_rate(), codec->output_sample_rate());
@@ -394,6 +424,10 @@ void Application::Start() {
     });
     protocol_->OnAudioChannelClosed([this, &board]() {
         board.SetPowerSaveMode(true);
+#if CONFIG_AUDIO_LATENCY_COMPARISON
+        // Request the next frame duration (20 -> 40 -> 60 -> 20 ms) in the next session, to compare their latency
+        protocol_->SetPreferredFrameDuration(protocol_->preferred_frame_duration() % 60 + 20);
+#endif
         Schedule([this]() {
             auto display = Board::GetInstance().GetDisplay();
             display->SetChatMessage("system", "");
@@ -406,8 +440,11 @@ void Application::Start() {
         if (strcmp(type->valuestring, "tts") == 0) {
             auto state = cJSON_GetObjectItem(root, "state");
             if (strcmp(state->valuestring, "start") == 0) {
+                // Cleared here, not in the main task, so the first packets of the new turn are kept
+                aborted_ = false;
                 Schedule([this]() {
-                    aborted_ = false;
+                    // Power up the speaker while the first packets are still on their way
+                    audio_service_.PrepareOutput();
                     if (device_state_ == kDeviceStateIdle || device_state_ == kDeviceStateListening) {
                         SetDeviceState(kDeviceStateSpeaking);
                     }
@@ -423,6 +460,8 @@ void Application::Start() {
                     }
                 });
             } else if (strcmp(state->valuestring, "sentence_start") == 0) {
+                // Before the sentence's audio is queued, so the gap in front of it is not counted as an underrun
+                audio_service_.MarkSpeechPause();
                 auto text = cJSON_GetObjectItem(root, "text");
                 if (cJSON_IsString(text)) {
                     ESP_LOGI(TAG, "<< %s", text->valuestring);
@@ -520,6 +559,9 @@ void Application::OnClockTimer() {
         // SystemInfo::PrintTaskCpuUsage(pdMS_TO_TICKS(1000));
         // SystemInfo::PrintTaskList();
         SystemInfo::PrintHeapStats();
+#if CONFIG_AUDIO_DEBUG_STATISTICS
+        audio_service_.PrintDebugStatistics();
+#endif
     }
 }
 
@@ -552,7 +594,12 @@ void Application::MainEventLoop() {
 
         if (bits & MAIN_EVENT_SEND_AUDIO) {
             while (auto packet = audio_service_.PopPacketFromSendQueue()) {
-                if (!protocol_->SendAudio(std::move(packet))) {
+                bool sent = protocol_->SendAudio(*packet);
+                if (sent) {
+                    audio_service_.latency_tracer().TraceSent(*packet, esp_timer_get_time());
+                }
+                audio_service_.RecyclePacket(std::move(packet));
+                if (!sent) {
                     break;
                 }
             }
@@ -586,8 +633,7 @@ void Application::OnWakeWordDetected() {
     }
 
     if (device_state_ == kDeviceStateIdle) {
-        audio_service_.EncodeWakeWord();
-
+        // The wake word data is already being encoded, since the detection, while the channel opens
         if (!protocol_->IsAudioChannelOpened()) {
             SetDeviceState(kDeviceStateConnecting);
             if (!protocol_->OpenAudioChannel()) {
@@ -599,9 +645,16 @@ void Application::OnWakeWordDetected() {
         auto wake_word = audio_service_.GetLastWakeWord();
         ESP_LOGI(TAG, "Wake word detected: %s", wake_word.c_str());
 #if CONFIG_USE_AFE_WAKE_WORD || CONFIG_USE_CUSTOM_WAKE_WORD
-        // Encode and send the wake word data to the server
+        // Send the wake word data to the server, each packet as soon as it is encoded
+        bool first_packet = true;
         while (auto packet = audio_service_.PopWakeWordPacket()) {
-            protocol_->SendAudio(std::move(packet));
+            protocol_->SendAudio(*packet);
+            audio_service_.RecyclePacket(std::move(packet));
+            if (first_packet) {
+                first_packet = false;
+                audio_service_.latency_tracer().Record(kLatencyStageWakeToFirstUplink,
+                    audio_service_.last_wake_word_time_us(), esp_timer_get_time());
+            }
         }
         // Set the chat state to wake word detected
         protocol_->SendWakeWordDetected(wake_word);
@@ -621,6 +674,9 @@ void Application::OnWakeWordDetected() {
 void Application::AbortSpeaking(AbortReason reason) {
     ESP_LOGI(TAG, "Abort speaking");
     aborted_ = true;
+    // Silence the speaker locally, without waiting for the server to stop the stream
+    int64_t trigger_time = reason == kAbortReasonWakeWordDetected ? audio_service_.last_wake_word_time_us() : 0;
+    audio_service_.AbortPlayback(trigger_time);
     protocol_->SendAbortSpeaking(reason);
 }
 
@@ -742,6 +798,16 @@ void Application::SendMcpMessage(const std::string& payload) {
     });
 }
 
+void Application::SendMcpNotification(const std::string& payload) {
+    Schedule([this, payload]() {
+        if (protocol_ && protocol_->IsConnected()) {
+            protocol_->SendMcpMessage(payload);
+        } else {
+            ESP_LOGI(TAG, "Not connected, MCP notification dropped");
+        }
+    });
+}
+
 void Application::SetAecMode(AecMode mode) {
     aec_mode_ = mode;
     Schedule([this]() {
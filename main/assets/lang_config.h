@@ -37,6 +37,7 @@ namespace Lang {
         constexpr const char* NEW_VERSION = "新版本 ";
         constexpr const char* OTA_UPGRADE = "OTA 升级";
         constexpr const char* PIN_ERROR = "请插入 SIM 卡";
+        constexpr const char* RECORDING = "录音中";
         constexpr const char* REGISTERING_NETWORK = "等待网络...";
         constexpr const char* REG_ERROR = "无法接入网络，请检查流量卡状态";
         constexpr const char* RTC_MODE_OFF = "AEC 关闭";
@@ -207,5 +208,31 @@ namespace Lang {
         static_cast<const char*>(p3_wificonfig_start),
         static_cast<size_t>(p3_wificonfig_end - p3_wificonfig_start)
         };
+
+        // 按文件名（不含 .p3）查找音效，未找到时返回空
+        static inline std::string_view Find(std::string_view name) {
+            if (name == "0") return P3_0;
+            if (name == "1") return P3_1;
+            if (name == "2") return P3_2;
+            if (name == "3") return P3_3;
+            if (name == "4") return P3_4;
+            if (name == "5") return P3_5;
+            if (name == "6") return P3_6;
+            if (name == "7") return P3_7;
+            if (name == "8") return P3_8;
+            if (name == "9") return P3_9;
+            if (name == "activation") return P3_ACTIVATION;
+            if (name == "err_pin") return P3_ERR_PIN;
+            if (name == "err_reg") return P3_ERR_REG;
+            if (name == "exclamation") return P3_EXCLAMATION;
+            if (name == "low_battery") return P3_LOW_BATTERY;
+            if (name == "popup") return P3_POPUP;
+            if (name == "success") return P3_SUCCESS;
+            if (name == "upgrade") return P3_UPGRADE;
+            if (name == "vibration") return P3_VIBRATION;
+            if (name == "welcome") return P3_WELCOME;
+            if (name == "wificonfig") return P3_WIFICONFIG;
+            return {};
+        }
     }
 }
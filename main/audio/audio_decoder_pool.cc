@@ -0,0 +1,100 @@
+#include "audio_decoder_pool.h"
+
+#include <esp_log.h>
+
+#define TAG "AudioDecoderPool"
+
+
+AudioDecoderPool::AudioDecoderPool(size_t size)
+    : slots_(new AudioDecoderSlot[size > 0 ? size : 1]), size_(size > 0 ? size : 1) {
+}
+
+void AudioDecoderPool::Initialize(int output_sample_rate, int sample_rate, int frame_duration) {
+    output_sample_rate_ = output_sample_rate;
+    Select(sample_rate, frame_duration);
+}
+
+AudioDecoderSlot* AudioDecoderPool::Find(int sample_rate, int frame_duration) {
+    for (size_t i = 0; i < size_; i++) {
+        auto& slot = slots_[i];
+        if (slot.decoder && slot.decoder->sample_rate() == sample_rate && slot.decoder->duration_ms() == frame_duration) {
+            return &slot;
+        }
+    }
+    return nullptr;
+}
+
+AudioDecoderSlot* AudioDecoderPool::Create(int sample_rate, int frame_duration) {
+    /* A free slot, or else the least recently used one that is not current */
+    AudioDecoderSlot* victim = nullptr;
+    for (size_t i = 0; i < size_; i++) {
+        auto& slot = slots_[i];
+        if (!slot.decoder) {
+            victim = &slot;
+            break;
+        }
+        if (&slot != current_ && (victim == nullptr || slot.last_used < victim->last_used)) {
+            victim = &slot;
+        }
+    }
+    if (victim == nullptr) {
+        // A pool of one: the current decoder is replaced, as before the pool
+        victim = current_;
+    }
+
+    if (victim->decoder) {
+        ESP_LOGI(TAG, "Replacing the %d Hz / %d ms decoder", victim->decoder->sample_rate(), victim->decoder->duration_ms());
+        victim->decoder.reset();
+        evictions_++;
+        if (victim == current_) {
+            current_ = nullptr;
+        }
+    }
+    victim->decoder = std::make_unique<OpusSpanDecoder>(sample_rate, 1, frame_duration);
+    if (sample_rate != output_sample_rate_) {
+        victim->resampler.Configure(sample_rate, output_sample_rate_);
+    }
+    victim->last_used = clock_;
+    creations_++;
+    ESP_LOGI(TAG, "Created a %d Hz / %d ms decoder%s", sample_rate, frame_duration,
+        sample_rate != output_sample_rate_ ? ", resampled to the output rate" : "");
+    return victim;
+}
+
+void AudioDecoderPool::Select(int sample_rate, int frame_duration) {
+    if (current_ != nullptr && current_->decoder->sample_rate() == sample_rate && current_->decoder->duration_ms() == frame_duration) {
+        return;
+    }
+
+    auto slot = Find(sample_rate, frame_duration);
+    if (slot != nullptr) {
+        switches_++;
+    } else {
+        slot = Create(sample_rate, frame_duration);
+    }
+    slot->last_used = ++clock_;
+    current_ = slot;
+    frame_duration_ = frame_duration;
+}
+
+void AudioDecoderPool::WarmUp(int sample_rate, int frame_duration) {
+    // With one slot, the current decoder would be replaced
+    if (size_ > 1 && Find(sample_rate, frame_duration) == nullptr) {
+        Create(sample_rate, frame_duration);
+    }
+}
+
+void AudioDecoderPool::ResetState() {
+    for (size_t i = 0; i < size_; i++) {
+        auto& slot = slots_[i];
+        if (slot.decoder) {
+            slot.decoder->ResetState();
+            slot.resampler.Reset();
+        }
+    }
+}
+
+void AudioDecoderPool::PrintStatistics() const {
+    ESP_LOGI(TAG, "decoders: %lu format switches to a warm decoder, %lu created, %lu replaced (%u slots)",
+        switches_.load(), creations_.load(), evictions_.load(), size_);
+}
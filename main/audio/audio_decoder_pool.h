@@ -0,0 +1,63 @@
+#ifndef AUDIO_DECODER_POOL_H
+#define AUDIO_DECODER_POOL_H
+
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#include "opus_span_decoder.h"
+#include "audio_resampler.h"
+
+// A warm decoder for one stream format, with its resampler to the output rate
+struct AudioDecoderSlot {
+    std::unique_ptr<OpusSpanDecoder> decoder;   // nullptr while the slot is free
+    AudioResampler resampler;                   // Only configured when the format rate differs from the output rate
+    uint32_t last_used = 0;
+};
+
+/*
+ * Opus decoders for the speech voice, keyed by sample rate and frame duration.
+ *
+ * Every format keeps its own decoder and resampler with their state, so a stream that switches
+ * format (16 kHz audio test playback between 24 kHz server speech, a server that changes its frame
+ * duration) only changes the current slot. The decoder used to be destroyed and created again, and
+ * the resampler reconfigured, at every switch. When all slots are used, the least recently used one
+ * (never the current one) is replaced.
+ *
+ * Select / WarmUp / ResetState / current are for the decode task only (Initialize runs before it
+ * starts), frame_duration() and PrintStatistics() may be called from any task.
+ */
+class AudioDecoderPool {
+public:
+    explicit AudioDecoderPool(size_t size);
+
+    // Creates the first decoder and makes it current
+    void Initialize(int output_sample_rate, int sample_rate, int frame_duration);
+    // Makes the decoder of the format current, creating it if it is not in the pool
+    void Select(int sample_rate, int frame_duration);
+    // Creates the decoder of the format ahead of its first packet, the current decoder stays (needs 2 slots)
+    void WarmUp(int sample_rate, int frame_duration);
+    inline AudioDecoderSlot& current() { return *current_; }
+    // Clears the state of every decoder and resampler, for a new stream
+    void ResetState();
+
+    inline int frame_duration() const { return frame_duration_; }
+    void PrintStatistics() const;
+
+private:
+    std::unique_ptr<AudioDecoderSlot[]> slots_;
+    size_t size_;
+    AudioDecoderSlot* current_ = nullptr;
+    int output_sample_rate_ = 0;
+    uint32_t clock_ = 0;
+    std::atomic<int> frame_duration_{0};
+    std::atomic<uint32_t> switches_{0};     // Format changes to a decoder that was already in the pool
+    std::atomic<uint32_t> creations_{0};    // Including the first decoder of every format
+    std::atomic<uint32_t> evictions_{0};    // Decoders replaced by another format
+
+    AudioDecoderSlot* Find(int sample_rate, int frame_duration);
+    AudioDecoderSlot* Create(int sample_rate, int frame_duration);
+};
+
+#endif // AUDIO_DECODER_POOL_H
@@ -0,0 +1,213 @@
+#include "audio_jitter_buffer.h"
+#include "sdkconfig.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "AudioJitterBuffer"
+
+// Conceal at most this many frames in a row, then skip to the next packet we have
+#define JITTER_BUFFER_MAX_CONCEALED_FRAMES 3
+// Frames of clean playback before one step of underrun boost is removed again
+#define JITTER_BUFFER_DECAY_FRAMES 250
+#define JITTER_BUFFER_DEFAULT_FRAME_US 60000
+
+
+AudioJitterBuffer::AudioJitterBuffer(size_t capacity, std::function<void(std::unique_ptr<AudioStreamPacket>&&)> release)
+    : slots_(capacity), release_(release) {
+    frame_us_ = JITTER_BUFFER_DEFAULT_FRAME_US;
+    stats_.target_depth = TargetDepth();
+}
+
+uint32_t AudioJitterBuffer::TargetDepth() const {
+    int min_depth = std::max(1, (CONFIG_AUDIO_JITTER_BUFFER_MIN_MS * 1000 + frame_us_ - 1) / frame_us_);
+    int max_depth = std::max(min_depth, CONFIG_AUDIO_JITTER_BUFFER_MAX_MS * 1000 / frame_us_);
+    max_depth = std::min(max_depth, (int)capacity());
+    // Cover twice the mean deviation, plus whatever the underruns taught us
+    int depth = min_depth + (int)((2 * (int64_t)jitter_us_ + frame_us_ - 1) / frame_us_) + underrun_boost_;
+    return std::clamp(depth, 1, max_depth);
+}
+
+void AudioJitterBuffer::StartStream(uint32_t sequence) {
+    has_stream_ = true;
+    playing_ = false;
+    next_sequence_ = sequence;
+    highest_sequence_ = sequence;
+    has_transit_ = false;
+    concealed_in_row_ = 0;
+}
+
+void AudioJitterBuffer::DropAll() {
+    for (auto& slot : slots_) {
+        if (slot) {
+            release_(std::move(slot));
+        }
+    }
+    size_.store(0, std::memory_order_relaxed);
+}
+
+void AudioJitterBuffer::Reset() {
+    DropAll();
+    has_stream_ = false;
+    playing_ = false;
+    underrun_pending_ = false;
+    pause_expected_ = false;
+}
+
+void AudioJitterBuffer::MarkPause() {
+    /* The buffer may already have run dry waiting for this sentence, or run dry before it starts */
+    underrun_pending_ = false;
+    pause_expected_ = true;
+}
+
+uint32_t AudioJitterBuffer::LowestSequence() const {
+    uint32_t lowest = next_sequence_;
+    int32_t lowest_distance = INT32_MAX;
+    for (auto& slot : slots_) {
+        if (slot) {
+            int32_t distance = (int32_t)(slot->sequence - next_sequence_);
+            if (distance < lowest_distance) {
+                lowest_distance = distance;
+                lowest = slot->sequence;
+            }
+        }
+    }
+    return lowest;
+}
+
+void AudioJitterBuffer::Put(std::unique_ptr<AudioStreamPacket>&& packet, int64_t now_us) {
+    stats_.received++;
+    if (packet->frame_duration > 0) {
+        frame_us_ = packet->frame_duration * 1000;
+    }
+
+    if (packet->sequence == 0) {
+        // No sequence from the transport, number the packet in arrival order
+        packet->sequence = has_stream_ ? highest_sequence_ + 1 : 1;
+    }
+    uint32_t sequence = packet->sequence;
+
+    if (!has_stream_) {
+        StartStream(sequence);
+    } else {
+        int32_t ahead = (int32_t)(sequence - next_sequence_);
+        bool idle = Size() == 0 && !playing_;
+        if (ahead < 0 && (-ahead <= (int32_t)capacity() || !idle)) {
+            stats_.late++;
+            release_(std::move(packet));
+            return;
+        }
+        if (ahead >= (int32_t)capacity() && !idle) {
+            stats_.overflow++;
+            release_(std::move(packet));
+            return;
+        }
+        if (ahead < 0 || ahead >= (int32_t)capacity()) {
+            ESP_LOGI(TAG, "Sequence jumped from %lu to %lu, restarting stream", next_sequence_, sequence);
+            stats_.resyncs++;
+            underrun_pending_ = false;
+            StartStream(sequence);
+        }
+    }
+
+    /* An underrun is only real if the stream continues right where it ran dry */
+    pause_expected_ = false;
+    if (underrun_pending_) {
+        underrun_pending_ = false;
+        if (sequence == next_sequence_ && now_us - underrun_time_us_ < (int64_t)TargetDepth() * frame_us_ * 4) {
+            stats_.underruns++;
+            underrun_boost_ = std::min(underrun_boost_ + 1, (int)capacity());
+            clean_frames_ = 0;
+        }
+    }
+
+    /* Interarrival jitter (RFC 3550), only lateness counts so bursts of early packets do not inflate it */
+    if ((int32_t)(sequence - highest_sequence_) > 0 || !has_transit_) {
+        int64_t transit = now_us - (int64_t)sequence * frame_us_;
+        if (has_transit_) {
+            int64_t d = std::max<int64_t>(transit - last_transit_us_, 0);
+            jitter_us_ += (int32_t)(d - jitter_us_) / 16;
+        }
+        last_transit_us_ = transit;
+        has_transit_ = true;
+        stats_.jitter_us = jitter_us_;
+    }
+
+    if ((int32_t)(sequence - highest_sequence_) > 0) {
+        highest_sequence_ = sequence;
+    } else if (sequence != highest_sequence_) {
+        stats_.reordered++;
+    }
+
+    auto& slot = slots_[sequence % capacity()];
+    if (slot) {
+        // Duplicate, or a stale packet from a window we already left
+        stats_.late++;
+        release_(std::move(slot));
+        size_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    if (!playing_ && Size() == 0) {
+        prefill_start_us_ = now_us;
+    }
+    slot = std::move(packet);
+    size_.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool AudioJitterBuffer::PopNext(std::unique_ptr<AudioStreamPacket>& packet) {
+    auto& slot = slots_[next_sequence_ % capacity()];
+    if (!slot || slot->sequence != next_sequence_) {
+        return false;
+    }
+    packet = std::move(slot);
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    next_sequence_++;
+    return true;
+}
+
+JitterBufferResult AudioJitterBuffer::Get(std::unique_ptr<AudioStreamPacket>& packet, int64_t now_us, int64_t& wait_us) {
+    wait_us = -1;
+    if (Size() == 0) {
+        if (playing_) {
+            playing_ = false;
+            underrun_pending_ = !pause_expected_;
+            underrun_time_us_ = now_us;
+        }
+        return kJitterBufferWait;
+    }
+
+    if (!playing_) {
+        uint32_t target_depth = TargetDepth();
+        int64_t target_us = (int64_t)target_depth * frame_us_;
+        int64_t waited_us = now_us - prefill_start_us_;
+        if (Size() < target_depth && waited_us < target_us) {
+            wait_us = target_us - waited_us;
+            return kJitterBufferWait;
+        }
+        playing_ = true;
+        stats_.target_depth = target_depth;
+        // A hole in front of the first packet is not worth concealing
+        next_sequence_ = LowestSequence();
+        concealed_in_row_ = 0;
+    }
+
+    if (!PopNext(packet)) {
+        if (concealed_in_row_ < JITTER_BUFFER_MAX_CONCEALED_FRAMES) {
+            concealed_in_row_++;
+            next_sequence_++;
+            stats_.concealed++;
+            clean_frames_ = 0;
+            return kJitterBufferConceal;
+        }
+        uint32_t lowest = LowestSequence();
+        stats_.skipped += lowest - next_sequence_;
+        next_sequence_ = lowest;
+        PopNext(packet);
+    }
+
+    concealed_in_row_ = 0;
+    if (++clean_frames_ >= JITTER_BUFFER_DECAY_FRAMES && underrun_boost_ > 0) {
+        underrun_boost_--;
+        clean_frames_ = 0;
+    }
+    return kJitterBufferPacket;
+}
@@ -0,0 +1,92 @@
+#ifndef AUDIO_JITTER_BUFFER_H
+#define AUDIO_JITTER_BUFFER_H
+
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+
+#include "protocol.h"
+
+enum JitterBufferResult {
+    kJitterBufferWait,      // Nothing to play yet, wait for more packets (or until wait_us passes)
+    kJitterBufferPacket,    // The next packet in sequence is returned
+    kJitterBufferConceal,   // The next packet is missing, the caller should conceal one frame (Opus PLC)
+};
+
+struct JitterBufferStats {
+    uint32_t received = 0;
+    uint32_t reordered = 0;         // Arrived after a packet with a higher sequence, but still in time
+    uint32_t late = 0;              // Arrived after its playout time, dropped
+    uint32_t overflow = 0;          // Too far ahead of the playout position, dropped
+    uint32_t concealed = 0;         // Frames replaced by packet loss concealment
+    uint32_t skipped = 0;           // Missing frames skipped after too many concealed frames in a row
+    uint32_t underruns = 0;         // The buffer ran dry in the middle of a stream
+    uint32_t resyncs = 0;           // The sequence jumped, a new stream was started
+    uint32_t jitter_us = 0;         // Interarrival jitter estimate (RFC 3550)
+    uint32_t target_depth = 0;      // Current prefill depth in frames
+};
+
+/*
+ * Downlink jitter buffer, sitting between the decode queue and the Opus decoder.
+ *
+ * Packets are reordered by AudioStreamPacket::sequence. Packets without a sequence (WebSocket,
+ * local sounds) are numbered in arrival order, so they only get the adaptive prefill.
+ *
+ * The buffer starts in the prefill state and begins playing when target_depth frames are buffered,
+ * or when the oldest packet has waited for target_depth frames, whichever is first. The target depth
+ * follows the measured interarrival jitter and is raised after every underrun, then slowly lowered
+ * again while playback is clean. The gap in front of a TTS sentence is a pause of the server, not an
+ * underrun: MarkPause() is called at every sentence start and excuses the dry-out around it.
+ *
+ * Only the decode task may call Put / Get / Reset / MarkPause. Size() may be read from any task.
+ */
+class AudioJitterBuffer {
+public:
+    AudioJitterBuffer(size_t capacity, std::function<void(std::unique_ptr<AudioStreamPacket>&&)> release);
+
+    inline size_t capacity() const { return slots_.size(); }
+    inline size_t Size() const { return size_.load(std::memory_order_relaxed); }
+    inline const JitterBufferStats& stats() const { return stats_; }
+
+    // Takes ownership of the packet, rejected packets are handed to the release callback
+    void Put(std::unique_ptr<AudioStreamPacket>&& packet, int64_t now_us);
+    // wait_us is set when kJitterBufferWait is returned, -1 means wait for the next packet
+    JitterBufferResult Get(std::unique_ptr<AudioStreamPacket>& packet, int64_t now_us, int64_t& wait_us);
+    void Reset();
+    // The stream pauses here on purpose (a sentence boundary), its dry-out does not count as an underrun
+    void MarkPause();
+
+private:
+    std::vector<std::unique_ptr<AudioStreamPacket>> slots_;
+    std::function<void(std::unique_ptr<AudioStreamPacket>&&)> release_;
+    std::atomic<size_t> size_{0};
+    JitterBufferStats stats_;
+
+    bool has_stream_ = false;
+    bool playing_ = false;
+    uint32_t next_sequence_ = 0;        // Sequence of the next frame to play
+    uint32_t highest_sequence_ = 0;     // Highest sequence received in this stream
+    int frame_us_ = 0;
+    int64_t prefill_start_us_ = 0;      // Arrival of the first packet of the current prefill
+    int concealed_in_row_ = 0;
+
+    // Jitter estimation
+    int64_t last_transit_us_ = 0;
+    bool has_transit_ = false;
+    uint32_t jitter_us_ = 0;
+    int underrun_boost_ = 0;
+    bool underrun_pending_ = false;
+    bool pause_expected_ = false;       // MarkPause() was called and no packet has arrived since
+    int64_t underrun_time_us_ = 0;
+    uint32_t clean_frames_ = 0;
+
+    void StartStream(uint32_t sequence);
+    void DropAll();
+    bool PopNext(std::unique_ptr<AudioStreamPacket>& packet);
+    uint32_t LowestSequence() const;
+    uint32_t TargetDepth() const;
+};
+
+#endif // AUDIO_JITTER_BUFFER_H
@@ -0,0 +1,185 @@
+#include "audio_latency_tracer.h"
+
+#include <esp_log.h>
+
+#define TAG "AudioLatencyTracer"
+
+static const char* const kStageNames[kLatencyStageCount] = {
+    "capture_to_processed",
+    "processed_to_encoded",
+    "encoded_to_sent",
+    "total",
+    "received_to_decoded",
+    "decoded_to_played",
+    "total",
+    "abort_to_silence",
+    "wake_to_first_uplink",
+    "command_to_action",
+};
+
+// Stages are grouped by where they are measured, the groups are the top level keys of GetJson()
+static const char* const kGroupNames[] = {
+    "uplink",
+    "downlink",
+    "barge_in",
+    "wake_word",
+    "local_command",
+};
+static constexpr int kGroupCount = sizeof(kGroupNames) / sizeof(kGroupNames[0]);
+
+static int StageGroup(int stage) {
+    if (stage < kLatencyStageReceivedToDecoded) {
+        return 0;
+    }
+    if (stage < kLatencyStageAbortToSilence) {
+        return 1;
+    }
+    if (stage < kLatencyStageWakeToFirstUplink) {
+        return 2;
+    }
+    return stage < kLatencyStageCommandToAction ? 3 : 4;
+}
+
+
+void LatencyHistogram::Add(uint32_t ms) {
+    int bin;
+    if (ms < LATENCY_HISTOGRAM_LINEAR_MS) {
+        bin = ms;
+    } else {
+        int exponent = 31 - __builtin_clz(ms);  // >= 4
+        int sub = (ms >> (exponent - 3)) & (LATENCY_HISTOGRAM_SUB_BINS - 1);
+        bin = LATENCY_HISTOGRAM_LINEAR_MS + (exponent - 4) * LATENCY_HISTOGRAM_SUB_BINS + sub;
+        if (bin >= LATENCY_HISTOGRAM_BINS) {
+            bin = LATENCY_HISTOGRAM_BINS - 1;
+        }
+    }
+    bins[bin]++;
+    count++;
+    if (ms > max_ms) {
+        max_ms = ms;
+    }
+}
+
+uint32_t LatencyHistogram::Percentile(int percent) const {
+    if (count == 0) {
+        return 0;
+    }
+    uint32_t rank = ((uint64_t)count * percent + 99) / 100;
+    uint32_t seen = 0;
+    for (int bin = 0; bin < LATENCY_HISTOGRAM_BINS; bin++) {
+        seen += bins[bin];
+        if (seen < rank) {
+            continue;
+        }
+        if (bin < LATENCY_HISTOGRAM_LINEAR_MS) {
+            return bin;
+        }
+        int exponent = 4 + (bin - LATENCY_HISTOGRAM_LINEAR_MS) / LATENCY_HISTOGRAM_SUB_BINS;
+        int sub = (bin - LATENCY_HISTOGRAM_LINEAR_MS) % LATENCY_HISTOGRAM_SUB_BINS;
+        uint32_t width = 1 << (exponent - 3);
+        uint32_t middle = (LATENCY_HISTOGRAM_SUB_BINS + sub) * width + width / 2;
+        return middle < max_ms ? middle : max_ms;
+    }
+    return max_ms;
+}
+
+void AudioLatencyTracer::Record(AudioLatencyStage stage, int64_t from_us, int64_t to_us) {
+    if (from_us <= 0 || to_us < from_us) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    histograms_[stage].Add((to_us - from_us) / 1000);
+}
+
+void AudioLatencyTracer::TraceSent(const AudioStreamPacket& packet, int64_t now_us) {
+    Record(kLatencyStageEncodedToSent, packet.encoded_time_us, now_us);
+    Record(kLatencyStageUplinkTotal, packet.origin_time_us, now_us);
+}
+
+void AudioLatencyTracer::MarkCaptured(size_t samples, int64_t time_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    captured_samples_ += samples;
+    capture_marks_[capture_head_ % kCaptureMarks] = {captured_samples_, time_us};
+    capture_head_++;
+    if (capture_head_ - capture_tail_ > kCaptureMarks) {
+        capture_tail_ = capture_head_ - kCaptureMarks;
+    }
+}
+
+int64_t AudioLatencyTracer::MatchCaptured(size_t samples, int64_t* first_sample_time_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t first_sample = processed_samples_ + 1;
+    processed_samples_ += samples;
+    if (first_sample_time_us != nullptr) {
+        *first_sample_time_us = 0;
+        for (size_t i = capture_tail_; i < capture_head_; i++) {
+            auto& mark = capture_marks_[i % kCaptureMarks];
+            if (mark.end_sample >= first_sample) {
+                // The frame was read when its last sample arrived, the samples before it arrived in real time
+                *first_sample_time_us = mark.time_us - (int64_t)(mark.end_sample - first_sample) * 1000000 / 16000;
+                break;
+            }
+        }
+    }
+    while (capture_tail_ < capture_head_) {
+        auto& mark = capture_marks_[capture_tail_ % kCaptureMarks];
+        if (mark.end_sample >= processed_samples_) {
+            return mark.time_us;
+        }
+        capture_tail_++;
+    }
+    return 0;
+}
+
+void AudioLatencyTracer::ResetCapture() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capture_head_ = 0;
+    capture_tail_ = 0;
+    captured_samples_ = 0;
+    processed_samples_ = 0;
+}
+
+void AudioLatencyTracer::Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& histogram : histograms_) {
+        histogram = LatencyHistogram();
+    }
+}
+
+void AudioLatencyTracer::PrintStatistics() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int stage = 0; stage < kLatencyStageCount; stage++) {
+        auto& histogram = histograms_[stage];
+        if (histogram.count == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%s %s: frames=%lu p50=%lums p95=%lums p99=%lums max=%lums",
+            kGroupNames[StageGroup(stage)], kStageNames[stage], histogram.count,
+            histogram.Percentile(50), histogram.Percentile(95), histogram.Percentile(99), histogram.max_ms);
+    }
+}
+
+cJSON* AudioLatencyTracer::GetJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto root = cJSON_CreateObject();
+    cJSON* groups[kGroupCount];
+    for (int group = 0; group < kGroupCount; group++) {
+        groups[group] = cJSON_CreateObject();
+    }
+    for (int stage = 0; stage < kLatencyStageCount; stage++) {
+        auto& histogram = histograms_[stage];
+        if (histogram.count == 0) {
+            continue;
+        }
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "p50", histogram.Percentile(50));
+        cJSON_AddNumberToObject(item, "p95", histogram.Percentile(95));
+        cJSON_AddNumberToObject(item, "p99", histogram.Percentile(99));
+        cJSON_AddNumberToObject(item, "frames", histogram.count);
+        cJSON_AddItemToObject(groups[StageGroup(stage)], kStageNames[stage], item);
+    }
+    for (int group = 0; group < kGroupCount; group++) {
+        cJSON_AddItemToObject(root, kGroupNames[group], groups[group]);
+    }
+    return root;
+}
@@ -0,0 +1,92 @@
+#ifndef AUDIO_LATENCY_TRACER_H
+#define AUDIO_LATENCY_TRACER_H
+
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+#include <cJSON.h>
+
+#include "protocol.h"
+
+enum AudioLatencyStage {
+    // Uplink, the frame is stamped when its last sample is read from the codec
+    kLatencyStageCaptureToProcessed,    // Audio processor (AFE) buffering and processing
+    kLatencyStageProcessedToEncoded,    // Encode queue and Opus encoder
+    kLatencyStageEncodedToSent,         // Send queue until Protocol::SendAudio returns
+    kLatencyStageUplinkTotal,           // Microphone to wire
+    // Downlink, the packet is stamped when the protocol receives it
+    kLatencyStageReceivedToDecoded,     // Decode queue, jitter buffer and Opus decoder
+    kLatencyStageDecodedToPlayed,       // Playback queue, mixer and I2S write, until AudioCodec::OutputData returns
+    kLatencyStageDownlinkTotal,         // Wire to speaker, until AudioCodec::OutputData returns
+    // Barge-in, one sample per abort
+    kLatencyStageAbortToSilence,        // Wake word detected (or abort requested) until the speaker is silent
+    // Wake word, one sample per detection
+    kLatencyStageWakeToFirstUplink,     // Wake word detected until its first packet is sent
+    // Local command, one sample per command
+    kLatencyStageCommandToAction,       // Local command recognized until its MCP tool returns
+    kLatencyStageCount,
+};
+
+// 1ms bins below 16ms, then 8 bins per power of two up to 4s (at most 12.5% error)
+#define LATENCY_HISTOGRAM_LINEAR_MS 16
+#define LATENCY_HISTOGRAM_SUB_BINS 8
+#define LATENCY_HISTOGRAM_BINS (LATENCY_HISTOGRAM_LINEAR_MS + 8 * LATENCY_HISTOGRAM_SUB_BINS)
+
+struct LatencyHistogram {
+    uint32_t bins[LATENCY_HISTOGRAM_BINS] = {};
+    uint32_t count = 0;
+    uint32_t max_ms = 0;
+
+    void Add(uint32_t ms);
+    // percent in 1-100, the result is the middle of the bin it falls in
+    uint32_t Percentile(int percent) const;
+};
+
+/*
+ * Per-frame latency tracing from microphone to wire and from wire to speaker.
+ *
+ * Frames carry their stamps in AudioTask / AudioStreamPacket (origin_time_us, processed_time_us,
+ * encoded_time_us). Each stage adds the time between two stamps to its histogram, frames without a
+ * stamp (local sounds, concealed frames, the wake word data) are not counted.
+ *
+ * The audio processor buffers its input, so its output frames are matched to the capture time by
+ * sample count: MarkCaptured() is called for every frame fed to the processor, and MatchCaptured()
+ * returns when the last sample of an output frame was read.
+ *
+ * All methods may be called from any task.
+ */
+class AudioLatencyTracer {
+public:
+    void Record(AudioLatencyStage stage, int64_t from_us, int64_t to_us);
+    void TraceSent(const AudioStreamPacket& packet, int64_t now_us);
+
+    void MarkCaptured(size_t samples, int64_t time_us);
+    // first_sample_time_us (optional) is set to when the first sample of the frame was captured,
+    // from its place in the 16 kHz frame it was read with (0 if it is too old)
+    int64_t MatchCaptured(size_t samples, int64_t* first_sample_time_us = nullptr);
+    void ResetCapture();
+
+    void Reset();
+    void PrintStatistics();
+    // {"uplink": {"capture_to_processed": {"p50": 12, "p95": 20, "p99": 31}, ...}, "downlink": {...}, "barge_in": {...},
+    //  "wake_word": {...}, "local_command": {"command_to_action": {...}}}, in ms
+    cJSON* GetJson();
+
+private:
+    struct CaptureMark {
+        uint64_t end_sample;
+        int64_t time_us;
+    };
+    static constexpr size_t kCaptureMarks = 16;
+
+    std::mutex mutex_;
+    LatencyHistogram histograms_[kLatencyStageCount];
+    CaptureMark capture_marks_[kCaptureMarks];
+    size_t capture_head_ = 0;
+    size_t capture_tail_ = 0;
+    uint64_t captured_samples_ = 0;
+    uint64_t processed_samples_ = 0;
+};
+
+#endif // AUDIO_LATENCY_TRACER_H
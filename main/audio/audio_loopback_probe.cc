@@ -0,0 +1,118 @@
+#include "audio_loopback_probe.h"
+
+#include <cmath>
+
+#define PROBE_START_HZ 500.0f
+#define PROBE_END_HZ 4000.0f
+#define PROBE_AMPLITUDE 8192.0f
+
+// The coarse search runs at 8 kHz on scaled down samples, so a 100 ms sum of products fits in 32 bits
+#define COARSE_MIC_SHIFT 4
+#define COARSE_PROBE_SHIFT 4
+#define REFINE_LAGS 2
+
+
+void AudioLoopbackProbe::Generate(int sample_rate, std::vector<int16_t>& probe) {
+    int samples = sample_rate * LOOPBACK_PROBE_MS / 1000;
+    float duration = LOOPBACK_PROBE_MS / 1000.0f;
+    float sweep = (PROBE_END_HZ - PROBE_START_HZ) / (2 * duration);
+    probe.resize(samples);
+    for (int i = 0; i < samples; i++) {
+        float t = (float)i / sample_rate;
+        float phase = 2 * (float)M_PI * (PROBE_START_HZ * t + sweep * t * t);
+        float envelope = 0.5f - 0.5f * cosf(2 * (float)M_PI * i / (samples - 1));
+        probe[i] = (int16_t)lrintf(PROBE_AMPLITUDE * envelope * sinf(phase));
+    }
+}
+
+// Pairwise average, scaled down by shift
+static void Decimate(const int16_t* src, size_t samples, int shift, std::vector<int16_t>& dst) {
+    dst.resize(samples / 2);
+    for (size_t i = 0; i < dst.size(); i++) {
+        dst[i] = (int16_t)(((int32_t)src[2 * i] + src[2 * i + 1]) >> (1 + shift));
+    }
+}
+
+// Normalized correlation of the probe with the microphone at one lag, at 16 kHz
+static float Correlate(const int16_t* mic, const std::vector<int16_t>& probe, float probe_energy) {
+    int64_t sum = 0;
+    int64_t energy = 0;
+    for (size_t i = 0; i < probe.size(); i++) {
+        sum += (int32_t)mic[i] * probe[i];
+        energy += (int32_t)mic[i] * mic[i];
+    }
+    if (energy == 0) {
+        return 0;
+    }
+    return (float)sum / sqrtf(probe_energy * (float)energy);
+}
+
+int AudioLoopbackProbe::Find(const int16_t* mic, size_t samples, float& score) {
+    std::vector<int16_t> probe;
+    Generate(16000, probe);
+    size_t length = probe.size();
+    score = 0;
+    if (samples < length) {
+        return -1;
+    }
+
+    /* Coarse: every other lag on the decimated signals, in integers */
+    std::vector<int16_t> coarse_probe;
+    std::vector<int16_t> coarse_mic;
+    Decimate(probe.data(), length, COARSE_PROBE_SHIFT, coarse_probe);
+    Decimate(mic, samples, COARSE_MIC_SHIFT, coarse_mic);
+    size_t coarse_length = coarse_probe.size();
+
+    // Energy of the microphone window, slid along with the lag
+    int64_t window_energy = 0;
+    for (size_t i = 0; i < coarse_length; i++) {
+        window_energy += (int32_t)coarse_mic[i] * coarse_mic[i];
+    }
+
+    int coarse_best = -1;
+    float coarse_score = 0;
+    for (size_t lag = 0; lag + coarse_length <= coarse_mic.size(); lag++) {
+        if (lag > 0) {
+            int32_t in = coarse_mic[lag + coarse_length - 1];
+            int32_t out = coarse_mic[lag - 1];
+            window_energy += in * in - out * out;
+        }
+        if (window_energy <= 0) {
+            continue;
+        }
+        const int16_t* window = coarse_mic.data() + lag;
+        int32_t sum = 0;
+        for (size_t i = 0; i < coarse_length; i++) {
+            sum += (int32_t)window[i] * coarse_probe[i];
+        }
+        if (sum <= 0) {
+            continue;
+        }
+        // Ranked by sum / sqrt(energy), compared squared
+        float correlation = (float)sum * sum / (float)window_energy;
+        if (correlation > coarse_score) {
+            coarse_score = correlation;
+            coarse_best = lag;
+        }
+    }
+    if (coarse_best < 0) {
+        return -1;
+    }
+
+    /* Fine: the lags around the coarse peak at 16 kHz */
+    float probe_energy = 0;
+    for (size_t i = 0; i < length; i++) {
+        probe_energy += (float)probe[i] * probe[i];
+    }
+    int best = -1;
+    int first = 2 * coarse_best - REFINE_LAGS;
+    int last = 2 * coarse_best + REFINE_LAGS;
+    for (int lag = first < 0 ? 0 : first; lag <= last && lag + length <= samples; lag++) {
+        float correlation = Correlate(mic + lag, probe, probe_energy);
+        if (correlation > score) {
+            score = correlation;
+            best = lag;
+        }
+    }
+    return best;
+}
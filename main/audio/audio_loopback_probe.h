@@ -0,0 +1,28 @@
+#ifndef AUDIO_LOOPBACK_PROBE_H
+#define AUDIO_LOOPBACK_PROBE_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#define LOOPBACK_PROBE_MS 100
+#define LOOPBACK_PROBE_MIN_SCORE 0.3f   // Normalized correlation, below it the probe was not heard
+
+/*
+ * Test signal for the loopback delay calibration: a 100 ms linear chirp from 500 Hz to 4 kHz with
+ * a Hann envelope, about -12 dBFS. A chirp has a single sharp correlation peak and stays below the
+ * 8 kHz limit of the 16 kHz microphone path, so it can be generated at the output rate and found
+ * in the microphone signal at 16 kHz.
+ *
+ * Find() searches the whole buffer in two passes: every lag at 8 kHz with 32-bit integer sums,
+ * then the lags around the best one at 16 kHz. Keep the buffer to the lags that can hold the probe,
+ * the cost grows with its length (about 2.7 M multiply-adds for 420 ms of lags).
+ */
+class AudioLoopbackProbe {
+public:
+    static void Generate(int sample_rate, std::vector<int16_t>& probe);
+    // Returns the microphone sample where the probe starts, with its normalized correlation in score (-1 if too short)
+    static int Find(const int16_t* mic, size_t samples, float& score);
+};
+
+#endif // AUDIO_LOOPBACK_PROBE_H
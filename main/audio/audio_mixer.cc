@@ -0,0 +1,162 @@
+#include "audio_mixer.h"
+#include "audio_service.h"
+#include "pcm_kernels.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <cstring>
+
+#define TAG "AudioMixer"
+
+
+static inline int16_t VolumeToLinearGain(int volume) {
+    volume = std::clamp(volume, 0, 100);
+    return volume * 32767 / 100;
+}
+
+AudioMixer::AudioMixer(std::function<void(AudioVoice, std::unique_ptr<AudioTask>&&)> release)
+    : release_(release) {
+}
+
+AudioMixer::~AudioMixer() {
+}
+
+void AudioMixer::SetQueue(AudioVoice voice, Queue* queue) {
+    voices_[voice].queue = queue;
+}
+
+void AudioMixer::OnFrameStart(std::function<void(AudioVoice, const AudioTask&, size_t offset)> callback) {
+    frame_start_ = callback;
+}
+
+void AudioMixer::SetVoiceVolume(AudioVoice voice, int volume) {
+    voices_[voice].gain = VolumeToLinearGain(volume);
+}
+
+void AudioMixer::SetDuckVolume(int volume) {
+    duck_gain_ = VolumeToLinearGain(volume);
+}
+
+void AudioMixer::Reset(AudioVoice voice) {
+    voices_[voice].reset = true;
+}
+
+void AudioMixer::FadeOut(AudioVoice voice) {
+    voices_[voice].fade = true;
+}
+
+bool AudioMixer::HasData() {
+    for (auto& voice : voices_) {
+        if (voice.reset || voice.fade) {
+            return true;    // Let Mix() drop the frame
+        }
+        if (voice.current || (voice.queue != nullptr && !voice.queue->Empty())) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void AudioMixer::ArmWakeup() {
+    for (auto& voice : voices_) {
+        if (voice.queue != nullptr) {
+            voice.queue->ArmConsumerWakeup();
+        }
+    }
+}
+
+size_t AudioMixer::MixVoice(AudioVoice index, int16_t* out, size_t samples, int16_t gain_from, int16_t gain_to) {
+    auto& voice = voices_[index];
+    if (voice.reset.exchange(false) && voice.current) {
+        auto task = std::move(voice.current);
+        release_(index, std::move(task));
+    }
+    if (voice.queue == nullptr) {
+        return 0;
+    }
+
+    size_t mixed = 0;
+    while (mixed < samples) {
+        if (!voice.current) {
+            if (!voice.queue->Pop(voice.current)) {
+                break;
+            }
+            voice.offset = 0;
+            if (frame_start_) {
+                frame_start_(index, *voice.current, mixed);
+            }
+            // The first frame of a sound is stamped with the PlaySound() time
+            if (index != kAudioVoiceTts && voice.current->origin_time_us > 0) {
+                uint32_t start_us = esp_timer_get_time() - voice.current->origin_time_us;
+                stats_.effect_starts++;
+                stats_.effect_start_total_us += start_us;
+                stats_.effect_start_max_us = std::max(stats_.effect_start_max_us, start_us);
+            }
+        }
+
+        auto& pcm = voice.current->pcm;
+        size_t count = std::min(samples - mixed, pcm.size() - voice.offset);
+        const int16_t* src = pcm.data() + voice.offset;
+        if (gain_from == gain_to) {
+            PcmKernels::Mix(out + mixed, src, count, gain_to);
+        } else {
+            // Linear gain ramp over the whole period
+            int32_t delta = gain_to - gain_from;
+            for (size_t i = 0; i < count; i++) {
+                int32_t gain = gain_from + delta * (int32_t)(mixed + i) / (int32_t)samples;
+                int32_t value = out[mixed + i] + (((int32_t)src[i] * gain) >> 15);
+                out[mixed + i] = std::clamp<int32_t>(value, INT16_MIN, INT16_MAX);
+            }
+        }
+        voice.offset += count;
+        mixed += count;
+
+        if (voice.offset >= pcm.size()) {
+            auto task = std::move(voice.current);
+            release_(index, std::move(task));
+        }
+    }
+    return mixed;
+}
+
+bool AudioMixer::Mix(int16_t* out, size_t samples) {
+    memset(out, 0, samples * sizeof(int16_t));
+
+    /* Effects first, they decide whether the speech is ducked in this period */
+    bool effect_active = false;
+    for (int voice = kAudioVoiceUi; voice < kAudioVoiceCount; voice++) {
+        int16_t gain = voices_[voice].gain;
+        if (MixVoice((AudioVoice)voice, out, samples, gain, gain) > 0) {
+            effect_active = true;
+        }
+    }
+
+    int16_t duck_target = effect_active ? duck_gain_.load() : 32767;
+    int16_t voice_gain = voices_[kAudioVoiceTts].gain;
+    int16_t gain_from = ((int32_t)voice_gain * speech_gain_) >> 15;
+    int16_t gain_to = ((int32_t)voice_gain * duck_target) >> 15;
+    // A fade out ramps the speech to zero over this period, then drops what is left of the frame
+    bool fading = voices_[kAudioVoiceTts].fade.exchange(false);
+    if (fading) {
+        gain_to = 0;
+    }
+    size_t speech = MixVoice(kAudioVoiceTts, out, samples, gain_from, gain_to);
+    if (fading) {
+        auto& voice = voices_[kAudioVoiceTts];
+        if (voice.current) {
+            auto task = std::move(voice.current);
+            release_(kAudioVoiceTts, std::move(task));
+        }
+    }
+    // Without speech the duck gain can jump, there is nothing to click
+    speech_gain_ = duck_target;
+
+    if (!effect_active && speech == 0) {
+        return false;
+    }
+    stats_.periods++;
+    if (effect_active && speech > 0) {
+        stats_.ducked_periods++;
+    }
+    return true;
+}
@@ -0,0 +1,85 @@
+#ifndef AUDIO_MIXER_H
+#define AUDIO_MIXER_H
+
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+#include "audio_ring_buffer.h"
+
+struct AudioTask;
+
+enum AudioVoice {
+    kAudioVoiceTts,     // Server speech (and the audio test playback), ducked while an effect plays
+    kAudioVoiceUi,      // Short UI effects: wake up, success, ...
+    kAudioVoiceAlert,   // Alerts and spoken prompts: errors, activation code, ...
+    kAudioVoiceCount,
+};
+
+struct AudioMixerStats {
+    uint32_t periods = 0;               // Periods written to the codec
+    uint32_t ducked_periods = 0;        // Periods where speech was ducked under an effect
+    uint32_t effect_starts = 0;
+    uint64_t effect_start_total_us = 0; // PlaySound() until the first sample is mixed
+    uint32_t effect_start_max_us = 0;
+};
+
+/*
+ * Playback mixer, run by the audio output task one codec DMA period at a time.
+ *
+ * Each voice reads decoded frames (at the codec output rate) from its own queue, so a UI sound
+ * starts at the next period no matter how much speech is queued. Voices are summed with their
+ * own gain and saturated. While an effect voice is playing, the speech voice is ducked; the duck
+ * gain is ramped over one period so it does not click.
+ *
+ * Mix / HasData / ArmWakeup are for the output task only. The gains, Reset() and FadeOut() may be used from any task.
+ */
+class AudioMixer {
+public:
+    typedef AudioRingBuffer<std::unique_ptr<AudioTask>> Queue;
+
+    // Finished frames are handed to the release callback
+    explicit AudioMixer(std::function<void(AudioVoice, std::unique_ptr<AudioTask>&&)> release);
+    ~AudioMixer();
+
+    void SetQueue(AudioVoice voice, Queue* queue);
+    // Called when a frame starts to be mixed, offset samples into the period
+    void OnFrameStart(std::function<void(AudioVoice, const AudioTask&, size_t offset)> callback);
+    // 0-100, linear
+    void SetVoiceVolume(AudioVoice voice, int volume);
+    void SetDuckVolume(int volume);
+    // Drops the frame the voice is playing, the caller flushes its queue
+    void Reset(AudioVoice voice);
+    // Like Reset(), but the frame is faded out over the next period first
+    void FadeOut(AudioVoice voice);
+    bool IsFading(AudioVoice voice) const { return voices_[voice].fade; }
+    inline const AudioMixerStats& stats() const { return stats_; }
+
+    bool HasData();
+    void ArmWakeup();
+    // Mixes the next period into out, silence where no voice has audio. Returns false if nothing was mixed.
+    bool Mix(int16_t* out, size_t samples);
+
+private:
+    struct Voice {
+        Queue* queue = nullptr;
+        std::unique_ptr<AudioTask> current;
+        size_t offset = 0;
+        std::atomic<int16_t> gain{32767};
+        std::atomic<bool> reset{false};
+        std::atomic<bool> fade{false};
+    };
+
+    std::function<void(AudioVoice, std::unique_ptr<AudioTask>&&)> release_;
+    std::function<void(AudioVoice, const AudioTask&, size_t)> frame_start_;
+    Voice voices_[kAudioVoiceCount];
+    std::atomic<int16_t> duck_gain_{32767};
+    int16_t speech_gain_ = 32767;      // Duck gain applied at the end of the last period
+    AudioMixerStats stats_;
+
+    size_t MixVoice(AudioVoice voice, int16_t* out, size_t samples, int16_t gain_from, int16_t gain_to);
+};
+
+#endif // AUDIO_MIXER_H
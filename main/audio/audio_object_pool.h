@@ -0,0 +1,111 @@
+#ifndef AUDIO_OBJECT_POOL_H
+#define AUDIO_OBJECT_POOL_H
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Counters of one pool, read by AudioService::PrintDebugStatistics() to size the pools per board.
+ */
+struct AudioPoolStats {
+    uint32_t acquire_count = 0;
+    uint32_t release_count = 0;
+    uint32_t exhausted_count = 0;     // Acquire() found the pool empty and fell back to the heap
+    uint32_t overflow_count = 0;      // Release() found the pool full and freed the object
+    uint32_t high_water = 0;          // Max number of pooled objects in use at the same time
+};
+
+/*
+ * Fixed-capacity pool of preallocated objects.
+ *
+ * All objects are created once in Initialize(), and the prepare callback reserves their buffers
+ * (payload / pcm), so an object taken from the pool and given back with Release() keeps its storage
+ * and no heap allocation happens in steady state.
+ *
+ * The pool never fails: when it is exhausted Acquire() creates a plain heap object and counts it.
+ * Objects must come back through Release(), also when a queue is flushed (AudioRingBuffer::OnDiscard),
+ * otherwise they are freed and lost to the pool. Heap objects that are released later refill the pool
+ * up to its capacity.
+ */
+template <typename T>
+class AudioObjectPool {
+public:
+    AudioObjectPool() = default;
+    AudioObjectPool(const AudioObjectPool&) = delete;
+    AudioObjectPool& operator=(const AudioObjectPool&) = delete;
+
+    void Initialize(size_t capacity, std::function<void(T&)> prepare = nullptr) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        capacity_ = capacity;
+        free_.clear();
+        free_.reserve(capacity);
+        for (size_t i = 0; i < capacity; i++) {
+            auto object = std::make_unique<T>();
+            if (prepare) {
+                prepare(*object);
+            }
+            free_.push_back(std::move(object));
+        }
+        min_free_ = capacity;
+    }
+
+    inline size_t capacity() const { return capacity_; }
+
+    size_t Available() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return free_.size();
+    }
+
+    AudioPoolStats GetStats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        AudioPoolStats stats = stats_;
+        stats.high_water = capacity_ - min_free_;
+        return stats;
+    }
+
+    std::unique_ptr<T> Acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stats_.acquire_count++;
+            if (!free_.empty()) {
+                auto object = std::move(free_.back());
+                free_.pop_back();
+                if (free_.size() < min_free_) {
+                    min_free_ = free_.size();
+                }
+                return object;
+            }
+            stats_.exhausted_count++;
+            min_free_ = 0;
+        }
+        return std::make_unique<T>();
+    }
+
+    void Release(std::unique_ptr<T>&& object) {
+        if (!object) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        stats_.release_count++;
+        if (free_.size() < capacity_) {
+            free_.push_back(std::move(object));
+            return;
+        }
+        stats_.overflow_count++;
+        lock.unlock();
+        object.reset();
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<T>> free_;
+    size_t capacity_ = 0;
+    size_t min_free_ = 0;
+    AudioPoolStats stats_;
+};
+
+#endif // AUDIO_OBJECT_POOL_H
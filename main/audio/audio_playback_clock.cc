@@ -0,0 +1,83 @@
+#include "audio_playback_clock.h"
+
+#include <algorithm>
+
+
+void AudioPlaybackClock::Initialize(int sample_rate, size_t dma_depth_samples) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sample_rate_ = sample_rate;
+    dma_depth_us_ = (int64_t)dma_depth_samples * 1000000 / sample_rate;
+}
+
+void AudioPlaybackClock::MarkFrame(uint64_t position, uint32_t timestamp, size_t samples) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    frames_[frame_count_ % kFrames] = {position, timestamp, (uint32_t)samples};
+    frame_count_++;
+}
+
+void AudioPlaybackClock::OnWritten(size_t samples, int64_t start_us, int64_t end_us) {
+    int64_t duration_us = (int64_t)samples * 1000000 / sample_rate_;
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t end_time_us;
+    if (end_us - start_us >= duration_us / 8) {
+        /* The write waited for a free DMA buffer, so the DMA is full again and this period plays last */
+        end_time_us = end_us + dma_depth_us_;
+    } else {
+        /* After the audio still queued, or after an underrun, from the next DMA period (half a period on average) */
+        end_time_us = std::max(queued_end_us_, end_us + duration_us / 2) + duration_us;
+        end_time_us = std::min(end_time_us, end_us + dma_depth_us_);
+    }
+    write_position_ += samples;
+    spans_[span_count_ % kSpans] = {write_position_, end_time_us, (uint32_t)samples};
+    span_count_++;
+    queued_end_us_ = end_time_us;
+}
+
+int64_t AudioPlaybackClock::PositionAtLocked(int64_t time_us) const {
+    size_t count = std::min(span_count_, kSpans);
+    for (size_t i = 1; i <= count; i++) {
+        auto& span = spans_[(span_count_ - i) % kSpans];
+        if (time_us > span.end_time_us) {
+            // After the newest span, or in an underrun gap
+            return -1;
+        }
+        int64_t start_time_us = span.end_time_us - (int64_t)(span.samples - 1) * 1000000 / sample_rate_;
+        if (time_us >= start_time_us) {
+            return span.end_position - (span.end_time_us - time_us) * sample_rate_ / 1000000 - 1;
+        }
+    }
+    return -1;
+}
+
+int64_t AudioPlaybackClock::PositionAt(int64_t time_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return PositionAtLocked(time_us);
+}
+
+int64_t AudioPlaybackClock::TimeOfPosition(uint64_t position) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t count = std::min(span_count_, kSpans);
+    for (size_t i = 1; i <= count; i++) {
+        auto& span = spans_[(span_count_ - i) % kSpans];
+        if (position < span.end_position && position + span.samples >= span.end_position) {
+            return span.end_time_us - (int64_t)(span.end_position - 1 - position) * 1000000 / sample_rate_;
+        }
+    }
+    return 0;
+}
+
+uint32_t AudioPlaybackClock::ServerTimestampAt(int64_t time_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t position = PositionAtLocked(time_us);
+    if (position < 0) {
+        return 0;
+    }
+    size_t count = std::min(frame_count_, kFrames);
+    for (size_t i = 1; i <= count; i++) {
+        auto& frame = frames_[(frame_count_ - i) % kFrames];
+        if ((uint64_t)position >= frame.position && (uint64_t)position < frame.position + frame.samples) {
+            return frame.timestamp + (uint32_t)(((uint64_t)position - frame.position) * 1000 / sample_rate_);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef AUDIO_PLAYBACK_CLOCK_H
+#define AUDIO_PLAYBACK_CLOCK_H
+
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Sample clock of the audio written to the codec, for the server AEC reference.
+ *
+ * Every period written by the output task is a span of output sample positions. The clock keeps
+ * when each recent span plays: a write that blocked found the DMA full, so its last sample plays
+ * one DMA depth after the write returns; a write that did not block follows the audio queued
+ * before it, or starts within one period after an underrun. Each speech frame is marked with its
+ * first position and its server timestamp, so ServerTimestampAt() gives the server timestamp of
+ * the sample that was playing at any recent time.
+ *
+ * The positions are exact, the times are not: a write is seen to block only when it takes longer
+ * than an eighth of a period, and a free DMA buffer is found at the next scheduling of the output
+ * task, so a time can be off by up to one DMA period (AUDIO_CODEC_DMA_FRAME_NUM samples). Times
+ * taken after an underrun are the least accurate.
+ *
+ * OnWritten() / MarkFrame() are for the output task, the lookups may be called from any task.
+ */
+class AudioPlaybackClock {
+public:
+    void Initialize(int sample_rate, size_t dma_depth_samples);
+
+    // The first sample of the next period, a frame that starts offset samples into it is marked with its position
+    inline uint64_t write_position() const { return write_position_; }
+    void MarkFrame(uint64_t position, uint32_t timestamp, size_t samples);
+    // A period of samples was written, OutputData() ran from start_us to end_us
+    void OnWritten(size_t samples, int64_t start_us, int64_t end_us);
+
+    // The position playing at time_us, -1 if nothing was playing
+    int64_t PositionAt(int64_t time_us);
+    // When the sample at position played, 0 if it is not in the recent history
+    int64_t TimeOfPosition(uint64_t position);
+    // Server timestamp (ms) of the speech playing at time_us, 0 if no speech was playing
+    uint32_t ServerTimestampAt(int64_t time_us);
+
+private:
+    struct Span {
+        uint64_t end_position;      // One past the last sample
+        int64_t end_time_us;        // When the last sample has played
+        uint32_t samples;
+    };
+    struct Frame {
+        uint64_t position;
+        uint32_t timestamp;
+        uint32_t samples;
+    };
+    // About 1.3 s of 10 ms periods, and 2 s of 60 ms frames
+    static constexpr size_t kSpans = 128;
+    static constexpr size_t kFrames = 32;
+
+    std::mutex mutex_;
+    int sample_rate_ = 16000;
+    int64_t dma_depth_us_ = 0;
+    uint64_t write_position_ = 0;
+    int64_t queued_end_us_ = 0;     // When the audio written so far has played
+    Span spans_[kSpans];
+    size_t span_count_ = 0;         // Total, the ring holds the last kSpans
+    Frame frames_[kFrames];
+    size_t frame_count_ = 0;
+
+    int64_t PositionAtLocked(int64_t time_us) const;
+};
+
+#endif // AUDIO_PLAYBACK_CLOCK_H
@@ -0,0 +1,77 @@
+#include "audio_preroll_buffer.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "AudioPrerollBuffer"
+
+
+AudioPrerollBuffer::~AudioPrerollBuffer() {
+    heap_caps_free(buffer_);
+}
+
+bool AudioPrerollBuffer::Initialize(size_t capacity_samples, size_t max_frame_samples) {
+    if (buffer_ != nullptr) {
+        return true;
+    }
+    max_frame_ = std::min(max_frame_samples, capacity_samples);
+    size_t bytes = (capacity_samples + max_frame_) * sizeof(int16_t);
+    buffer_ = (int16_t*)heap_caps_malloc_prefer(bytes, 2, MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT);
+    if (buffer_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes", bytes);
+        return false;
+    }
+    capacity_ = capacity_samples;
+    return true;
+}
+
+void AudioPrerollBuffer::Write(const int16_t* data, size_t samples) {
+    if (buffer_ == nullptr) {
+        return;
+    }
+    uint64_t position = write_position_.load(std::memory_order_relaxed);
+    /* Only the last capacity_ samples would survive */
+    if (samples > capacity_) {
+        position += samples - capacity_;
+        data += samples - capacity_;
+        samples = capacity_;
+    }
+    overwrite_position_.store(position + samples, std::memory_order_release);
+    while (samples > 0) {
+        size_t offset = position % capacity_;
+        size_t count = std::min(samples, capacity_ - offset);
+        memcpy(buffer_ + offset, data, count * sizeof(int16_t));
+        if (offset < max_frame_) {
+            size_t mirrored = std::min(count, max_frame_ - offset);
+            memcpy(buffer_ + capacity_ + offset, data, mirrored * sizeof(int16_t));
+        }
+        position += count;
+        data += count;
+        samples -= count;
+    }
+    write_position_.store(position, std::memory_order_release);
+}
+
+void AudioPrerollBuffer::Clear() {
+    clear_position_.store(write_position_.load(std::memory_order_relaxed), std::memory_order_release);
+}
+
+uint64_t AudioPrerollBuffer::begin() const {
+    uint64_t end = write_position_.load(std::memory_order_acquire);
+    uint64_t begin = end > capacity_ ? end - capacity_ : 0;
+    return std::max(begin, clear_position_.load(std::memory_order_acquire));
+}
+
+const int16_t* AudioPrerollBuffer::Peek(uint64_t position, size_t samples) const {
+    if (buffer_ == nullptr || samples > max_frame_ || position < begin() || position + samples > end()) {
+        return nullptr;
+    }
+    return buffer_ + position % capacity_;
+}
+
+bool AudioPrerollBuffer::IsValid(uint64_t position) const {
+    uint64_t overwritten = overwrite_position_.load(std::memory_order_acquire);
+    return overwritten <= capacity_ || position >= overwritten - capacity_;
+}
@@ -0,0 +1,49 @@
+#ifndef AUDIO_PREROLL_BUFFER_H
+#define AUDIO_PREROLL_BUFFER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Fixed ring of the most recent PCM samples, allocated once (in PSRAM when there is some).
+ *
+ * Positions are absolute sample counts, they keep growing across Clear(), so a reader can tell which part of the audio
+ * is still there. The first max_frame samples of the ring are mirrored past its end, so any frame of
+ * up to max_frame samples can be read in place with Peek(), even where it wraps around.
+ *
+ * Write / Clear are for one writer task. Peek / IsValid may be called from another task: the writer
+ * does not wait for readers, so a reader checks IsValid() after using a frame, in case the writer
+ * has overwritten it meanwhile.
+ */
+class AudioPrerollBuffer {
+public:
+    AudioPrerollBuffer() = default;
+    ~AudioPrerollBuffer();
+    AudioPrerollBuffer(const AudioPrerollBuffer&) = delete;
+    AudioPrerollBuffer& operator=(const AudioPrerollBuffer&) = delete;
+
+    bool Initialize(size_t capacity_samples, size_t max_frame_samples);
+    inline size_t capacity() const { return capacity_; }
+
+    void Write(const int16_t* data, size_t samples);
+    void Clear();
+
+    // The stored audio is [begin(), end())
+    uint64_t begin() const;
+    inline uint64_t end() const { return write_position_.load(std::memory_order_acquire); }
+    // Points into the ring, nullptr if the samples are not (or no longer) stored, or samples > max_frame
+    const int16_t* Peek(uint64_t position, size_t samples) const;
+    // Whether the samples from position on have not been overwritten yet
+    bool IsValid(uint64_t position) const;
+
+private:
+    int16_t* buffer_ = nullptr;     // capacity_ + max_frame_ samples, the tail mirrors the head
+    size_t capacity_ = 0;
+    size_t max_frame_ = 0;
+    std::atomic<uint64_t> write_position_{0};
+    std::atomic<uint64_t> overwrite_position_{0};   // Set before the samples are copied, for IsValid()
+    std::atomic<uint64_t> clear_position_{0};       // Nothing before it is returned
+};
+
+#endif // AUDIO_PREROLL_BUFFER_H
@@ -0,0 +1,207 @@
+#include "audio_recorder.h"
+#include "protocol.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "AudioRecorder"
+
+
+static const char* const kTapNames[kAudioTapCount] = {
+    "microphone",
+    "reference",
+    "processed",
+};
+
+const char* AudioTapName(AudioTap tap) {
+    return tap >= 0 && tap < kAudioTapCount ? kTapNames[tap] : "unknown";
+}
+
+bool ParseAudioTap(const std::string& name, AudioTap& tap) {
+    for (int i = 0; i < kAudioTapCount; i++) {
+        if (name == kTapNames[i]) {
+            tap = (AudioTap)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+AudioRecording::~AudioRecording() {
+    heap_caps_free(data);
+}
+
+std::string AudioRecording::FileHeader() const {
+    if (format != kAudioRecordFormatPcm) {
+        return std::string();
+    }
+    auto put16 = [](std::string& s, uint16_t v) {
+        s.push_back(v & 0xFF);
+        s.push_back(v >> 8);
+    };
+    auto put32 = [](std::string& s, uint32_t v) {
+        for (int i = 0; i < 4; i++) {
+            s.push_back((v >> (i * 8)) & 0xFF);
+        }
+    };
+    std::string header;
+    header.reserve(44);
+    header += "RIFF";
+    put32(header, 36 + size);
+    header += "WAVEfmt ";
+    put32(header, 16);
+    put16(header, 1);                               // PCM
+    put16(header, 1);                               // Mono
+    put32(header, AUDIO_RECORDER_SAMPLE_RATE);
+    put32(header, AUDIO_RECORDER_SAMPLE_RATE * 2);  // Byte rate
+    put16(header, 2);                               // Block align
+    put16(header, 16);
+    header += "data";
+    put32(header, size);
+    return header;
+}
+
+void AudioRecorder::OnOpusFrame(std::function<bool(const std::vector<int16_t>& pcm, uint32_t sequence)> callback) {
+    on_opus_frame_ = callback;
+}
+
+bool AudioRecorder::Start(AudioTap tap, AudioRecordFormat format, int duration_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (recording_) {
+        ESP_LOGW(TAG, "Already recording %s", AudioTapName(recording_->tap));
+        return false;
+    }
+    // The previous recording is only kept by its readers, so two large buffers are not needed at once
+    last_recording_.reset();
+
+    size_t samples = (size_t)duration_ms * AUDIO_RECORDER_SAMPLE_RATE / 1000;
+    size_t bytes;
+    if (format == kAudioRecordFormatOpus) {
+        size_t frames = (samples + AUDIO_RECORDER_FRAME_SAMPLES - 1) / AUDIO_RECORDER_FRAME_SAMPLES;
+        samples = frames * AUDIO_RECORDER_FRAME_SAMPLES;
+        bytes = frames * (sizeof(BinaryProtocol3) + AUDIO_RECORDER_OPUS_FRAME_BYTES);
+    } else {
+        bytes = samples * sizeof(int16_t);
+    }
+    auto recording = std::make_shared<AudioRecording>(tap, format);
+    recording->data = (uint8_t*)heap_caps_malloc_prefer(bytes, 2, MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT);
+    if (recording->data == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes for %d ms", bytes, duration_ms);
+        return false;
+    }
+    recording->capacity = bytes;
+    recording->start_time_us = esp_timer_get_time();
+
+    recording_ = recording;
+    sequence_++;
+    opus_frame_.clear();
+    opus_frame_.reserve(format == kAudioRecordFormatOpus ? AUDIO_RECORDER_FRAME_SAMPLES : 0);
+    fed_samples_ = 0;
+    target_samples_ = samples;
+    pending_frames_ = 0;
+    tap_ = tap;
+    ESP_LOGI(TAG, "Recording %s as %s for %d ms, %u bytes", AudioTapName(tap),
+        format == kAudioRecordFormatOpus ? "Opus" : "PCM", duration_ms, bytes);
+    return true;
+}
+
+std::shared_ptr<const AudioRecording> AudioRecorder::Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!recording_) {
+        return nullptr;
+    }
+    Finish("stopped");
+    return last_recording_;
+}
+
+std::shared_ptr<const AudioRecording> AudioRecorder::last_recording() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return last_recording_;
+}
+
+void AudioRecorder::Feed(AudioTap tap, const int16_t* data, size_t frames, size_t channels, size_t channel) {
+    if (!IsRecording(tap)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!recording_ || !IsRecording(tap)) {
+        return;
+    }
+    auto& recording = *recording_;
+    data += channel;
+    while (frames > 0 && fed_samples_ < target_samples_) {
+        size_t count = std::min(frames, target_samples_ - fed_samples_);
+        if (recording.format == kAudioRecordFormatPcm) {
+            auto output = (int16_t*)(recording.data + recording.size);
+            for (size_t i = 0; i < count; i++) {
+                output[i] = data[i * channels];
+            }
+            recording.size += count * sizeof(int16_t);
+            recording.samples += count;
+        } else {
+            count = std::min(count, AUDIO_RECORDER_FRAME_SAMPLES - opus_frame_.size());
+            for (size_t i = 0; i < count; i++) {
+                opus_frame_.push_back(data[i * channels]);
+            }
+            if (opus_frame_.size() == AUDIO_RECORDER_FRAME_SAMPLES) {
+                if (on_opus_frame_ && on_opus_frame_(opus_frame_, sequence_)) {
+                    pending_frames_++;
+                } else {
+                    recording.dropped_frames++;
+                }
+                opus_frame_.clear();
+            }
+        }
+        fed_samples_ += count;
+        data += count * channels;
+        frames -= count;
+    }
+
+    if (fed_samples_ >= target_samples_) {
+        /* Take no more input, an Opus recording is finished by its last packet */
+        tap_ = -1;
+        if (recording.format == kAudioRecordFormatPcm || pending_frames_ == 0) {
+            Finish("complete");
+        }
+    }
+}
+
+bool AudioRecorder::WriteOpus(const std::vector<uint8_t>& opus, uint32_t sequence) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!recording_ || sequence != sequence_) {
+        return false;
+    }
+    auto& recording = *recording_;
+    pending_frames_--;
+    if (recording.size + sizeof(BinaryProtocol3) + opus.size() > recording.capacity) {
+        Finish("buffer full");
+        return false;
+    }
+    auto p3 = (BinaryProtocol3*)(recording.data + recording.size);
+    p3->type = 0;
+    p3->reserved = 0;
+    p3->payload_size = htons(opus.size());
+    memcpy(p3->payload, opus.data(), opus.size());
+    recording.size += sizeof(BinaryProtocol3) + opus.size();
+    recording.samples += AUDIO_RECORDER_FRAME_SAMPLES;
+
+    if (!IsRecording() && pending_frames_ == 0) {
+        Finish("complete");
+        return false;
+    }
+    return true;
+}
+
+void AudioRecorder::Finish(const char* reason) {
+    tap_ = -1;
+    auto& recording = *recording_;
+    ESP_LOGI(TAG, "Recording %s: %s, %lu ms, %u bytes, %lu frames dropped", reason, AudioTapName(recording.tap),
+        recording.duration_ms(), recording.size, recording.dropped_frames);
+    last_recording_ = std::move(recording_);
+    opus_frame_.clear();
+    pending_frames_ = 0;
+}
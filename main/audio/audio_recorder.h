@@ -0,0 +1,104 @@
+#ifndef AUDIO_RECORDER_H
+#define AUDIO_RECORDER_H
+
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+// Points of the uplink pipeline that can be recorded, all 16 kHz mono
+enum AudioTap {
+    kAudioTapMicrophone,    // First input channel, resampled to 16 kHz, before the audio processor
+    kAudioTapReference,     // Second input channel (the playback reference), on codecs that have one
+    kAudioTapProcessed,     // Audio processor (AFE) output, what is encoded for the server
+    kAudioTapCount,
+};
+
+enum AudioRecordFormat {
+    kAudioRecordFormatPcm,      // 16-bit samples, little endian
+    kAudioRecordFormatOpus,     // P3 stream of 60 ms Opus frames, like the local sounds
+};
+
+const char* AudioTapName(AudioTap tap);
+bool ParseAudioTap(const std::string& name, AudioTap& tap);
+
+#define AUDIO_RECORDER_SAMPLE_RATE 16000
+// Opus frames are 60 ms, so a recording plays like a P3 sound
+#define AUDIO_RECORDER_FRAME_SAMPLES 960
+// Bytes reserved per Opus frame (about 40 kbit/s), the recording ends early if the encoder needs more
+#define AUDIO_RECORDER_OPUS_FRAME_BYTES 320
+
+// One recording, in a buffer allocated when it starts (in PSRAM when there is some). It does not change once finished.
+struct AudioRecording {
+    AudioTap tap;
+    AudioRecordFormat format;
+    uint8_t* data = nullptr;
+    size_t capacity = 0;
+    size_t size = 0;                // Bytes written
+    uint32_t samples = 0;           // Samples recorded (and encoded, for Opus)
+    uint32_t dropped_frames = 0;    // Opus frames lost because the encode queue was full
+    int64_t start_time_us = 0;
+
+    AudioRecording(AudioTap tap, AudioRecordFormat format) : tap(tap), format(format) {}
+    ~AudioRecording();
+    AudioRecording(const AudioRecording&) = delete;
+    AudioRecording& operator=(const AudioRecording&) = delete;
+
+    inline uint32_t duration_ms() const { return samples * 1000ULL / AUDIO_RECORDER_SAMPLE_RATE; }
+    inline std::string_view view() const { return std::string_view((const char*)data, size); }
+    // 44-byte WAV header for a PCM recording, empty for Opus (a P3 stream has no header)
+    std::string FileHeader() const;
+};
+
+/*
+ * Records one tap of the uplink into a preallocated buffer, for field diagnostics (e.g. a minute of
+ * cabin noise) and the BOOT button audio test.
+ *
+ * The taps feed their audio with Feed() where it passes anyway; only the tap being recorded copies
+ * anything. PCM is stored as it comes. For Opus, 60 ms frames are handed to the OnOpusFrame()
+ * callback to be encoded elsewhere (the encode task), and the packets come back with WriteOpus().
+ * The recording ends at its duration, when the buffer is full, or with Stop(). A finished recording
+ * is shared and read-only, so it can be played or uploaded while the next one starts.
+ *
+ * All methods may be called from any task, Feed() of a tap from one task at a time.
+ */
+class AudioRecorder {
+public:
+    // Returns false if the frame was dropped, the packet is written back with the recording's sequence number
+    void OnOpusFrame(std::function<bool(const std::vector<int16_t>& pcm, uint32_t sequence)> callback);
+
+    bool Start(AudioTap tap, AudioRecordFormat format, int duration_ms);
+    // Ends the recording and returns it, nullptr if none was running
+    std::shared_ptr<const AudioRecording> Stop();
+    inline bool IsRecording() const { return tap_.load(std::memory_order_relaxed) >= 0; }
+    inline bool IsRecording(AudioTap tap) const { return tap_.load(std::memory_order_relaxed) == tap; }
+    // The last finished recording
+    std::shared_ptr<const AudioRecording> last_recording();
+
+    // channels interleaved channels, the tap is channel `channel`
+    void Feed(AudioTap tap, const int16_t* data, size_t frames, size_t channels = 1, size_t channel = 0);
+    // An encoded frame, returns false once the recording is over (the encoder may be released).
+    // Packets of an earlier recording, still queued when it was stopped, are dropped.
+    bool WriteOpus(const std::vector<uint8_t>& opus, uint32_t sequence);
+
+private:
+    std::mutex mutex_;
+    std::atomic<int> tap_{-1};                      // Tap being fed, -1 when no more input is taken
+    std::shared_ptr<AudioRecording> recording_;     // Running, until its last frame is written
+    std::shared_ptr<const AudioRecording> last_recording_;
+    std::function<bool(const std::vector<int16_t>& pcm, uint32_t sequence)> on_opus_frame_;
+    uint32_t sequence_ = 0;                         // Bumped by every Start()
+    std::vector<int16_t> opus_frame_;
+    size_t fed_samples_ = 0;
+    size_t target_samples_ = 0;
+    size_t pending_frames_ = 0;                     // Opus frames handed out and not written yet
+
+    void Finish(const char* reason);
+};
+
+#endif // AUDIO_RECORDER_H
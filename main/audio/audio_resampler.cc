@@ -0,0 +1,405 @@
+#include "audio_resampler.h"
+#include "sdkconfig.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#ifndef CONFIG_IDF_TARGET_LINUX
+#include <esp_cpu.h>
+#endif
+#include <algorithm>
+#include <functional>
+#include <numeric>
+#include <vector>
+#include <cmath>
+#include <cstring>
+
+#define TAG "AudioResampler"
+
+#define RESAMPLER_MAX_FACTOR 8              // Largest L or M of the polyphase path
+#define RESAMPLER_CHUNK_SAMPLES 240         // Input samples filtered per pass, sizes the history buffer
+#define RESAMPLER_SIMD_ALIGN 16
+#define RESAMPLER_SIMD_BLOCK 8              // 16-bit taps per 128-bit vector
+#define RESAMPLER_BENCHMARK_MS 500
+#define RESAMPLER_BENCHMARK_FRAME_MS 20
+#define RESAMPLER_BENCHMARK_SETTLE_MS 100   // Not analysed, the filters are still filling
+#define RESAMPLER_BENCHMARK_ITERATIONS 5
+
+
+struct ResamplerPreset {
+    const char* name;
+    int zero_crossings;     // Per side, in samples of the lower rate
+    double beta;            // Kaiser window
+    double cutoff;          // -6 dB point, relative to the lower Nyquist frequency
+};
+
+// The cutoff puts the end of the transition band at the lower Nyquist frequency
+static const ResamplerPreset kPresets[] = {
+    { "low", 8, 5.0, 0.80 },
+    { "medium", 16, 7.0, 0.86 },
+    { "high", 32, 9.0, 0.91 },
+};
+
+static inline int16_t Saturate16(int32_t value) {
+    return value > INT16_MAX ? INT16_MAX : (value < INT16_MIN ? INT16_MIN : (int16_t)value);
+}
+
+// Modified Bessel function of the first kind, order 0
+static double BesselI0(double x) {
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 50 && term > 1e-12 * sum; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+#if CONFIG_AUDIO_PCM_KERNELS_SIMD
+/*
+ * ESP32-S3 PIE dot product of blocks * 8 taps, blocks > 0. Both pointers must be 16-byte aligned. The
+ * products are summed in the 40-bit ACCX accumulator, so the whole loop is one asm statement, and the
+ * result is shifted right by 15 (Q15 coefficients) when it is read out. The loop is a plain branch: a
+ * zero-overhead loop would take LBEG / LEND / LCOUNT, which the compiler may be using for the loop
+ * this is inlined into.
+ */
+static inline int32_t SimdDotProduct(const int16_t* x, const int16_t* c, int blocks) {
+    int32_t result;
+    asm volatile(
+        "ee.zero.accx\n"
+        "1:\n"
+        "ee.vld.128.ip q0, %[x], 16\n"
+        "ee.vld.128.ip q1, %[c], 16\n"
+        "addi %[blocks], %[blocks], -1\n"
+        "ee.vmulas.s16.accx q0, q1\n"
+        "bnez %[blocks], 1b\n"
+        "ee.srs.accx %[result], %[shift], 0\n"
+        : [x] "+r"(x), [c] "+r"(c), [blocks] "+r"(blocks), [result] "=&r"(result)
+        : [shift] "r"(15)
+        : "memory");
+    return result;
+}
+#endif
+
+
+AudioResampler::~AudioResampler() {
+    Release();
+}
+
+AudioResamplerQuality AudioResampler::DefaultQuality() {
+#if CONFIG_AUDIO_RESAMPLER_QUALITY_LOW
+    return kAudioResamplerQualityLow;
+#elif CONFIG_AUDIO_RESAMPLER_QUALITY_HIGH
+    return kAudioResamplerQualityHigh;
+#else
+    return kAudioResamplerQualityMedium;
+#endif
+}
+
+void AudioResampler::Release() {
+    heap_caps_free(coefficients_);
+    heap_caps_free(history_);
+    coefficients_ = nullptr;
+    history_ = nullptr;
+    use_fallback_ = false;
+    time_ = 0;
+}
+
+void AudioResampler::Configure(int input_sample_rate, int output_sample_rate, AudioResamplerQuality quality) {
+    Release();
+    input_sample_rate_ = input_sample_rate;
+    output_sample_rate_ = output_sample_rate;
+    if (input_sample_rate <= 0 || output_sample_rate <= 0 || input_sample_rate == output_sample_rate) {
+        return;
+    }
+
+    int divisor = std::gcd(input_sample_rate, output_sample_rate);
+    up_ = output_sample_rate / divisor;
+    down_ = input_sample_rate / divisor;
+    if (up_ > RESAMPLER_MAX_FACTOR || down_ > RESAMPLER_MAX_FACTOR) {
+        ESP_LOGI(TAG, "No polyphase filter for %d -> %d, using OpusResampler", input_sample_rate, output_sample_rate);
+        use_fallback_ = true;
+        fallback_.Configure(input_sample_rate, output_sample_rate);
+        return;
+    }
+
+    /* Prototype lowpass at the upsampled rate L * input, cut off below the lower Nyquist frequency */
+    const auto& preset = kPresets[quality];
+    int factor = std::max(up_, down_);
+    taps_ = (2 * preset.zero_crossings * factor + up_ - 1) / up_;
+    int length = taps_ * up_;
+    double cutoff = preset.cutoff * 0.5 / factor;   // Cycles per upsampled sample
+    double center = (length - 1) / 2.0;
+    std::vector<double> prototype(length);
+    for (int k = 0; k < length; k++) {
+        double t = k - center;
+        double x = 2 * M_PI * cutoff * t;
+        double sinc = t == 0 ? 1.0 : std::sin(x) / x;
+        double r = t / (length / 2.0);
+        double window = BesselI0(preset.beta * std::sqrt(std::max(0.0, 1 - r * r))) / BesselI0(preset.beta);
+        prototype[k] = sinc * window;
+    }
+
+#if CONFIG_AUDIO_PCM_KERNELS_SIMD
+    const int shifts = RESAMPLER_SIMD_BLOCK;
+    stride_ = (taps_ + RESAMPLER_SIMD_BLOCK - 1 + RESAMPLER_SIMD_BLOCK - 1) / RESAMPLER_SIMD_BLOCK * RESAMPLER_SIMD_BLOCK;
+#else
+    const int shifts = 1;
+    stride_ = taps_;
+#endif
+    size_t coefficient_bytes = (size_t)up_ * shifts * stride_ * sizeof(int16_t);
+    // The vector loop may read up to a stride past the last new sample
+    size_t history_bytes = (size_t)(taps_ - 1 + RESAMPLER_CHUNK_SAMPLES + stride_ + RESAMPLER_SIMD_BLOCK) * sizeof(int16_t);
+    coefficients_ = (int16_t*)heap_caps_aligned_alloc(RESAMPLER_SIMD_ALIGN, coefficient_bytes, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    history_ = (int16_t*)heap_caps_aligned_alloc(RESAMPLER_SIMD_ALIGN, history_bytes, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (coefficients_ == nullptr || history_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the filter, using OpusResampler");
+        Release();
+        use_fallback_ = true;
+        fallback_.Configure(input_sample_rate, output_sample_rate);
+        return;
+    }
+    memset(coefficients_, 0, coefficient_bytes);
+    memset(history_, 0, history_bytes);
+
+    /*
+     * Phase p produces y = sum(h[p + j * L] * x[i - j]). The taps are stored oldest input first, so the
+     * dot product runs forward over x[i - taps + 1 .. i], and every phase is scaled to unity DC gain.
+     */
+    for (int phase = 0; phase < up_; phase++) {
+        double sum = 0;
+        for (int j = 0; j < taps_; j++) {
+            sum += prototype[phase + j * up_];
+        }
+        for (int shift = 0; shift < shifts; shift++) {
+            int16_t* row = coefficients_ + (phase * shifts + shift) * stride_ + shift;
+            for (int m = 0; m < taps_; m++) {
+                double value = prototype[phase + (taps_ - 1 - m) * up_] / sum * 32768.0;
+                row[m] = Saturate16((int32_t)std::lround(value));
+            }
+        }
+    }
+    ESP_LOGD(TAG, "Resampling %d -> %d (%d/%d), %s quality, %d taps per phase", input_sample_rate, output_sample_rate,
+        up_, down_, preset.name, taps_);
+}
+
+void AudioResampler::Reset() {
+    if (use_fallback_) {
+        fallback_.Configure(input_sample_rate_, output_sample_rate_);
+    } else if (history_ != nullptr) {
+        memset(history_, 0, (taps_ - 1) * sizeof(int16_t));
+    }
+    time_ = 0;
+}
+
+int AudioResampler::GetOutputSamples(int input_samples) const {
+    if (input_sample_rate_ == 0) {
+        return input_samples;
+    }
+    return (int64_t)input_samples * output_sample_rate_ / input_sample_rate_;
+}
+
+int32_t AudioResampler::DotProduct(int position, int phase) const {
+#if CONFIG_AUDIO_PCM_KERNELS_SIMD
+    int shift = position & (RESAMPLER_SIMD_BLOCK - 1);
+    if (!scalar_) {
+        const int16_t* c = coefficients_ + (phase * RESAMPLER_SIMD_BLOCK + shift) * stride_;
+        return SimdDotProduct(history_ + position - shift, c, stride_ / RESAMPLER_SIMD_BLOCK);
+    }
+    const int16_t* c = coefficients_ + phase * RESAMPLER_SIMD_BLOCK * stride_;
+#else
+    const int16_t* c = coefficients_ + phase * stride_;
+#endif
+    const int16_t* x = history_ + position;
+    int64_t sum = 0;
+    for (int m = 0; m < taps_; m++) {
+        sum += (int32_t)x[m] * c[m];
+    }
+    return (int32_t)(sum >> 15);
+}
+
+int AudioResampler::ProcessChunk(const int16_t* input, int samples, int16_t* output, int max_output, int stride) {
+    // history_[n] is x[n - taps + 1], so the window of x[i] starts at history_[i]
+    int16_t* chunk = history_ + taps_ - 1;
+    if (stride == 1) {
+        memcpy(chunk, input, samples * sizeof(int16_t));
+    } else {
+        for (int i = 0; i < samples; i++) {
+            chunk[i] = input[i * stride];
+        }
+    }
+    int end = samples * up_;
+    int written = 0;
+    for (; time_ < end; time_ += down_) {
+        if (written < max_output) {
+            output[written * stride] = Saturate16(DotProduct(time_ / up_, time_ % up_));
+            written++;
+        }
+    }
+    time_ -= end;
+    memmove(history_, history_ + samples, (taps_ - 1) * sizeof(int16_t));
+    return written;
+}
+
+void AudioResampler::Process(const int16_t* input, int input_samples, int16_t* output, int stride) {
+    if (use_fallback_) {
+        if (stride != 1) {
+            ESP_LOGE(TAG, "OpusResampler takes no interleaved input");
+            return;
+        }
+        fallback_.Process(input, input_samples, output);
+        return;
+    }
+    int output_samples = GetOutputSamples(input_samples);
+    if (coefficients_ == nullptr) {
+        for (int i = 0; i < std::min(input_samples, output_samples); i++) {
+            output[i * stride] = input[i * stride];
+        }
+        return;
+    }
+
+    int written = 0;
+    while (input_samples > 0) {
+        int chunk = std::min(input_samples, RESAMPLER_CHUNK_SAMPLES);
+        written += ProcessChunk(input, chunk, output + written * stride, output_samples - written, stride);
+        input += chunk * stride;
+        input_samples -= chunk;
+    }
+    /* Only a block that is not a multiple of M can come out one sample short */
+    for (; written < output_samples; written++) {
+        output[written * stride] = written > 0 ? output[(written - 1) * stride] : 0;
+    }
+}
+
+// THD+N in dB of a tone at frequency: the best fitting sine and the DC are removed, the rest is noise
+static double MeasureThdN(const int16_t* samples, int count, int sample_rate, double frequency) {
+    double sine = 0, cosine = 0, mean = 0;
+    for (int i = 0; i < count; i++) {
+        double phase = 2 * M_PI * frequency * i / sample_rate;
+        sine += samples[i] * std::sin(phase);
+        cosine += samples[i] * std::cos(phase);
+        mean += samples[i];
+    }
+    sine *= 2.0 / count;
+    cosine *= 2.0 / count;
+    mean /= count;
+    double signal = 0, noise = 0;
+    for (int i = 0; i < count; i++) {
+        double phase = 2 * M_PI * frequency * i / sample_rate;
+        double fitted = sine * std::sin(phase) + cosine * std::cos(phase);
+        double error = samples[i] - mean - fitted;
+        signal += fitted * fitted;
+        noise += error * error;
+    }
+    return 10 * std::log10(std::max(noise, 1e-9) / std::max(signal, 1e-9));
+}
+
+void AudioResampler::RunBenchmark() {
+    struct Ratio {
+        int input_sample_rate;
+        int output_sample_rate;
+    };
+    static const Ratio kRatios[] = { { 48000, 16000 }, { 24000, 16000 }, { 16000, 24000 }, { 24000, 48000 } };
+    // Whole numbers of periods in the analysed window at every rate
+    static const double kFrequencies[] = { 1000, 6000 };
+
+    for (auto& ratio : kRatios) {
+        int input_samples = ratio.input_sample_rate * RESAMPLER_BENCHMARK_MS / 1000;
+        int output_samples = ratio.output_sample_rate * RESAMPLER_BENCHMARK_MS / 1000;
+        int frame_samples = ratio.input_sample_rate * RESAMPLER_BENCHMARK_FRAME_MS / 1000;
+        int settle = ratio.output_sample_rate * RESAMPLER_BENCHMARK_SETTLE_MS / 1000;
+        auto input = (int16_t*)heap_caps_malloc_prefer(input_samples * sizeof(int16_t), 2, MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT);
+        auto output = (int16_t*)heap_caps_malloc_prefer(output_samples * sizeof(int16_t), 2, MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT);
+        auto expected = (int16_t*)heap_caps_malloc_prefer(output_samples * sizeof(int16_t), 2, MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT);
+        if (input == nullptr || output == nullptr || expected == nullptr) {
+            ESP_LOGE(TAG, "Failed to allocate benchmark buffers");
+            heap_caps_free(input);
+            heap_caps_free(output);
+            heap_caps_free(expected);
+            return;
+        }
+
+        /*
+         * Runs the whole signal frame by frame, returns the time per output sample and adds the CPU cycles
+         * per output sample to cycles. The cycle counter is that of the core the caller runs on, it
+         * wraps after 2^32 cycles, far longer than one run.
+         */
+        auto run = [&](const std::function<void(const int16_t*, int, int16_t*)>& process, int16_t* result,
+            double& cycles) {
+#ifndef CONFIG_IDF_TARGET_LINUX
+            uint32_t start_cycles = esp_cpu_get_cycle_count();
+#endif
+            int64_t start_time = esp_timer_get_time();
+            int written = 0;
+            for (int offset = 0; offset + frame_samples <= input_samples; offset += frame_samples) {
+                process(input + offset, frame_samples, result + written);
+                written += frame_samples * ratio.output_sample_rate / ratio.input_sample_rate;
+            }
+            int64_t elapsed_us = esp_timer_get_time() - start_time;
+#ifndef CONFIG_IDF_TARGET_LINUX
+            cycles += (double)(uint32_t)(esp_cpu_get_cycle_count() - start_cycles) / written;
+#endif
+            return (double)elapsed_us * 1000 / written;
+        };
+
+        for (double frequency : kFrequencies) {
+            for (int i = 0; i < input_samples; i++) {
+                input[i] = (int16_t)(16000 * std::sin(2 * M_PI * frequency * i / ratio.input_sample_rate));
+            }
+            auto report = [&](const char* name, double ns, double cycles) {
+                double thdn = MeasureThdN(output + settle, output_samples - settle, ratio.output_sample_rate, frequency);
+#ifndef CONFIG_IDF_TARGET_LINUX
+                ESP_LOGI(TAG, "%5d>%5d %4.0fHz %-6s %7.1fns %5.0f cycles per sample, THD+N %6.1fdB", ratio.input_sample_rate,
+                    ratio.output_sample_rate, frequency, name, ns, cycles, thdn);
+#else
+                ESP_LOGI(TAG, "%5d>%5d %4.0fHz %-6s %7.1fns per sample, THD+N %6.1fdB", ratio.input_sample_rate,
+                    ratio.output_sample_rate, frequency, name, ns, thdn);
+#endif
+            };
+
+            double ns = 0;
+            double cycles = 0;
+#ifndef CONFIG_IDF_TARGET_LINUX
+            /* On the linux target OpusResampler is the linear host shim, not the Opus resampler, so it is left out */
+            for (int i = 0; i < RESAMPLER_BENCHMARK_ITERATIONS; i++) {
+                OpusResampler reference;
+                reference.Configure(ratio.input_sample_rate, ratio.output_sample_rate);
+                ns += run([&](const int16_t* in, int samples, int16_t* out) {
+                    reference.Process(in, samples, out);
+                }, output, cycles) / RESAMPLER_BENCHMARK_ITERATIONS;
+            }
+            report("opus", ns, cycles / RESAMPLER_BENCHMARK_ITERATIONS);
+#endif
+
+            for (int quality = kAudioResamplerQualityLow; quality <= kAudioResamplerQualityHigh; quality++) {
+                AudioResampler resampler;
+                ns = 0;
+                cycles = 0;
+                for (int i = 0; i < RESAMPLER_BENCHMARK_ITERATIONS; i++) {
+                    resampler.Configure(ratio.input_sample_rate, ratio.output_sample_rate, (AudioResamplerQuality)quality);
+                    ns += run([&](const int16_t* in, int samples, int16_t* out) {
+                        resampler.Process(in, samples, out);
+                    }, output, cycles) / RESAMPLER_BENCHMARK_ITERATIONS;
+                }
+                report(kPresets[quality].name, ns, cycles / RESAMPLER_BENCHMARK_ITERATIONS);
+
+#if CONFIG_AUDIO_PCM_KERNELS_SIMD
+                resampler.Configure(ratio.input_sample_rate, ratio.output_sample_rate, (AudioResamplerQuality)quality);
+                resampler.scalar_ = true;
+                double scalar_cycles = 0;
+                double scalar_ns = run([&](const int16_t* in, int samples, int16_t* out) {
+                    resampler.Process(in, samples, out);
+                }, expected, scalar_cycles);
+                bool match = memcmp(expected, output, output_samples * sizeof(int16_t)) == 0;
+                ESP_LOGI(TAG, "%5d>%5d %4.0fHz %-6s scalar %7.1fns %5.0f cycles per sample, PIE vector loop %s",
+                    ratio.input_sample_rate, ratio.output_sample_rate, frequency, kPresets[quality].name, scalar_ns,
+                    scalar_cycles, match ? "matches" : "DOES NOT match");
+#endif
+            }
+        }
+
+        heap_caps_free(input);
+        heap_caps_free(output);
+        heap_caps_free(expected);
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef AUDIO_RESAMPLER_H
+#define AUDIO_RESAMPLER_H
+
+#include <cstdint>
+#include <opus_resampler.h>
+
+enum AudioResamplerQuality {
+    kAudioResamplerQualityLow,      // 8 zero crossings per side, about 50 dB stopband
+    kAudioResamplerQualityMedium,   // 16 zero crossings, about 70 dB
+    kAudioResamplerQualityHigh,     // 32 zero crossings, about 90 dB
+};
+
+/*
+ * Polyphase FIR resampler for the small integer ratios of the audio pipeline (48k > 16k, 24k > 16k,
+ * 16k > 24k, 24k > 48k, ...), with the same interface as OpusResampler.
+ *
+ * Configure() designs a Kaiser windowed sinc for the ratio and quality and keeps one Q15 coefficient
+ * set per phase, so Process() is one dot product per output sample and nothing is computed per call.
+ * On ESP32-S3 (CONFIG_AUDIO_PCM_KERNELS_SIMD) the dot product runs 8 taps per instruction with the
+ * PIE vector unit: every phase is stored 8 times, shifted by 0-7 taps, so the input is always read
+ * from an aligned address. Both paths give bit-identical results.
+ *
+ * Ratios that do not reduce to L/M with both at most 8 (44.1 kHz) fall back to OpusResampler.
+ * Process() writes GetOutputSamples() samples; the filter state carries over between calls, so the
+ * stream stays continuous when every block is a multiple of M input samples (whole milliseconds).
+ *
+ * One resampler is for one task.
+ */
+class AudioResampler {
+public:
+    AudioResampler() = default;
+    ~AudioResampler();
+    AudioResampler(const AudioResampler&) = delete;
+    AudioResampler& operator=(const AudioResampler&) = delete;
+
+    void Configure(int input_sample_rate, int output_sample_rate, AudioResamplerQuality quality = DefaultQuality());
+    // stride > 1 reads and writes one channel of interleaved frames (input_samples per channel), which
+    // only the polyphase path supports
+    void Process(const int16_t* input, int input_samples, int16_t* output, int stride = 1);
+    // Clears the filter history, for a new stream
+    void Reset();
+    int GetOutputSamples(int input_samples) const;
+
+    inline int input_sample_rate() const { return input_sample_rate_; }
+    inline int output_sample_rate() const { return output_sample_rate_; }
+    // False when the ratio is handled by OpusResampler
+    inline bool polyphase() const { return coefficients_ != nullptr; }
+
+    // The quality selected with CONFIG_AUDIO_RESAMPLER_QUALITY
+    static AudioResamplerQuality DefaultQuality();
+    // Prints the time and CPU cycles per sample and the THD+N of every preset and of OpusResampler, for the
+    // pipeline ratios. On the linux target only the presets, in time per sample
+    static void RunBenchmark();
+
+private:
+    int input_sample_rate_ = 0;
+    int output_sample_rate_ = 0;
+    int up_ = 1;                    // L
+    int down_ = 1;                  // M
+    int taps_ = 0;                  // Taps per phase
+    int stride_ = 0;                // Coefficients per shifted phase, taps_ rounded up with room for the shift
+    int16_t* coefficients_ = nullptr;   // [phase][shift][stride_], only shift 0 without the vector unit
+    int16_t* history_ = nullptr;        // taps_ - 1 samples of the previous input, then the next chunk
+    int time_ = 0;                  // Next output in upsampled samples, from the start of the next chunk
+    OpusResampler fallback_;
+    bool use_fallback_ = false;
+    bool scalar_ = false;           // RunBenchmark() only, the scalar loop on the vector tables
+
+    void Release();
+    int ProcessChunk(const int16_t* input, int samples, int16_t* output, int max_output, int stride);
+    int32_t DotProduct(int position, int phase) const;
+};
+
+#endif // AUDIO_RESAMPLER_H
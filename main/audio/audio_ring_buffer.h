@@ -0,0 +1,196 @@
+#ifndef AUDIO_RING_BUFFER_H
+#define AUDIO_RING_BUFFER_H
+
+#include <atomic>
+#include <algorithm>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+
+/*
+ * Counters of one ring. Producer side fields are only written by the producer,
+ * consumer side fields only by the consumer, so no locking is needed.
+ */
+struct AudioRingStats {
+    // Producer side
+    uint32_t push_count = 0;
+    uint32_t full_count = 0;          // Push() found the ring full (back pressure / contention)
+    uint32_t high_water = 0;          // Max number of items seen in the ring
+    uint64_t producer_wait_us = 0;    // Time the producer blocked in WaitForSpace()
+    // Consumer side
+    uint32_t pop_count = 0;
+    uint32_t flushed_count = 0;       // Items discarded by Flush()
+    uint64_t consumer_wait_us = 0;    // Time the consumer blocked in WaitForData()
+    uint64_t residency_total_us = 0;  // Time popped items spent in the ring, see EnableResidencyTracking()
+    uint32_t residency_max_us = 0;
+};
+
+/*
+ * Bounded single-producer / single-consumer ring buffer.
+ *
+ * Push() must only be called from one producer task and Pop() from one consumer task.
+ * Flush() may be called from any task: it marks everything pushed so far as discarded,
+ * and the consumer drops those items on its next Pop(), so slots are only ever touched
+ * by their owner. Dropped items are handed to the OnDiscard() callback, on the consumer
+ * task, so pooled objects can go back to their pool.
+ *
+ * Wakeups use direct task notifications instead of a shared condition variable. A task that
+ * wants to sleep arms the ring (ArmConsumerWakeup / ArmProducerWakeup) before re-checking its
+ * condition, then blocks in ulTaskNotifyTake(). Notifications are latched, so a wakeup sent
+ * between the check and the block is not lost. A task may arm several rings and wait once.
+ */
+template <typename T>
+class AudioRingBuffer {
+public:
+    explicit AudioRingBuffer(size_t capacity) : slots_(capacity), capacity_(capacity) {}
+
+    AudioRingBuffer(const AudioRingBuffer&) = delete;
+    AudioRingBuffer& operator=(const AudioRingBuffer&) = delete;
+
+    inline size_t capacity() const { return capacity_; }
+
+    // Record how long each item stays in the ring. Call before the ring is used.
+    void EnableResidencyTracking() {
+        push_time_.assign(capacity_, 0);
+    }
+    inline const AudioRingStats& stats() const { return stats_; }
+    // Receives every item dropped after a Flush(). Call before the ring is used.
+    void OnDiscard(std::function<void(T&&)> callback) {
+        on_discard_ = callback;
+    }
+
+    size_t Size() const {
+        // Load head first, so a concurrent pop can not make head pass the tail snapshot
+        uint32_t head = head_.load(std::memory_order_acquire);
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        return tail - head;
+    }
+    bool Empty() const { return Size() == 0; }
+    bool Full() const { return Size() >= capacity_; }
+
+    // Producer only. The item is moved from only when the push succeeds.
+    // `limit` lets a producer apply a soft limit below the ring capacity.
+    bool Push(T&& item, size_t limit = SIZE_MAX) {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        uint32_t head = head_.load(std::memory_order_acquire);
+        if (tail - head >= std::min(limit, capacity_)) {
+            stats_.full_count++;
+            return false;
+        }
+        slots_[tail % capacity_] = std::move(item);
+        if (!push_time_.empty()) {
+            push_time_[tail % capacity_] = esp_timer_get_time();
+        }
+        tail_.store(tail + 1, std::memory_order_release);
+
+        stats_.push_count++;
+        if (tail + 1 - head > stats_.high_water) {
+            stats_.high_water = tail + 1 - head;
+        }
+        Notify(consumer_waiter_);
+        return true;
+    }
+
+    // Consumer only
+    bool Pop(T& item) {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        uint32_t flush_to = flush_to_.load(std::memory_order_acquire);
+        while (head != tail && (int32_t)(flush_to - head) > 0) {
+            if (on_discard_) {
+                on_discard_(std::move(slots_[head % capacity_]));
+            }
+            slots_[head % capacity_] = T();
+            head++;
+            stats_.flushed_count++;
+        }
+        if (head == tail) {
+            if (head != head_.load(std::memory_order_relaxed)) {
+                head_.store(head, std::memory_order_release);
+                Notify(producer_waiter_);
+            }
+            return false;
+        }
+        item = std::move(slots_[head % capacity_]);
+        if (!push_time_.empty()) {
+            uint32_t residency = esp_timer_get_time() - push_time_[head % capacity_];
+            stats_.residency_total_us += residency;
+            if (residency > stats_.residency_max_us) {
+                stats_.residency_max_us = residency;
+            }
+        }
+        head_.store(head + 1, std::memory_order_release);
+
+        stats_.pop_count++;
+        Notify(producer_waiter_);
+        return true;
+    }
+
+    // Any task. Discards everything pushed so far and wakes both sides.
+    void Flush() {
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        uint32_t current = flush_to_.load(std::memory_order_relaxed);
+        while ((int32_t)(tail - current) > 0 &&
+            !flush_to_.compare_exchange_weak(current, tail, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+        Notify(consumer_waiter_);
+        Notify(producer_waiter_);
+    }
+
+    void ArmConsumerWakeup() {
+        consumer_waiter_.store(xTaskGetCurrentTaskHandle(), std::memory_order_release);
+    }
+
+    void ArmProducerWakeup() {
+        producer_waiter_.store(xTaskGetCurrentTaskHandle(), std::memory_order_release);
+    }
+
+    // Consumer only. Returns when data may be available, on timeout, or on Flush().
+    void WaitForData(TickType_t timeout) {
+        ArmConsumerWakeup();
+        if (!Empty()) {
+            return;
+        }
+        int64_t start_time = esp_timer_get_time();
+        ulTaskNotifyTake(pdTRUE, timeout);
+        stats_.consumer_wait_us += esp_timer_get_time() - start_time;
+    }
+
+    // Producer only. Returns when space may be available, on timeout, or on Flush().
+    void WaitForSpace(TickType_t timeout, size_t limit = SIZE_MAX) {
+        ArmProducerWakeup();
+        if (Size() < std::min(limit, capacity_)) {
+            return;
+        }
+        int64_t start_time = esp_timer_get_time();
+        ulTaskNotifyTake(pdTRUE, timeout);
+        stats_.producer_wait_us += esp_timer_get_time() - start_time;
+    }
+
+private:
+    std::vector<T> slots_;
+    std::vector<int64_t> push_time_;
+    std::function<void(T&&)> on_discard_;
+    const size_t capacity_;
+    // Free running indices, the slot is index % capacity
+    std::atomic<uint32_t> head_{0};
+    std::atomic<uint32_t> tail_{0};
+    std::atomic<uint32_t> flush_to_{0};
+    std::atomic<TaskHandle_t> consumer_waiter_{nullptr};
+    std::atomic<TaskHandle_t> producer_waiter_{nullptr};
+    AudioRingStats stats_;
+
+    static void Notify(std::atomic<TaskHandle_t>& waiter) {
+        TaskHandle_t task = waiter.exchange(nullptr, std::memory_order_acq_rel);
+        if (task != nullptr) {
+            xTaskNotifyGive(task);
+        }
+    }
+};
+
+#endif // AUDIO_RING_BUFFER_H
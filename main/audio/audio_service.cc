@@ -1,5 +1,10 @@
 #include "audio_service.h"
+#include "pcm_kernels.h"
+#include "audio_loopback_probe.h"
+#include "settings.h"
 #include <esp_log.h>
+#include <cstring>
+#include <algorithm>
 
 #if CONFIG_USE_AUDIO_PROCESSOR
 #include "processors/afe_audio_processor.h"
@@ -17,9 +22,33 @@
 
 #define TAG "AudioService"
 
+#if CONFIG_FREERTOS_UNICORE
+#define OPUS_TASK_CORE(core) tskNO_AFFINITY
+#else
+#define OPUS_TASK_CORE(core) ((core) < 0 ? tskNO_AFFINITY : (core))
+#endif
 
 AudioService::AudioService() {
     event_group_ = xEventGroupCreate();
+    mixer_.SetQueue(kAudioVoiceTts, &audio_playback_queue_);
+    for (int voice = kAudioVoiceUi; voice < kAudioVoiceCount; voice++) {
+        mixer_.SetQueue((AudioVoice)voice, &effects_[voice - kAudioVoiceUi].queue);
+    }
+    mixer_.SetVoiceVolume(kAudioVoiceUi, CONFIG_AUDIO_MIXER_UI_VOLUME);
+    mixer_.SetVoiceVolume(kAudioVoiceAlert, CONFIG_AUDIO_MIXER_ALERT_VOLUME);
+    mixer_.SetDuckVolume(CONFIG_AUDIO_MIXER_DUCK_VOLUME);
+    mixer_.OnFrameStart([this](AudioVoice voice, const AudioTask& task, size_t offset) {
+        // On the output task, while the period is mixed and before it is written
+        if (voice == kAudioVoiceTts && task.timestamp > 0) {
+            playback_clock_.MarkFrame(playback_clock_.write_position() + offset, task.timestamp, task.pcm.size());
+        }
+    });
+#if CONFIG_AUDIO_CODEC_BENCHMARK
+    audio_encode_queue_.EnableResidencyTracking();
+    audio_send_queue_.EnableResidencyTracking();
+    audio_decode_queue_.EnableResidencyTracking();
+    audio_playback_queue_.EnableResidencyTracking();
+#endif
 }
 
 AudioService::~AudioService() {
@@ -33,16 +62,97 @@ void AudioService::Initialize(AudioCodec* codec) {
     codec_ = codec;
     codec_->Start();
 
+#if CONFIG_AUDIO_PCM_KERNELS_BENCHMARK
+    PcmKernels::RunBenchmark();
+#endif
+#if CONFIG_AUDIO_RESAMPLER_BENCHMARK
+    AudioResampler::RunBenchmark();
+#endif
+
+#if CONFIG_USE_AUDIO_DEBUGGER
+    /* Created before the tasks, the taps feed it from several of them */
+    audio_debugger_ = std::make_unique<AudioDebugger>();
+#endif
+
     /* Setup the audio codec */
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(codec->output_sample_rate(), 1, OPUS_FRAME_DURATION_MS);
-    opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
-    opus_encoder_->SetComplexity(0);
+    decoder_pool_.Initialize(codec->output_sample_rate(), codec->output_sample_rate(), OPUS_FRAME_DURATION_MS);
+    opus_encoder_ = std::make_unique<OpusFrameEncoder>(16000, 1, OPUS_FRAME_DURATION_MS);
+    // Starts at 0 (the fastest), the governor raises it while the CPU has time to spare
+    opus_encoder_->SetComplexity(encoder_governor_.complexity());
+    opus_encoder_->SetBitrate(encoder_governor_.bitrate());
+#if CONFIG_AUDIO_UPLINK_DTX
+    opus_encoder_->SetDtx(true);
+#endif
+    uplink_gate_.SetHandlers([this](std::unique_ptr<AudioStreamPacket>&& packet) {
+        audio_send_queue_.Push(std::move(packet));
+        if (callbacks_.on_send_queue_available) {
+            callbacks_.on_send_queue_available();
+        }
+    }, [this](std::unique_ptr<AudioStreamPacket>&& packet) {
+        RecyclePacket(std::move(packet));
+    });
+
+    /* Preallocate the packet and task pools, so the per-frame path does not touch the heap */
+    packet_pool_.Initialize(CONFIG_AUDIO_PACKET_POOL_SIZE, [](AudioStreamPacket& packet) {
+        packet.payload.reserve(MAX_OPUS_PACKET_SIZE);
+    });
+    // A task holds either a 16kHz frame to encode, or a decoded frame (server audio is usually 24kHz) resampled to the output rate
+    size_t max_pcm_samples = std::max(24000, codec->output_sample_rate()) * MAX_OPUS_FRAME_DURATION_MS / 1000;
+    task_pool_.Initialize(CONFIG_AUDIO_TASK_POOL_SIZE, [max_pcm_samples](AudioTask& task) {
+        task.pcm.reserve(max_pcm_samples);
+    });
+    // Flushed frames (ResetDecoder, barge-in) go back to the pools like the consumed ones
+    auto recycle_packet = [this](std::unique_ptr<AudioStreamPacket>&& packet) {
+        RecyclePacket(std::move(packet));
+    };
+    auto recycle_task = [this](std::unique_ptr<AudioTask>&& task) {
+        task_pool_.Release(std::move(task));
+    };
+    audio_decode_queue_.OnDiscard(recycle_packet);
+    audio_send_queue_.OnDiscard(recycle_packet);
+    audio_encode_queue_.OnDiscard(recycle_task);
+    audio_playback_queue_.OnDiscard(recycle_task);
+    for (auto& effect : effects_) {
+        effect.queue.OnDiscard(recycle_task);
+    }
 
     if (codec->input_sample_rate() != 16000) {
         input_resampler_.Configure(codec->input_sample_rate(), 16000);
         reference_resampler_.Configure(codec->input_sample_rate(), 16000);
     }
 
+    /* Local sounds are 16kHz, the mixer works at the output rate, one DMA period at a time */
+    if (codec->output_sample_rate() != 16000) {
+        for (auto& effect : effects_) {
+            effect.resampler.Configure(16000, codec->output_sample_rate());
+        }
+    }
+    mix_buffer_.resize(AUDIO_CODEC_DMA_FRAME_NUM);
+    played_frames_.reserve(MAX_PLAYED_FRAMES_PER_PERIOD);
+    playback_clock_.Initialize(codec->output_sample_rate(), AUDIO_CODEC_DMA_DESC_NUM * AUDIO_CODEC_DMA_FRAME_NUM);
+#if CONFIG_USE_SERVER_AEC
+    {
+        Settings settings("audio", false);
+        int delay = settings.GetInt("aec_delay_us", -1);
+        loopback_delay_calibrated_ = delay >= 0;
+        loopback_delay_us_ = loopback_delay_calibrated_ ? delay : CONFIG_SERVER_AEC_LOOPBACK_DELAY_MS * 1000;
+    }
+#endif
+
+    /* Size the input scratch for the longest frame, so ReadAudioData does not allocate per frame */
+    int input_channels = codec->input_channels();
+    size_t max_input_frames = codec->input_sample_rate() * MAX_OPUS_FRAME_DURATION_MS / 1000;
+    size_t max_output_frames = 16000 * MAX_OPUS_FRAME_DURATION_MS / 1000;
+    input_buffer_.reserve(max_input_frames * input_channels);
+    input_frame_.reserve(std::max(max_input_frames, max_output_frames) * input_channels);
+    // The polyphase resamplers read and write the interleaved frames in place, OpusResampler needs the channels apart
+    if (input_channels == 2 && codec->input_sample_rate() != 16000 && !input_resampler_.polyphase()) {
+        input_mic_.reserve(max_input_frames);
+        input_reference_.reserve(max_input_frames);
+        input_resampled_mic_.reserve(max_output_frames);
+        input_resampled_reference_.reserve(max_output_frames);
+    }
+
 #if CONFIG_USE_AUDIO_PROCESSOR
     audio_processor_ = std::make_unique<AfeAudioProcessor>();
 #else
@@ -60,7 +170,13 @@ void AudioService::Initialize(AudioCodec* codec) {
 #endif
 
     audio_processor_->OnOutput([this](std::vector<int16_t>&& data) {
-        PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(data));
+        recorder_.Feed(kAudioTapProcessed, data.data(), data.size());
+#if CONFIG_USE_AUDIO_DEBUGGER
+        audio_debugger_->Feed(kAudioDebugTapProcessed, data, 1, 16000);
+#endif
+        int64_t capture_time_us;
+        int64_t origin_time_us = latency_tracer_.MatchCaptured(data.size(), &capture_time_us);
+        PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(data), origin_time_us, capture_time_us);
     });
 
     audio_processor_->OnVadStateChange([this](bool speaking) {
@@ -70,8 +186,26 @@ void AudioService::Initialize(AudioCodec* codec) {
         }
     });
 
+    /* Opus frames of a recording are encoded by the encode task, with an encoder of their own */
+    recorder_.OnOpusFrame([this](const std::vector<int16_t>& pcm, uint32_t sequence) {
+        auto task = task_pool_.Acquire();
+        task->type = kAudioTaskTypeEncodeToRecorder;
+        task->timestamp = sequence;
+        task->origin_time_us = 0;
+        task->processed_time_us = 0;
+        task->pcm.assign(pcm.begin(), pcm.end());
+        // The tap must not wait for the encoder, a frame is dropped while the uplink fills the queue
+        std::lock_guard<std::mutex> lock(encode_producer_mutex_);
+        if (!audio_encode_queue_.Push(std::move(task), QUEUE_FRAMES(MAX_ENCODE_QUEUE_MS, frame_duration_))) {
+            task_pool_.Release(std::move(task));
+            return false;
+        }
+        return true;
+    });
+
     if (wake_word_) {
         wake_word_->OnWakeWordDetected([this](const std::string& wake_word) {
+            wake_word_time_us_ = esp_timer_get_time();
             if (callbacks_.on_wake_word_detected) {
                 callbacks_.on_wake_word_detected(wake_word);
             }
@@ -93,9 +227,15 @@ void AudioService::Initialize(AudioCodec* codec) {
 
 void AudioService::Start() {
     service_stopped_ = false;
-    xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING | AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING);
-
-    esp_timer_start_periodic(audio_power_timer_, 1000000);
+    xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_RECORDING_RUNNING | AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING);
+
+    /* The codec starts with both channels enabled */
+    {
+        std::lock_guard<std::mutex> lock(codec_power_mutex_);
+        last_input_time_us_ = esp_timer_get_time();
+        last_output_time_us_ = esp_timer_get_time();
+        ArmPowerTimer(AUDIO_POWER_TIMEOUT_MS * 1000);
+    }
 
     /* Start the audio input task */
 #if CONFIG_USE_AUDIO_PROCESSOR
@@ -119,78 +259,102 @@ void AudioService::Start() {
         vTaskDelete(NULL);
     }, "audio_output", 4096, this, 3, &audio_output_task_handle_);
 
-    /* Start the opus codec task */
-    xTaskCreate([](void* arg) {
+    /* Start the opus encode and decode tasks, one per direction so a TTS burst does not delay the uplink */
+    xTaskCreatePinnedToCore([](void* arg) {
+        AudioService* audio_service = (AudioService*)arg;
+        audio_service->OpusEncodeTask();
+        vTaskDelete(NULL);
+    }, "opus_encode", 4096 * 7, this, CONFIG_AUDIO_OPUS_ENCODE_TASK_PRIORITY, &opus_encode_task_handle_,
+        OPUS_TASK_CORE(CONFIG_AUDIO_OPUS_ENCODE_TASK_CORE));
+
+    xTaskCreatePinnedToCore([](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
-        audio_service->OpusCodecTask();
+        audio_service->OpusDecodeTask();
         vTaskDelete(NULL);
-    }, "opus_codec", 4096 * 7, this, 2, &opus_codec_task_handle_);
+    }, "opus_decode", 4096 * 4, this, CONFIG_AUDIO_OPUS_DECODE_TASK_PRIORITY, &opus_decode_task_handle_,
+        OPUS_TASK_CORE(CONFIG_AUDIO_OPUS_DECODE_TASK_CORE));
 }
 
 void AudioService::Stop() {
     esp_timer_stop(audio_power_timer_);
     service_stopped_ = true;
-    xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING |
+    xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_RECORDING_RUNNING |
         AS_EVENT_WAKE_WORD_RUNNING |
         AS_EVENT_AUDIO_PROCESSOR_RUNNING);
 
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    audio_encode_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    /* Flush also wakes up the tasks blocked on the queues, so they can see service_stopped_ */
+    audio_encode_queue_.Flush();
+    audio_decode_queue_.Flush();
+    audio_playback_queue_.Flush();
+    audio_send_queue_.Flush();
+    for (auto& effect : effects_) {
+        effect.queue.Flush();
+    }
+}
+
+void AudioService::ResizeInputBuffer(std::vector<int16_t>& buffer, size_t samples) {
+    if (samples > buffer.capacity()) {
+        debug_statistics_.input_alloc_bytes += samples * sizeof(int16_t);
+    }
+    buffer.resize(samples);
 }
 
 bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples) {
     if (!codec_->input_enabled()) {
-        codec_->EnableInput(true);
-        esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
+        EnableCodecInput();
     }
 
     if (codec_->input_sample_rate() != sample_rate) {
-        data.resize(samples * codec_->input_sample_rate() / sample_rate);
-        if (!codec_->InputData(data)) {
+        /* Read into the persistent input buffer, and resample from there straight into data */
+        ResizeInputBuffer(input_buffer_, samples * codec_->input_sample_rate() / sample_rate);
+        if (!codec_->InputData(input_buffer_)) {
             return false;
         }
-        if (codec_->input_channels() == 2) {
-            auto mic_channel = std::vector<int16_t>(data.size() / 2);
-            auto reference_channel = std::vector<int16_t>(data.size() / 2);
-            for (size_t i = 0, j = 0; i < mic_channel.size(); ++i, j += 2) {
-                mic_channel[i] = data[j];
-                reference_channel[i] = data[j + 1];
-            }
-            auto resampled_mic = std::vector<int16_t>(input_resampler_.GetOutputSamples(mic_channel.size()));
-            auto resampled_reference = std::vector<int16_t>(reference_resampler_.GetOutputSamples(reference_channel.size()));
-            input_resampler_.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
-            reference_resampler_.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
-            data.resize(resampled_mic.size() + resampled_reference.size());
-            for (size_t i = 0, j = 0; i < resampled_mic.size(); ++i, j += 2) {
-                data[j] = resampled_mic[i];
-                data[j + 1] = resampled_reference[i];
-            }
+        if (codec_->input_channels() == 2 && input_resampler_.polyphase()) {
+            /* One pass per channel, from the codec frame to its slot in the interleaved output */
+            size_t frames = input_buffer_.size() / 2;
+            ResizeInputBuffer(data, input_resampler_.GetOutputSamples(frames) * 2);
+            input_resampler_.Process(input_buffer_.data(), frames, data.data(), 2);
+            reference_resampler_.Process(input_buffer_.data() + 1, frames, data.data() + 1, 2);
+        } else if (codec_->input_channels() == 2) {
+            size_t frames = input_buffer_.size() / 2;
+            ResizeInputBuffer(input_mic_, frames);
+            ResizeInputBuffer(input_reference_, frames);
+            PcmKernels::Deinterleave(input_buffer_.data(), input_mic_.data(), input_reference_.data(), frames);
+            ResizeInputBuffer(input_resampled_mic_, input_resampler_.GetOutputSamples(frames));
+            ResizeInputBuffer(input_resampled_reference_, reference_resampler_.GetOutputSamples(frames));
+            input_resampler_.Process(input_mic_.data(), frames, input_resampled_mic_.data());
+            reference_resampler_.Process(input_reference_.data(), frames, input_resampled_reference_.data());
+
+            size_t output_frames = input_resampled_mic_.size();
+            ResizeInputBuffer(data, output_frames * 2);
+            PcmKernels::Interleave(input_resampled_mic_.data(), input_resampled_reference_.data(), data.data(), output_frames);
         } else {
-            auto resampled = std::vector<int16_t>(input_resampler_.GetOutputSamples(data.size()));
-            input_resampler_.Process(data.data(), data.size(), resampled.data());
-            data = std::move(resampled);
+            ResizeInputBuffer(data, input_resampler_.GetOutputSamples(input_buffer_.size()));
+            input_resampler_.Process(input_buffer_.data(), input_buffer_.size(), data.data());
         }
     } else {
-        data.resize(samples);
+        ResizeInputBuffer(data, samples);
         if (!codec_->InputData(data)) {
             return false;
         }
     }
 
-    /* Update the last input time */
-    last_input_time_ = std::chrono::steady_clock::now();
+    /* Update the last input time, the power timer reads it when its deadline comes */
+    last_input_time_us_ = esp_timer_get_time();
     debug_statistics_.input_count++;
 
+    if (sample_rate == AUDIO_RECORDER_SAMPLE_RATE) {
+        size_t channels = codec_->input_channels();
+        recorder_.Feed(kAudioTapMicrophone, data.data(), data.size() / channels, channels, 0);
+        if (channels == 2) {
+            recorder_.Feed(kAudioTapReference, data.data(), data.size() / channels, channels, 1);
+        }
+    }
+
 #if CONFIG_USE_AUDIO_DEBUGGER
     // 音频调试：发送原始音频数据
-    if (audio_debugger_ == nullptr) {
-        audio_debugger_ = std::make_unique<AudioDebugger>();
-    }
-    audio_debugger_->Feed(data);
+    audio_debugger_->Feed(kAudioDebugTapInput, data, codec_->input_channels(), sample_rate);
 #endif
 
     return true;
@@ -198,8 +362,8 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
 
 void AudioService::AudioInputTask() {
     while (true) {
-        EventBits_t bits = xEventGroupWaitBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING |
-            AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING,
+        EventBits_t bits = xEventGroupWaitBits(event_group_, AS_EVENT_AUDIO_RECORDING_RUNNING |
+            AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING | AS_EVENT_LOOPBACK_CALIBRATION,
             pdFALSE, pdFALSE, portMAX_DELAY);
 
         if (service_stopped_) {
@@ -211,36 +375,18 @@ void AudioService::AudioInputTask() {
             continue;
         }
 
-        /* Used for audio testing in NetworkConfiguring mode by clicking the BOOT button */
-        if (bits & AS_EVENT_AUDIO_TESTING_RUNNING) {
-            if (audio_testing_queue_.size() >= AUDIO_TESTING_MAX_DURATION_MS / OPUS_FRAME_DURATION_MS) {
-                ESP_LOGW(TAG, "Audio testing queue is full, stopping audio testing");
-                EnableAudioTesting(false);
-                continue;
-            }
-            std::vector<int16_t> data;
-            int samples = OPUS_FRAME_DURATION_MS * 16000 / 1000;
-            if (ReadAudioData(data, 16000, samples)) {
-                // If input channels is 2, we need to fetch the left channel data
-                if (codec_->input_channels() == 2) {
-                    auto mono_data = std::vector<int16_t>(data.size() / 2);
-                    for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-                        mono_data[i] = data[j];
-                    }
-                    data = std::move(mono_data);
-                }
-                PushTaskToEncodeQueue(kAudioTaskTypeEncodeToTestingQueue, std::move(data));
-                continue;
-            }
+        /* The calibration reads the microphone itself and feeds the wake word, the audio processor waits */
+        if (bits & AS_EVENT_LOOPBACK_CALIBRATION) {
+            RunLoopbackCalibration();
+            continue;
         }
 
         /* Feed the wake word */
         if (bits & AS_EVENT_WAKE_WORD_RUNNING) {
-            std::vector<int16_t> data;
             int samples = wake_word_->GetFeedSize();
             if (samples > 0) {
-                if (ReadAudioData(data, 16000, samples)) {
-                    wake_word_->Feed(data);
+                if (ReadAudioData(input_frame_, 16000, samples)) {
+                    wake_word_->Feed(input_frame_);
                     continue;
                 }
             }
@@ -248,16 +394,28 @@ void AudioService::AudioInputTask() {
 
         /* Feed the audio processor */
         if (bits & AS_EVENT_AUDIO_PROCESSOR_RUNNING) {
-            std::vector<int16_t> data;
             int samples = audio_processor_->GetFeedSize();
             if (samples > 0) {
-                if (ReadAudioData(data, 16000, samples)) {
-                    audio_processor_->Feed(std::move(data));
+                if (ReadAudioData(input_frame_, 16000, samples)) {
+                    latency_tracer_.MarkCaptured(input_frame_.size() / codec_->input_channels(), esp_timer_get_time());
+                    // The processors only read the frame (the output callback copies it), so the buffer keeps its storage
+                    audio_processor_->Feed(std::move(input_frame_));
                     continue;
                 }
             }
         }
 
+        /* Nothing else reads the input, read it for the recorder (ReadAudioData feeds the taps) */
+        if (bits & AS_EVENT_AUDIO_RECORDING_RUNNING) {
+            if (!recorder_.IsRecording()) {
+                xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_RECORDING_RUNNING);
+                continue;
+            }
+            if (ReadAudioData(input_frame_, AUDIO_RECORDER_SAMPLE_RATE, frame_duration_ * AUDIO_RECORDER_SAMPLE_RATE / 1000)) {
+                continue;
+            }
+        }
+
         ESP_LOGE(TAG, "Should not be here, bits: %lx", bits);
         break;
     }
@@ -267,185 +425,394 @@ void AudioService::AudioInputTask() {
 
 void AudioService::AudioOutputTask() {
     while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() { return !audio_playback_queue_.empty() || service_stopped_; });
         if (service_stopped_) {
             break;
         }
 
-        auto task = std::move(audio_playback_queue_.front());
-        audio_playback_queue_.pop_front();
-        audio_queue_cv_.notify_all();
-        lock.unlock();
-
-        if (!codec_->output_enabled()) {
-            codec_->EnableOutput(true);
-            esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
+        /* A calibration probe starts at a period boundary, so its position is the period's */
+        if (!probe_playing_ && probe_requested_.exchange(false)) {
+            probe_offset_ = 0;
+            probe_position_ = playback_clock_.write_position();
+            probe_playing_ = true;
         }
-        codec_->OutputData(task->pcm);
 
-        /* Update the last output time */
-        last_output_time_ = std::chrono::steady_clock::now();
-        debug_statistics_.playback_count++;
+        if (!mixer_.HasData() && !probe_playing_) {
+            mixer_.ArmWakeup();
+            if (!mixer_.HasData() && !service_stopped_) {
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            }
+            continue;
+        }
 
-#if CONFIG_USE_SERVER_AEC
-        /* Record the timestamp for server AEC */
-        if (task->timestamp > 0) {
-            lock.lock();
-            timestamp_queue_.push_back(task->timestamp);
+        bool mixed = mixer_.Mix(mix_buffer_.data(), mix_buffer_.size());
+        if (probe_playing_) {
+            size_t count = std::min(mix_buffer_.size(), probe_.size() - probe_offset_);
+            PcmKernels::Mix(mix_buffer_.data(), probe_.data() + probe_offset_, count, 32767);
+            probe_offset_ += count;
+            probe_playing_ = probe_offset_ < probe_.size();
+            mixed = true;
+        }
+        if (mixed) {
+            if (!codec_->output_enabled()) {
+                PrepareOutput();
+            }
+            int64_t write_start_time = esp_timer_get_time();
+            codec_->OutputData(mix_buffer_);
+            last_write_time_us_ = esp_timer_get_time();
+            last_output_time_us_ = last_write_time_us_;
+            playback_clock_.OnWritten(mix_buffer_.size(), write_start_time, last_write_time_us_);
+            for (auto& frame : played_frames_) {
+                latency_tracer_.Record(kLatencyStageDecodedToPlayed, frame.decoded_time_us, last_write_time_us_);
+                latency_tracer_.Record(kLatencyStageDownlinkTotal, frame.origin_time_us, last_write_time_us_);
+            }
+        }
+        played_frames_.clear();
+
+        /* The fade out is written, the speaker is silent once the DMA buffers written before it have played */
+        int64_t abort_time = abort_time_us_;
+        if (abort_time != 0 && !mixer_.IsFading(kAudioVoiceTts)) {
+            abort_time_us_ = 0;
+            int64_t dma_us = (int64_t)AUDIO_CODEC_DMA_DESC_NUM * AUDIO_CODEC_DMA_FRAME_NUM * 1000000 /
+                codec_->output_sample_rate();
+            int64_t silent_time = std::max(esp_timer_get_time(), last_write_time_us_ + dma_us);
+            latency_tracer_.Record(kLatencyStageAbortToSilence, abort_time, silent_time);
+            ESP_LOGI(TAG, "Playback aborted, silent after %lld ms", (silent_time - abort_time) / 1000);
         }
-#endif
     }
 
     ESP_LOGW(TAG, "Audio output task stopped");
 }
 
-void AudioService::OpusCodecTask() {
+void AudioService::OnFramePlayed(AudioVoice voice, std::unique_ptr<AudioTask>&& task) {
+    // Called by the mixer when the last sample of the frame is mixed, it is traced once the period is written
+    if (voice == kAudioVoiceTts) {
+        if (played_frames_.size() < played_frames_.capacity()) {
+            played_frames_.push_back({task->origin_time_us, task->processed_time_us});
+        }
+        debug_statistics_.playback_count++;
+    }
+    task_pool_.Release(std::move(task));
+}
+
+void AudioService::OpusDecodeTask() {
     while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() {
-            return service_stopped_ ||
-                (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) ||
-                (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE);
-        });
         if (service_stopped_) {
             break;
         }
 
-        /* Decode the audio from decode queue */
-        if (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE) {
-            auto packet = std::move(audio_decode_queue_.front());
-            audio_decode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
-
-            auto task = std::make_unique<AudioTask>();
-            task->type = kAudioTaskTypeDecodeToPlaybackQueue;
-            task->timestamp = packet->timestamp;
-
-            SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
-            if (opus_decoder_->Decode(std::move(packet->payload), task->pcm)) {
-                // Resample if the sample rate is different
-                if (opus_decoder_->sample_rate() != codec_->output_sample_rate()) {
-                    int target_size = output_resampler_.GetOutputSamples(task->pcm.size());
-                    std::vector<int16_t> resampled(target_size);
-                    output_resampler_.Process(task->pcm.data(), task->pcm.size(), resampled.data());
-                    task->pcm = std::move(resampled);
-                }
+        /* Read before the reset flag: an abort after this point drops the frame decoded below */
+        uint32_t epoch = playback_epoch_;
+        if (jitter_buffer_reset_.exchange(false)) {
+            jitter_buffer_.Reset();
+            // A new stream follows, the decoders are reset here since they belong to this task
+            decoder_pool_.ResetState();
+        }
 
-                lock.lock();
-                audio_playback_queue_.push_back(std::move(task));
-                audio_queue_cv_.notify_all();
-            } else {
-                ESP_LOGE(TAG, "Failed to decode audio");
-                lock.lock();
+        /* Local sounds first, they play over the speech that is already in the playback queue */
+        size_t effect_limit = QUEUE_FRAMES(MAX_EFFECT_QUEUE_MS, OPUS_FRAME_DURATION_MS);
+        bool effect_decoded = false;
+        bool effect_full = false;
+        for (auto& effect : effects_) {
+            if (effect.queue.Size() >= effect_limit) {
+                effect_full = true;
+            } else if (DecodeEffectFrame(effect)) {
+                effect_decoded = true;
             }
-            debug_statistics_.decode_count++;
-        }
-        
-        /* Encode the audio to send queue */
-        if (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) {
-            auto task = std::move(audio_encode_queue_.front());
-            audio_encode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
-
-            auto packet = std::make_unique<AudioStreamPacket>();
-            packet->frame_duration = OPUS_FRAME_DURATION_MS;
-            packet->sample_rate = 16000;
-            packet->timestamp = task->timestamp;
-            if (!opus_encoder_->Encode(std::move(task->pcm), packet->payload)) {
-                ESP_LOGE(TAG, "Failed to encode audio");
+        }
+        if (effect_decoded) {
+            continue;
+        }
+
+        /* Fill the sound cache while no speech is coming in */
+        if (jitter_buffer_.Size() == 0 && audio_decode_queue_.Empty() && WarmUpSound()) {
+            continue;
+        }
+        uint32_t warmup = decoder_warmup_.exchange(0);
+        if (warmup != 0) {
+            decoder_pool_.WarmUp(warmup >> 8, warmup & 0xFF);
+        }
+
+        /* Move the arrived packets into the jitter buffer right away, so their arrival time is accurate */
+        std::unique_ptr<AudioStreamPacket> packet;
+        while (jitter_buffer_.Size() < jitter_buffer_.capacity() && audio_decode_queue_.Pop(packet)) {
+            /* Checked after the pop: a pause marked before its packet was pushed is seen here */
+            if (jitter_buffer_pause_.exchange(false)) {
+                jitter_buffer_.MarkPause();
+            }
+            jitter_buffer_.Put(std::move(packet), esp_timer_get_time());
+        }
+        if (jitter_buffer_pause_.exchange(false)) {
+            jitter_buffer_.MarkPause();
+        }
+
+        TickType_t wait_ticks = portMAX_DELAY;
+        size_t playback_limit = QUEUE_FRAMES(MAX_PLAYBACK_QUEUE_MS, decoder_pool_.frame_duration());
+        bool playback_full = audio_playback_queue_.Size() >= playback_limit;
+        if (!playback_full) {
+            int64_t wait_us;
+            auto result = jitter_buffer_.Get(packet, esp_timer_get_time(), wait_us);
+            if (result == kJitterBufferPacket) {
+                DecodePacket(std::move(packet), epoch);
+                continue;
+            } else if (result == kJitterBufferConceal) {
+                DecodePacket(nullptr, epoch);
                 continue;
             }
+            if (wait_us >= 0) {
+                wait_ticks = pdMS_TO_TICKS((wait_us + 999) / 1000) + 1;
+            }
+        }
 
-            if (task->type == kAudioTaskTypeEncodeToSendQueue) {
-                {
-                    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-                    audio_send_queue_.push_back(std::move(packet));
-                }
-                if (callbacks_.on_send_queue_available) {
-                    callbacks_.on_send_queue_available();
-                }
-            } else if (task->type == kAudioTaskTypeEncodeToTestingQueue) {
-                std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-                audio_testing_queue_.push_back(std::move(packet));
+        /* Sleep until a packet arrives, the playback queue has room, or the prefill times out */
+        bool can_receive = jitter_buffer_.Size() < jitter_buffer_.capacity();
+        if (can_receive) {
+            audio_decode_queue_.ArmConsumerWakeup();
+        }
+        if (playback_full) {
+            audio_playback_queue_.ArmProducerWakeup();
+        }
+        if (effect_full) {
+            // PlaySound() notifies the task directly, only a full effect queue needs to be armed
+            for (auto& effect : effects_) {
+                effect.queue.ArmProducerWakeup();
             }
-            debug_statistics_.encode_count++;
-            lock.lock();
+        }
+        bool has_work = (can_receive && !audio_decode_queue_.Empty()) || (playback_full && audio_playback_queue_.Size() < playback_limit);
+        if (!has_work && !service_stopped_ && !jitter_buffer_reset_) {
+            ulTaskNotifyTake(pdTRUE, wait_ticks);
         }
     }
 
-    ESP_LOGW(TAG, "Opus codec task stopped");
+    ESP_LOGW(TAG, "Opus decode task stopped");
 }
 
-void AudioService::SetDecodeSampleRate(int sample_rate, int frame_duration) {
-    if (opus_decoder_->sample_rate() == sample_rate && opus_decoder_->duration_ms() == frame_duration) {
+void AudioService::DecodePacket(std::unique_ptr<AudioStreamPacket> packet, uint32_t epoch) {
+#if CONFIG_AUDIO_CODEC_BENCHMARK
+    int64_t start_time = esp_timer_get_time();
+#endif
+    auto task = task_pool_.Acquire();
+    task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+    task->timestamp = 0;
+    task->origin_time_us = 0;
+
+    bool decoded;
+    if (packet) {
+        task->timestamp = packet->timestamp;
+        task->origin_time_us = packet->origin_time_us;
+        // A warm decoder of the packet format, with its state, becomes current
+        decoder_pool_.Select(packet->sample_rate, packet->frame_duration);
+        decoded = decoder_pool_.current().decoder->Decode(packet->data(), packet->size(), task->pcm);
+        RecyclePacket(std::move(packet));
+    } else {
+        // An empty payload makes the Opus decoder run packet loss concealment for one frame
+        decoded = decoder_pool_.current().decoder->Decode(nullptr, 0, task->pcm);
+    }
+    if (!decoded) {
+        ESP_LOGE(TAG, "Failed to decode audio");
+        task_pool_.Release(std::move(task));
         return;
     }
 
-    opus_decoder_.reset();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(sample_rate, 1, frame_duration);
+    auto& slot = decoder_pool_.current();
+#if CONFIG_USE_AUDIO_DEBUGGER
+    audio_debugger_->Feed(kAudioDebugTapDecoderOutput, task->pcm, 1, slot.decoder->sample_rate());
+#endif
+    // Resample if the sample rate is different
+    if (slot.decoder->sample_rate() != codec_->output_sample_rate()) {
+        int target_size = slot.resampler.GetOutputSamples(task->pcm.size());
+        resample_buffer_.resize(target_size);
+        slot.resampler.Process(task->pcm.data(), task->pcm.size(), resample_buffer_.data());
+        task->pcm.assign(resample_buffer_.begin(), resample_buffer_.end());
+    }
+#if CONFIG_AUDIO_CODEC_BENCHMARK
+    decode_benchmark_.Add(esp_timer_get_time() - start_time);
+#endif
+    task->processed_time_us = esp_timer_get_time();
+    latency_tracer_.Record(kLatencyStageReceivedToDecoded, task->origin_time_us, task->processed_time_us);
+    if (epoch != playback_epoch_) {
+        /* Aborted while decoding, the frame belongs to the old stream */
+        task_pool_.Release(std::move(task));
+        return;
+    }
+    audio_playback_queue_.Push(std::move(task));
+    debug_statistics_.decode_count++;
+}
+
+void AudioService::OpusEncodeTask() {
+    bool send_stalled = false;
+    bool send_waited = false;
+    while (true) {
+        if (service_stopped_) {
+            break;
+        }
+
+        /* Leave the packets in the encode queue while the send queue is full */
+        size_t send_limit = QUEUE_FRAMES(MAX_SEND_QUEUE_MS, frame_duration_);
+        if (audio_send_queue_.Size() >= send_limit) {
+            send_stalled = true;
+            send_waited = true;
+            audio_send_queue_.WaitForSpace(portMAX_DELAY, send_limit);
+            continue;
+        }
+        std::unique_ptr<AudioTask> task;
+        if (!audio_encode_queue_.Pop(task)) {
+            audio_encode_queue_.WaitForData(portMAX_DELAY);
+            continue;
+        }
+        /* Another frame already waiting means the encoder is behind, unless the network held it back */
+        bool backlog = !audio_encode_queue_.Empty() && !send_stalled;
+        if (audio_encode_queue_.Empty()) {
+            send_stalled = false;
+        }
+        if (task->type == kAudioTaskTypeEncodeToRecorder) {
+            EncodeRecorderFrame(std::move(task));
+            continue;
+        }
 
-    auto codec = Board::GetInstance().GetAudioCodec();
-    if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
-        ESP_LOGI(TAG, "Resampling audio from %d to %d", opus_decoder_->sample_rate(), codec->output_sample_rate());
-        output_resampler_.Configure(opus_decoder_->sample_rate(), codec->output_sample_rate());
+        int64_t start_time = esp_timer_get_time();
+        /* The frame duration may have been renegotiated, follow the size of the captured frame */
+        int frame_duration = task->pcm.size() * 1000 / 16000;
+        if (frame_duration != opus_encoder_->duration_ms() && frame_duration >= MIN_OPUS_FRAME_DURATION_MS &&
+            frame_duration <= MAX_OPUS_FRAME_DURATION_MS) {
+            ESP_LOGI(TAG, "Encoder frame duration changed from %d to %d ms", opus_encoder_->duration_ms(), frame_duration);
+            opus_encoder_.reset();
+            opus_encoder_ = std::make_unique<OpusFrameEncoder>(16000, 1, frame_duration);
+            opus_encoder_->SetComplexity(encoder_governor_.complexity());
+            opus_encoder_->SetBitrate(encoder_governor_.bitrate());
+#if CONFIG_AUDIO_UPLINK_DTX
+            opus_encoder_->SetDtx(true);
+#endif
+        }
+
+        auto packet = AcquirePacket();
+        packet->frame_duration = opus_encoder_->duration_ms();
+        packet->sample_rate = 16000;
+        packet->timestamp = task->timestamp;
+        packet->origin_time_us = task->origin_time_us;
+        packet->processed_time_us = task->processed_time_us;
+#if CONFIG_USE_AUDIO_DEBUGGER
+        audio_debugger_->Feed(kAudioDebugTapEncoderInput, task->pcm, 1, 16000);
+#endif
+        bool encoded = opus_encoder_->Encode(task->pcm, packet->payload);
+        auto type = task->type;
+        task_pool_.Release(std::move(task));
+        if (!encoded) {
+            ESP_LOGE(TAG, "Failed to encode audio");
+            RecyclePacket(std::move(packet));
+            continue;
+        }
+        uint32_t encode_us = esp_timer_get_time() - start_time;
+#if CONFIG_AUDIO_CODEC_BENCHMARK
+        encode_benchmark_.Add(encode_us);
+#endif
+
+        if (type == kAudioTaskTypeEncodeToSendQueue) {
+            /* The frame the network held back is the one that waited for space in the send queue */
+            bool stalled = send_waited;
+            send_waited = false;
+            if (encoder_governor_.OnFrameEncoded(encode_us, packet->frame_duration, packet->payload.size(), backlog,
+                    stalled)) {
+                opus_encoder_->SetComplexity(encoder_governor_.complexity());
+                opus_encoder_->SetBitrate(encoder_governor_.bitrate());
+            }
+            packet->encoded_time_us = esp_timer_get_time();
+            latency_tracer_.Record(kLatencyStageProcessedToEncoded, packet->processed_time_us, packet->encoded_time_us);
+            uplink_gate_.Process(std::move(packet), voice_detected_, audio_processor_->IsVadEnabled());
+        }
+        debug_statistics_.encode_count++;
+    }
+
+    ESP_LOGW(TAG, "Opus encode task stopped");
+}
+
+void AudioService::EncodeRecorderFrame(std::unique_ptr<AudioTask>&& task) {
+    /* Recordings have an encoder of their own, the uplink encoder keeps its state and its frame duration */
+    if (!recorder_encoder_) {
+        recorder_encoder_ = std::make_unique<OpusEncoderWrapper>(AUDIO_RECORDER_SAMPLE_RATE, 1, OPUS_FRAME_DURATION_MS);
     }
+    auto packet = AcquirePacket();
+    uint32_t sequence = task->timestamp;
+    bool encoded = recorder_encoder_->Encode(std::move(task->pcm), packet->payload);
+    task_pool_.Release(std::move(task));
+    if (!encoded) {
+        ESP_LOGE(TAG, "Failed to encode recorder frame");
+    } else if (!recorder_.WriteOpus(packet->payload, sequence)) {
+        // The recording is over, the next one starts with a new encoder
+        recorder_encoder_.reset();
+    }
+    RecyclePacket(std::move(packet));
 }
 
-void AudioService::PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm) {
-    auto task = std::make_unique<AudioTask>();
+void AudioService::PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm, int64_t origin_time_us,
+    int64_t capture_time_us) {
+    auto task = task_pool_.Acquire();
     task->type = type;
-    task->pcm = std::move(pcm);
-    
-    /* Push the task to the encode queue */
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-
-    /* If the task is to send queue, we need to set the timestamp */
-    if (type == kAudioTaskTypeEncodeToSendQueue && !timestamp_queue_.empty()) {
-        if (timestamp_queue_.size() <= MAX_TIMESTAMPS_IN_QUEUE) {
-            task->timestamp = timestamp_queue_.front();
-        } else {
-            ESP_LOGW(TAG, "Timestamp queue (%u) is full, dropping timestamp", timestamp_queue_.size());
-        }
-        timestamp_queue_.pop_front();
+    task->timestamp = 0;
+    task->origin_time_us = origin_time_us;
+    task->processed_time_us = esp_timer_get_time();
+    latency_tracer_.Record(kLatencyStageCaptureToProcessed, origin_time_us, task->processed_time_us);
+    /* Swap instead of copying: the caller gets the pooled buffer back and reuses it for its next frame.
+     * A caller buffer too small for a decoded frame grows once when the task is used for decoding. */
+    task->pcm.swap(pcm);
+
+#if CONFIG_USE_SERVER_AEC
+    /* The echo in the frame's first sample is the speech that played one loopback delay before it was captured */
+    if (type == kAudioTaskTypeEncodeToSendQueue && capture_time_us > 0) {
+        task->timestamp = playback_clock_.ServerTimestampAt(capture_time_us - loopback_delay_us_);
     }
+#endif
 
-    audio_queue_cv_.wait(lock, [this]() { return audio_encode_queue_.size() < MAX_ENCODE_TASKS_IN_QUEUE; });
-    audio_encode_queue_.push_back(std::move(task));
-    audio_queue_cv_.notify_all();
+    /* Push the task to the encode queue, wait for the opus codec task if it is full */
+    int frame_duration = frame_duration_;
+    size_t limit = QUEUE_FRAMES(MAX_ENCODE_QUEUE_MS, frame_duration);
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(encode_producer_mutex_);
+            if (audio_encode_queue_.Push(std::move(task), limit)) {
+                break;
+            }
+        }
+        if (service_stopped_) {
+            task_pool_.Release(std::move(task));
+            return;
+        }
+        audio_encode_queue_.WaitForSpace(pdMS_TO_TICKS(frame_duration), limit);
+    }
 }
 
 bool AudioService::PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait) {
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-    if (audio_decode_queue_.size() >= MAX_DECODE_PACKETS_IN_QUEUE) {
-        if (wait) {
-            audio_queue_cv_.wait(lock, [this]() { return audio_decode_queue_.size() < MAX_DECODE_PACKETS_IN_QUEUE; });
-        } else {
+    int frame_duration = packet->frame_duration > 0 ? packet->frame_duration : OPUS_FRAME_DURATION_MS;
+    size_t limit = QUEUE_FRAMES(MAX_DECODE_QUEUE_MS, frame_duration);
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(decode_producer_mutex_);
+            if (audio_decode_queue_.Push(std::move(packet), limit)) {
+                return true;
+            }
+        }
+        if (!wait || service_stopped_) {
+            RecyclePacket(std::move(packet));
             return false;
         }
+        // Several producers may wait here and only the last one is armed, so wait at most one frame
+        audio_decode_queue_.WaitForSpace(pdMS_TO_TICKS(frame_duration), limit);
     }
-    audio_decode_queue_.push_back(std::move(packet));
-    audio_queue_cv_.notify_all();
-    return true;
 }
 
 std::unique_ptr<AudioStreamPacket> AudioService::PopPacketFromSendQueue() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    if (audio_send_queue_.empty()) {
-        return nullptr;
-    }
-    auto packet = std::move(audio_send_queue_.front());
-    audio_send_queue_.pop_front();
-    audio_queue_cv_.notify_all();
+    std::unique_ptr<AudioStreamPacket> packet;
+    audio_send_queue_.Pop(packet);
     return packet;
 }
 
-void AudioService::EncodeWakeWord() {
-    if (wake_word_) {
-        wake_word_->EncodeWakeWordData();
-    }
+std::unique_ptr<AudioStreamPacket> AudioService::AcquirePacket() {
+    auto packet = packet_pool_.Acquire();
+    packet->Reset();
+    return packet;
+}
+
+void AudioService::RecyclePacket(std::unique_ptr<AudioStreamPacket>&& packet) {
+    packet_pool_.Release(std::move(packet));
 }
 
 const std::string& AudioService::GetLastWakeWord() const {
@@ -453,10 +820,11 @@ const std::string& AudioService::GetLastWakeWord() const {
 }
 
 std::unique_ptr<AudioStreamPacket> AudioService::PopWakeWordPacket() {
-    auto packet = std::make_unique<AudioStreamPacket>();
+    auto packet = AcquirePacket();
     if (wake_word_->GetWakeWordOpus(packet->payload)) {
         return packet;
     }
+    RecyclePacket(std::move(packet));
     return nullptr;
 }
 
@@ -482,35 +850,95 @@ void AudioService::EnableWakeWordDetection(bool enable) {
     }
 }
 
+bool AudioService::SetSpeechCommands(const std::vector<SpeechCommand>& commands) {
+    return wake_word_ && wake_word_->SetCommands(commands);
+}
+
+std::vector<SpeechCommand> AudioService::GetSpeechCommands() {
+    return wake_word_ ? wake_word_->GetCommands() : std::vector<SpeechCommand>();
+}
+
+void AudioService::OnSpeechCommand(int command_id, std::function<void(const SpeechCommand& command)> callback) {
+    if (wake_word_) {
+        wake_word_->OnCommandDetected(command_id, callback);
+    }
+}
+
 void AudioService::EnableVoiceProcessing(bool enable) {
     ESP_LOGD(TAG, "%s voice processing", enable ? "Enabling" : "Disabling");
     if (enable) {
         if (!audio_processor_initialized_) {
-            audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS);
+            audio_processor_->Initialize(codec_, frame_duration_);
             audio_processor_initialized_ = true;
+        } else {
+            // The processor is stopped here, so it is safe to follow a renegotiated frame duration
+            audio_processor_->SetFrameDuration(frame_duration_);
         }
 
         /* We should make sure no audio is playing */
         ResetDecoder();
+        latency_tracer_.ResetCapture();
         audio_input_need_warmup_ = true;
         audio_processor_->Start();
         xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_PROCESSOR_RUNNING);
     } else {
         audio_processor_->Stop();
         xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_PROCESSOR_RUNNING);
+        uplink_gate_.EndSession();
     }
 }
 
 void AudioService::EnableAudioTesting(bool enable) {
     ESP_LOGI(TAG, "%s audio testing", enable ? "Enabling" : "Disabling");
     if (enable) {
-        xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
+#if CONFIG_AUDIO_TESTING_RAW_PCM
+        StartRecording(kAudioTapMicrophone, kAudioRecordFormatPcm, CONFIG_AUDIO_TESTING_DURATION * 1000);
+#else
+        StartRecording(kAudioTapMicrophone, kAudioRecordFormatOpus, CONFIG_AUDIO_TESTING_DURATION * 1000);
+#endif
     } else {
-        xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
-        /* Copy audio_testing_queue_ to audio_decode_queue_ */
-        std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-        audio_decode_queue_ = std::move(audio_testing_queue_);
-        audio_queue_cv_.notify_all();
+        /* The recording stopped by itself once it was full, play the last one */
+        auto recording = StopRecording();
+        PlayRecording(recording ? recording : recorder_.last_recording());
+    }
+}
+
+bool AudioService::StartRecording(AudioTap tap, AudioRecordFormat format, int duration_ms) {
+    /* The reference tap is only fed from a second input channel, it would record nothing */
+    if (tap == kAudioTapReference && codec_->input_channels() < 2) {
+        ESP_LOGW(TAG, "No reference channel to record");
+        return false;
+    }
+    if (!recorder_.Start(tap, format, duration_ms)) {
+        return false;
+    }
+    /* The input task reads the raw taps even when neither the wake word nor the processor runs */
+    if (tap != kAudioTapProcessed) {
+        xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_RECORDING_RUNNING);
+    }
+    return true;
+}
+
+std::shared_ptr<const AudioRecording> AudioService::StopRecording() {
+    xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_RECORDING_RUNNING);
+    return recorder_.Stop();
+}
+
+void AudioService::PlayRecording(std::shared_ptr<const AudioRecording> recording, AudioVoice voice) {
+    if (!recording || recording->size == 0) {
+        ESP_LOGW(TAG, "No recording to play");
+        return;
+    }
+    if (voice == kAudioVoiceTts) {
+        voice = kAudioVoiceUi;
+    }
+    auto& effect = effects_[voice - kAudioVoiceUi];
+    {
+        std::lock_guard<std::mutex> lock(effect.mutex);
+        effect.pending.push_back({recording->view(), esp_timer_get_time(), recording});
+    }
+    if (opus_decode_task_handle_ != nullptr) {
+        xTaskNotifyGive(opus_decode_task_handle_);
     }
 }
 
@@ -523,51 +951,618 @@ void AudioService::SetCallbacks(AudioServiceCallbacks& callbacks) {
     callbacks_ = callbacks;
 }
 
-void AudioService::PlaySound(const std::string_view& sound) {
-    const char* data = sound.data();
-    size_t size = sound.size();
-    for (const char* p = data; p < data + size; ) {
-        auto p3 = (BinaryProtocol3*)p;
-        p += sizeof(BinaryProtocol3);
+void AudioService::PlaySound(const std::string_view& sound, AudioVoice voice) {
+    if (sound.empty()) {
+        return;
+    }
+    if (voice == kAudioVoiceTts) {
+        voice = kAudioVoiceUi;
+    }
+    auto& effect = effects_[voice - kAudioVoiceUi];
+    {
+        std::lock_guard<std::mutex> lock(effect.mutex);
+        effect.pending.push_back({sound, esp_timer_get_time()});
+    }
+    if (opus_decode_task_handle_ != nullptr) {
+        xTaskNotifyGive(opus_decode_task_handle_);
+    }
+}
 
-        auto payload_size = ntohs(p3->payload_size);
-        auto packet = std::make_unique<AudioStreamPacket>();
-        packet->sample_rate = 16000;
-        packet->frame_duration = 60;
-        packet->payload.resize(payload_size);
-        memcpy(packet->payload.data(), p3->payload, payload_size);
-        p += payload_size;
+// Points the packet at the next frame of a P3 stream, in place. False at the end or on a truncated frame.
+static bool NextP3Frame(const std::string_view& sound, size_t& offset, AudioStreamPacket& packet) {
+    if (offset + sizeof(BinaryProtocol3) > sound.size()) {
+        return false;
+    }
+    auto p3 = (const BinaryProtocol3*)(sound.data() + offset);
+    size_t payload_size = ntohs(p3->payload_size);
+    if (offset + sizeof(BinaryProtocol3) + payload_size > sound.size()) {
+        return false;
+    }
+    packet.sample_rate = 16000;
+    packet.frame_duration = OPUS_FRAME_DURATION_MS;
+    packet.span_data = p3->payload;
+    packet.span_size = payload_size;
+    offset += sizeof(BinaryProtocol3) + payload_size;
+    return true;
+}
+
+static size_t CountP3Frames(const std::string_view& sound) {
+    size_t frames = 0;
+    size_t offset = 0;
+    AudioStreamPacket packet;
+    while (NextP3Frame(sound, offset, packet)) {
+        frames++;
+    }
+    return frames;
+}
+
+bool AudioService::DecodeSoundFrame(OpusSpanDecoder& decoder, AudioResampler& resampler, const AudioStreamPacket& packet,
+    std::vector<int16_t>& pcm) {
+    // The decoder reads the payload where it is, in the flash mapping
+    if (!decoder.Decode(packet.data(), packet.size(), pcm)) {
+        return false;
+    }
+
+    if (codec_->output_sample_rate() != 16000) {
+        int target_size = resampler.GetOutputSamples(pcm.size());
+        resample_buffer_.resize(target_size);
+        resampler.Process(pcm.data(), pcm.size(), resample_buffer_.data());
+        pcm.assign(resample_buffer_.begin(), resample_buffer_.end());
+    }
+    return true;
+}
 
-        PushPacketToDecodeQueue(std::move(packet), true);
+bool AudioService::DecodeEffectFrame(AudioEffectVoice& effect) {
+    // Local sounds are 60ms frames at 16kHz, resampled to the output rate
+    size_t frame_samples = codec_->output_sample_rate() * OPUS_FRAME_DURATION_MS / 1000;
+    bool first_frame = false;
+    if (effect.offset >= effect.playing.data.size()) {
+        {
+            // The sound stays at the front of pending until it is decoded, so IsIdle() sees it
+            std::lock_guard<std::mutex> lock(effect.mutex);
+            if (!effect.playing.data.empty()) {
+                effect.pending.pop_front();
+                effect.playing = {};
+            }
+            if (effect.pending.empty()) {
+                // The voice is idle, give the decoder memory back until the next sound
+                effect.decoder.reset();
+                return false;
+            }
+            effect.playing = effect.pending.front();
+            effect.offset = 0;
+        }
+        first_frame = true;
+
+        // A recording is not cached, its buffer may be freed and its address reused by the next one
+        bool cacheable = sound_cache_.capacity_bytes() > 0 && !effect.playing.recording;
+        effect.cached = cacheable ? sound_cache_.Find(effect.playing.data) : nullptr;
+        effect.cached_offset = 0;
+        if (!effect.cached) {
+            if (effect.decoder) {
+                effect.decoder->ResetState();
+            } else {
+                effect.decoder = std::make_unique<OpusSpanDecoder>(16000, 1, OPUS_FRAME_DURATION_MS);
+            }
+            // No tail of the previous sound in the filter, so the PCM matches what WarmUpSound() caches
+            effect.resampler.Reset();
+            effect.filling = cacheable ?
+                sound_cache_.Create(effect.playing.data, CountP3Frames(effect.playing.data) * frame_samples) : nullptr;
+            effect.filled = 0;
+        }
+    }
+
+    auto task = task_pool_.Acquire();
+    task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+    task->timestamp = 0;
+    // The mixer measures the start latency of the sound from its first frame
+    task->origin_time_us = first_frame ? effect.playing.request_time_us : 0;
+    task->processed_time_us = 0;
+
+    if (effect.cached) {
+        /* Cached sounds skip the Opus decoder, the frame is a copy */
+        size_t count = std::min(frame_samples, effect.cached->samples - effect.cached_offset);
+        task->pcm.assign(effect.cached->pcm + effect.cached_offset, effect.cached->pcm + effect.cached_offset + count);
+        effect.cached_offset += count;
+        if (effect.cached_offset >= effect.cached->samples) {
+            effect.offset = effect.playing.data.size();
+            effect.cached.reset();
+        }
+        effect.queue.Push(std::move(task));
+        return true;
+    }
+
+    if (effect.playing.recording && effect.playing.recording->format == kAudioRecordFormatPcm) {
+        /* A PCM recording is 16 kHz like the decoded sounds, it is only resampled */
+        size_t count = std::min<size_t>(AUDIO_RECORDER_FRAME_SAMPLES, (effect.playing.data.size() - effect.offset) / sizeof(int16_t));
+        auto pcm = (const int16_t*)(effect.playing.data.data() + effect.offset);
+        effect.offset = count > 0 ? effect.offset + count * sizeof(int16_t) : effect.playing.data.size();
+        if (codec_->output_sample_rate() != AUDIO_RECORDER_SAMPLE_RATE) {
+            task->pcm.resize(effect.resampler.GetOutputSamples(count));
+            effect.resampler.Process(pcm, count, task->pcm.data());
+        } else {
+            task->pcm.assign(pcm, pcm + count);
+        }
+        effect.queue.Push(std::move(task));
+        return true;
+    }
+
+    AudioStreamPacket frame;
+    if (!NextP3Frame(effect.playing.data, effect.offset, frame)) {
+        ESP_LOGE(TAG, "Truncated P3 sound at offset %u", effect.offset);
+        effect.offset = effect.playing.data.size();
+        effect.filling.reset();
+        task_pool_.Release(std::move(task));
+        return true;
+    }
+    if (!DecodeSoundFrame(*effect.decoder, effect.resampler, frame, task->pcm)) {
+        ESP_LOGE(TAG, "Failed to decode sound");
+        effect.filling.reset();
+        task_pool_.Release(std::move(task));
+        return true;
+    }
+
+    if (effect.filling) {
+        if (effect.filled + task->pcm.size() <= effect.filling->samples) {
+            memcpy(effect.filling->pcm + effect.filled, task->pcm.data(), task->pcm.size() * sizeof(int16_t));
+            effect.filled += task->pcm.size();
+        } else {
+            effect.filling.reset();
+        }
+        if (effect.filling && effect.offset >= effect.playing.data.size()) {
+            if (effect.filled == effect.filling->samples) {
+                sound_cache_.Insert(std::move(effect.filling));
+            }
+            effect.filling.reset();
+        }
     }
+    effect.queue.Push(std::move(task));
+    return true;
+}
+
+void AudioService::CacheSound(const std::string_view& sound) {
+    if (sound.empty() || sound_cache_.capacity_bytes() == 0) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(warmup_mutex_);
+        warmup_sounds_.push_back(sound);
+    }
+    if (opus_decode_task_handle_ != nullptr) {
+        xTaskNotifyGive(opus_decode_task_handle_);
+    }
+}
+
+void AudioService::WarmUpDecoder(int sample_rate, int frame_duration) {
+    decoder_warmup_ = (uint32_t)sample_rate << 8 | (frame_duration & 0xFF);
+    if (opus_decode_task_handle_ != nullptr) {
+        xTaskNotifyGive(opus_decode_task_handle_);
+    }
+}
+
+bool AudioService::WarmUpSound() {
+    std::string_view sound;
+    {
+        std::lock_guard<std::mutex> lock(warmup_mutex_);
+        if (warmup_sounds_.empty()) {
+            return false;
+        }
+        sound = warmup_sounds_.front();
+        warmup_sounds_.pop_front();
+    }
+
+    size_t frame_samples = codec_->output_sample_rate() * OPUS_FRAME_DURATION_MS / 1000;
+    auto cached = sound_cache_.Create(sound, CountP3Frames(sound) * frame_samples);
+    if (!cached) {
+        return true;
+    }
+    OpusSpanDecoder decoder(16000, 1, OPUS_FRAME_DURATION_MS);
+    AudioResampler resampler;
+    if (codec_->output_sample_rate() != 16000) {
+        resampler.Configure(16000, codec_->output_sample_rate());
+    }
+
+    auto task = task_pool_.Acquire();
+    size_t offset = 0;
+    size_t filled = 0;
+    AudioStreamPacket frame;
+    while (NextP3Frame(sound, offset, frame)) {
+        if (!DecodeSoundFrame(decoder, resampler, frame, task->pcm) ||
+            filled + task->pcm.size() > cached->samples) {
+            break;
+        }
+        memcpy(cached->pcm + filled, task->pcm.data(), task->pcm.size() * sizeof(int16_t));
+        filled += task->pcm.size();
+    }
+    task_pool_.Release(std::move(task));
+
+    if (filled == cached->samples) {
+        ESP_LOGI(TAG, "Cached sound %p, %u samples", sound.data(), filled);
+        sound_cache_.Insert(std::move(cached));
+    } else {
+        ESP_LOGW(TAG, "Failed to cache sound %p", sound.data());
+    }
+    return true;
 }
 
 bool AudioService::IsIdle() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    return audio_encode_queue_.empty() && audio_decode_queue_.empty() && audio_playback_queue_.empty() && audio_testing_queue_.empty();
+    for (auto& effect : effects_) {
+        std::lock_guard<std::mutex> lock(effect.mutex);
+        if (!effect.pending.empty() || !effect.queue.Empty()) {
+            return false;
+        }
+    }
+    return audio_encode_queue_.Empty() && audio_decode_queue_.Empty() && audio_playback_queue_.Empty() &&
+        jitter_buffer_.Size() == 0;
 }
 
 void AudioService::ResetDecoder() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    opus_decoder_->ResetState();
-    timestamp_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    // The jitter buffer and the decoders belong to the decode task, they are reset there; the flush below wakes it up
+    jitter_buffer_reset_ = true;
+    playback_epoch_++;
+    audio_decode_queue_.Flush();
+    audio_playback_queue_.Flush();
+    mixer_.Reset(kAudioVoiceTts);
+}
+
+void AudioService::MarkSpeechPause() {
+    // Applied by the decode task, which owns the jitter buffer
+    jitter_buffer_pause_ = true;
+}
+
+void AudioService::AbortPlayback(int64_t trigger_time_us) {
+    jitter_buffer_reset_ = true;
+    playback_epoch_++;
+    audio_decode_queue_.Flush();
+    audio_playback_queue_.Flush();
+    /* The frame the mixer is playing is not cut, it is faded out over the next period so it does not click */
+    mixer_.FadeOut(kAudioVoiceTts);
+    abort_time_us_ = trigger_time_us > 0 ? trigger_time_us : esp_timer_get_time();
+    if (audio_output_task_handle_ != nullptr) {
+        xTaskNotifyGive(audio_output_task_handle_);
+    }
+}
+
+void AudioService::PrintDebugStatistics() {
+    ESP_LOGI(TAG, "input: %lu, encode: %lu, decode: %lu, playback: %lu",
+        debug_statistics_.input_count, debug_statistics_.encode_count, debug_statistics_.decode_count,
+        debug_statistics_.playback_count);
+
+    /* Bytes the input path allocated since the last report, measured where its buffers grow */
+    int64_t now_us = esp_timer_get_time();
+    if (last_statistics_time_us_ > 0 && now_us > last_statistics_time_us_) {
+        int64_t elapsed_us = now_us - last_statistics_time_us_;
+        ESP_LOGI(TAG, "input alloc: %llu B/s",
+            (debug_statistics_.input_alloc_bytes - last_input_alloc_bytes_) * 1000000 / elapsed_us);
+    }
+    last_statistics_time_us_ = now_us;
+    last_input_alloc_bytes_ = debug_statistics_.input_alloc_bytes;
+
+    auto print_queue = [](const char* name, const AudioRingStats& stats, size_t size) {
+        ESP_LOGI(TAG, "%s: size=%u push=%lu pop=%lu full=%lu flushed=%lu hwm=%lu producer_wait=%llums consumer_wait=%llums",
+            name, size, stats.push_count, stats.pop_count, stats.full_count, stats.flushed_count, stats.high_water,
+            stats.producer_wait_us / 1000, stats.consumer_wait_us / 1000);
+    };
+    print_queue("encode", audio_encode_queue_.stats(), audio_encode_queue_.Size());
+    print_queue("send", audio_send_queue_.stats(), audio_send_queue_.Size());
+    print_queue("decode", audio_decode_queue_.stats(), audio_decode_queue_.Size());
+    print_queue("playback", audio_playback_queue_.stats(), audio_playback_queue_.Size());
+    auto& ui = effects_[kAudioVoiceUi - kAudioVoiceUi].queue;
+    auto& alert = effects_[kAudioVoiceAlert - kAudioVoiceUi].queue;
+    print_queue("ui", ui.stats(), ui.Size());
+    print_queue("alert", alert.stats(), alert.Size());
+
+    auto cache = sound_cache_.GetStats();
+    ESP_LOGI(TAG, "sound cache: sounds=%u used=%uKB/%uKB hits=%lu misses=%lu evictions=%lu rejected=%lu",
+        sound_cache_.GetCount(), sound_cache_.GetUsedBytes() / 1024, sound_cache_.capacity_bytes() / 1024,
+        cache.hits, cache.misses, cache.evictions, cache.rejected);
+
+    encoder_governor_.PrintStatistics();
+    uplink_gate_.PrintStatistics();
+    decoder_pool_.PrintStatistics();
+
+    auto& mixer = mixer_.stats();
+    ESP_LOGI(TAG, "mixer: periods=%lu ducked=%lu effects=%lu start avg=%lums max=%lums",
+        mixer.periods, mixer.ducked_periods, mixer.effect_starts,
+        (uint32_t)(mixer.effect_starts > 0 ? mixer.effect_start_total_us / mixer.effect_starts / 1000 : 0),
+        mixer.effect_start_max_us / 1000);
+
+    auto print_pool = [](const char* name, const AudioPoolStats& stats, size_t capacity) {
+        ESP_LOGI(TAG, "%s pool: capacity=%u hwm=%lu acquire=%lu release=%lu exhausted=%lu overflow=%lu",
+            name, capacity, stats.high_water, stats.acquire_count, stats.release_count,
+            stats.exhausted_count, stats.overflow_count);
+    };
+    print_pool("packet", packet_pool_.GetStats(), packet_pool_.capacity());
+    print_pool("task", task_pool_.GetStats(), task_pool_.capacity());
+
+    auto& jitter = jitter_buffer_.stats();
+    ESP_LOGI(TAG, "jitter buffer: size=%u depth=%lu jitter=%lums received=%lu reordered=%lu late=%lu overflow=%lu "
+        "concealed=%lu skipped=%lu underruns=%lu resyncs=%lu",
+        jitter_buffer_.Size(), jitter.target_depth, jitter.jitter_us / 1000, jitter.received, jitter.reordered,
+        jitter.late, jitter.overflow, jitter.concealed, jitter.skipped, jitter.underruns, jitter.resyncs);
+
+    latency_tracer_.PrintStatistics();
+
+#if CONFIG_AUDIO_CODEC_BENCHMARK
+    /* Per-frame codec time against the frame budget, and how long a frame waits before and after the codec */
+    auto print_benchmark = [](const char* name, const OpusBenchmarkStats& codec,
+        const AudioRingStats& in_queue, const AudioRingStats& out_queue, int frame_duration) {
+        auto avg = [](uint64_t total, uint32_t count) -> uint32_t { return count > 0 ? total / count : 0; };
+        uint32_t codec_avg = avg(codec.total_us, codec.frames);
+        ESP_LOGI(TAG, "%s benchmark: frames=%lu codec avg=%luus max=%luus load=%lu%%, "
+            "in queue avg=%luus max=%luus, out queue avg=%luus max=%luus",
+            name, codec.frames, codec_avg, codec.max_us, codec_avg * 100 / (frame_duration * 1000),
+            avg(in_queue.residency_total_us, in_queue.pop_count), in_queue.residency_max_us,
+            avg(out_queue.residency_total_us, out_queue.pop_count), out_queue.residency_max_us);
+    };
+    print_benchmark("encode", encode_benchmark_, audio_encode_queue_.stats(), audio_send_queue_.stats(), frame_duration_);
+    print_benchmark("decode", decode_benchmark_, audio_decode_queue_.stats(), audio_playback_queue_.stats(),
+        decoder_pool_.frame_duration());
+#endif
+
+#if CONFIG_AUDIO_LATENCY_COMPARISON
+    std::lock_guard<std::mutex> lock(latency_mutex_);
+    AccountLatency();
+    for (int i = 0; i < LATENCY_COMPARISON_BUCKETS; i++) {
+        auto& bucket = latency_buckets_[i];
+        int frame_duration = (i + 1) * MIN_OPUS_FRAME_DURATION_MS;
+        uint32_t uplink_pipeline = bucket.uplink_frames > 0 ? bucket.uplink_us / bucket.uplink_frames / 1000 : 0;
+        uint32_t downlink_pipeline = bucket.downlink_frames > 0 ? bucket.downlink_us / bucket.downlink_frames / 1000 : 0;
+        if (bucket.uplink_frames == 0 && bucket.downlink_frames == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "latency @%dms: uplink %lums (frame %d + pipeline %lu), downlink %lums (prefill %lu + pipeline %lu + frame %d), frames %lu/%lu",
+            frame_duration, frame_duration + uplink_pipeline, frame_duration, uplink_pipeline,
+            bucket.prefill_ms + downlink_pipeline + frame_duration, bucket.prefill_ms, downlink_pipeline, frame_duration,
+            bucket.uplink_frames, bucket.downlink_frames);
+    }
+#endif
+}
+
+void AudioService::SetFrameDuration(int frame_duration_ms) {
+    if (frame_duration_ms < MIN_OPUS_FRAME_DURATION_MS || frame_duration_ms > MAX_OPUS_FRAME_DURATION_MS ||
+        frame_duration_ms % MIN_OPUS_FRAME_DURATION_MS != 0) {
+        ESP_LOGW(TAG, "Unsupported frame duration: %d ms", frame_duration_ms);
+        return;
+    }
+    if (frame_duration_ == frame_duration_ms) {
+        return;
+    }
+
+#if CONFIG_AUDIO_LATENCY_COMPARISON
+    // Close the statistics of the old frame duration first
+    std::lock_guard<std::mutex> lock(latency_mutex_);
+    AccountLatency();
+#endif
+    ESP_LOGI(TAG, "Uplink frame duration: %d ms", frame_duration_ms);
+    // The input task and the encoder pick up the new duration with the next frame
+    frame_duration_ = frame_duration_ms;
+}
+
+#if CONFIG_AUDIO_LATENCY_COMPARISON
+/*
+ * Adds the codec time and queue residency since the last call to the bucket of the current frame duration.
+ * Uplink pipeline: encode queue + encoder + send queue. Downlink pipeline: decode queue + decoder + playback queue.
+ */
+void AudioService::AccountLatency() {
+    LatencySnapshot now;
+    now.encode_frames = encode_benchmark_.frames;
+    now.decode_frames = decode_benchmark_.frames;
+    now.uplink_us = encode_benchmark_.total_us + audio_encode_queue_.stats().residency_total_us +
+        audio_send_queue_.stats().residency_total_us;
+    now.downlink_us = decode_benchmark_.total_us + audio_decode_queue_.stats().residency_total_us +
+        audio_playback_queue_.stats().residency_total_us;
+
+    auto& bucket = latency_buckets_[frame_duration_ / MIN_OPUS_FRAME_DURATION_MS - 1];
+    bucket.uplink_frames += now.encode_frames - latency_snapshot_.encode_frames;
+    bucket.uplink_us += now.uplink_us - latency_snapshot_.uplink_us;
+    bucket.downlink_frames += now.decode_frames - latency_snapshot_.decode_frames;
+    bucket.downlink_us += now.downlink_us - latency_snapshot_.downlink_us;
+    if (now.decode_frames != latency_snapshot_.decode_frames) {
+        bucket.prefill_ms = jitter_buffer_.stats().target_depth * decoder_pool_.frame_duration();
+    }
+    latency_snapshot_ = now;
+}
+#endif
+
+void AudioService::ArmPowerTimer(int64_t timeout_us) {
+    // Already armed for an earlier deadline, it re-arms itself for the rest
+    if (!esp_timer_is_active(audio_power_timer_)) {
+        esp_timer_start_once(audio_power_timer_, timeout_us);
+    }
+}
+
+void AudioService::EnableCodecInput() {
+    std::lock_guard<std::mutex> lock(codec_power_mutex_);
+    last_input_time_us_ = esp_timer_get_time();
+    if (codec_->input_enabled()) {
+        return;
+    }
+    codec_->EnableInput(true);
+    ArmPowerTimer(AUDIO_POWER_TIMEOUT_MS * 1000);
+}
+
+void AudioService::PrepareOutput() {
+    std::lock_guard<std::mutex> lock(codec_power_mutex_);
+    last_output_time_us_ = esp_timer_get_time();
+    if (codec_->output_enabled()) {
+        return;
+    }
+    int64_t start_time = esp_timer_get_time();
+    codec_->EnableOutput(true);
+    ESP_LOGI(TAG, "Codec output enabled in %lld ms", (esp_timer_get_time() - start_time) / 1000);
+    ArmPowerTimer(AUDIO_POWER_TIMEOUT_MS * 1000);
+}
+
+int AudioService::CalibrateLoopbackDelay() {
+    std::lock_guard<std::mutex> lock(calibration_mutex_);
+    if (xEventGroupGetBits(event_group_) & AS_EVENT_LOOPBACK_CALIBRATION) {
+        ESP_LOGW(TAG, "Loopback calibration is still recording");
+        return -1;
+    }
+    loopback_captures_.clear();
+    xEventGroupClearBits(event_group_, AS_EVENT_LOOPBACK_CALIBRATION_DONE);
+    xEventGroupSetBits(event_group_, AS_EVENT_LOOPBACK_CALIBRATION);
+    auto bits = xEventGroupWaitBits(event_group_, AS_EVENT_LOOPBACK_CALIBRATION_DONE, pdTRUE, pdTRUE,
+        pdMS_TO_TICKS(LOOPBACK_CALIBRATION_PROBES * LOOPBACK_CALIBRATION_RECORD_MS * 2 + 1000));
+    std::vector<int> delays;
+    if (!(bits & AS_EVENT_LOOPBACK_CALIBRATION_DONE)) {
+        ESP_LOGE(TAG, "Loopback calibration timed out");
+    } else {
+        /* The search runs here, not on the input task */
+        for (size_t probe = 0; probe < loopback_captures_.size(); probe++) {
+            auto& capture = loopback_captures_[probe];
+            float score;
+            int index = AudioLoopbackProbe::Find(capture.mic.data(), capture.mic.size(), score);
+            if (index < 0 || score < LOOPBACK_PROBE_MIN_SCORE) {
+                ESP_LOGW(TAG, "Loopback probe %u: not found (score %.2f)", probe, score);
+                continue;
+            }
+            int delay = capture.first_time_us + (int64_t)index * 1000000 / 16000 - capture.played_time_us;
+            ESP_LOGI(TAG, "Loopback probe %u: delay %d us, score %.2f", probe, delay, score);
+            if (delay >= 0 && delay <= LOOPBACK_CALIBRATION_MAX_DELAY_MS * 1000) {
+                delays.push_back(delay);
+            }
+        }
+        loopback_captures_.clear();
+        loopback_captures_.shrink_to_fit();
+    }
+
+    if (delays.size() * 2 <= LOOPBACK_CALIBRATION_PROBES) {
+        ESP_LOGE(TAG, "Loopback calibration failed, %u of %d probes found", delays.size(), LOOPBACK_CALIBRATION_PROBES);
+        return -1;
+    }
+    std::sort(delays.begin(), delays.end());
+    int result = delays[delays.size() / 2];
+    loopback_delay_us_ = result;
+    loopback_delay_calibrated_ = true;
+    Settings settings("audio", true);
+    settings.SetInt("aec_delay_us", result);
+    ESP_LOGI(TAG, "Loopback delay calibrated: %d us", result);
+    return result;
+}
+
+void AudioService::RunLoopbackCalibration() {
+    /* Record the microphone around each probe, with the time of every read. The reads keep feeding the
+       wake word, in its own feed size, so it still listens while the probes play */
+    const size_t record_samples = 16000 * LOOPBACK_CALIBRATION_RECORD_MS / 1000;
+    std::vector<int16_t> mic;
+    mic.reserve(record_samples + 16000 / 10);
+    std::vector<size_t> read_ends;      // The sample after each read
+    std::vector<int64_t> read_times;
+    AudioLoopbackProbe::Generate(codec_->output_sample_rate(), probe_);
+    // Silence first, so the DMA is full and the clock knows exactly when the probe plays
+    size_t lead_in = (AUDIO_CODEC_DMA_DESC_NUM + 1) * AUDIO_CODEC_DMA_FRAME_NUM;
+    probe_.insert(probe_.begin(), lead_in, 0);
+    size_t probe_samples = 16000 * LOOPBACK_PROBE_MS / 1000;
+
+    // Like the uplink frames, a sample was captured when its read returned, less the samples after it
+    auto capture_time = [&](size_t index) {
+        size_t read = std::upper_bound(read_ends.begin(), read_ends.end(), index) - read_ends.begin();
+        return read_times[read] - (int64_t)(read_ends[read] - 1 - index) * 1000000 / 16000;
+    };
+    // The first sample captured at or after time_us
+    auto sample_at = [&](int64_t time_us) {
+        size_t index = 0;
+        while (index < mic.size() && capture_time(index) < time_us) {
+            index++;
+        }
+        return index;
+    };
+
+    for (int probe = 0; probe < LOOPBACK_CALIBRATION_PROBES && !service_stopped_; probe++) {
+        probe_position_ = -1;
+        mic.clear();
+        read_ends.clear();
+        read_times.clear();
+        bool read_ok = true;
+        bool probe_started = false;
+        while (mic.size() < record_samples && read_ok) {
+            bool feed_wake_word = xEventGroupGetBits(event_group_) & AS_EVENT_WAKE_WORD_RUNNING;
+            size_t samples = feed_wake_word ? wake_word_->GetFeedSize() : 16000 / 100;
+            if (samples == 0) {
+                feed_wake_word = false;
+                samples = 16000 / 100;
+            }
+            read_ok = ReadAudioData(input_frame_, 16000, samples);
+            if (!read_ok) {
+                break;
+            }
+            // The first channel is the microphone
+            size_t channels = codec_->input_channels();
+            for (size_t j = 0; j < samples; j++) {
+                mic.push_back(input_frame_[j * channels]);
+            }
+            read_ends.push_back(mic.size());
+            read_times.push_back(esp_timer_get_time());
+            if (feed_wake_word) {
+                wake_word_->Feed(input_frame_);
+            }
+            // Some silence before the probe, to start the microphone and the output
+            if (!probe_started && mic.size() >= 16000 * 50 / 1000) {
+                probe_started = true;
+                probe_requested_ = true;
+                xTaskNotifyGive(audio_output_task_handle_);
+            }
+        }
+        int64_t position = probe_position_;
+        int64_t played_time = position < 0 ? 0 : playback_clock_.TimeOfPosition(position + lead_in);
+        if (!read_ok || played_time == 0) {
+            ESP_LOGW(TAG, "Loopback probe %d: not played", probe);
+            continue;
+        }
+
+        // Only the delays that are accepted are kept for the search
+        size_t first = sample_at(played_time - LOOPBACK_CALIBRATION_MARGIN_MS * 1000);
+        size_t last = sample_at(played_time + LOOPBACK_CALIBRATION_MAX_DELAY_MS * 1000) + probe_samples;
+        if (last > mic.size()) {
+            last = mic.size();
+        }
+        if (first + probe_samples > last) {
+            ESP_LOGW(TAG, "Loopback probe %d: not recorded", probe);
+            continue;
+        }
+        LoopbackCapture capture;
+        capture.mic.assign(mic.begin() + first, mic.begin() + last);
+        capture.first_time_us = capture_time(first);
+        capture.played_time_us = played_time;
+        loopback_captures_.push_back(std::move(capture));
+    }
+
+    // The probe is only freed once the output task has written it
+    while (probe_playing_ || probe_requested_) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    probe_.clear();
+    probe_.shrink_to_fit();
+
+    xEventGroupClearBits(event_group_, AS_EVENT_LOOPBACK_CALIBRATION);
+    xEventGroupSetBits(event_group_, AS_EVENT_LOOPBACK_CALIBRATION_DONE);
 }
 
 void AudioService::CheckAndUpdateAudioPowerState() {
-    auto now = std::chrono::steady_clock::now();
-    auto input_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_input_time_).count();
-    auto output_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_output_time_).count();
-    if (input_elapsed > AUDIO_POWER_TIMEOUT_MS && codec_->input_enabled()) {
-        codec_->EnableInput(false);
+    /* One-shot: power down the idle channels, and come back only when the next one may be idle */
+    std::lock_guard<std::mutex> lock(codec_power_mutex_);
+    int64_t now = esp_timer_get_time();
+    int64_t timeout_us = AUDIO_POWER_TIMEOUT_MS * 1000;
+    int64_t next_check_us = 0;
+    if (codec_->input_enabled()) {
+        int64_t idle_us = now - last_input_time_us_;
+        if (idle_us >= timeout_us) {
+            codec_->EnableInput(false);
+        } else {
+            next_check_us = timeout_us - idle_us;
+        }
     }
-    if (output_elapsed > AUDIO_POWER_TIMEOUT_MS && codec_->output_enabled()) {
-        codec_->EnableOutput(false);
+    if (codec_->output_enabled()) {
+        int64_t idle_us = now - last_output_time_us_;
+        if (idle_us >= timeout_us) {
+            codec_->EnableOutput(false);
+        } else if (next_check_us == 0 || timeout_us - idle_us < next_check_us) {
+            next_check_us = timeout_us - idle_us;
+        }
     }
-    if (!codec_->input_enabled() && !codec_->output_enabled()) {
-        esp_timer_stop(audio_power_timer_);
+    if (next_check_us > 0) {
+        ArmPowerTimer(next_check_us);
     }
 }
\ No newline at end of file
@@ -3,9 +3,10 @@
 
 #include <memory>
 #include <deque>
-#include <condition_variable>
-#include <chrono>
 #include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <string_view>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -13,11 +14,23 @@
 #include <esp_timer.h>
 
 #include <opus_encoder.h>
-#include <opus_decoder.h>
-#include <opus_resampler.h>
 
 #include "audio_codec.h"
 #include "audio_processor.h"
+#include "audio_ring_buffer.h"
+#include "audio_object_pool.h"
+#include "audio_jitter_buffer.h"
+#include "audio_latency_tracer.h"
+#include "audio_mixer.h"
+#include "audio_sound_cache.h"
+#include "audio_resampler.h"
+#include "audio_decoder_pool.h"
+#include "audio_playback_clock.h"
+#include "audio_recorder.h"
+#include "opus_span_decoder.h"
+#include "opus_frame_encoder.h"
+#include "opus_encoder_governor.h"
+#include "audio_uplink_gate.h"
 #include "processors/audio_debugger.h"
 #include "wake_word.h"
 #include "protocol.h"
@@ -26,42 +39,79 @@
 /*
  * There are two types of audio data flow:
  * 1. (MIC) -> [Processors] -> {Encode Queue} -> [Opus Encoder] -> {Send Queue} -> (Server)
- * 2. (Server) -> {Decode Queue} -> [Opus Decoder] -> {Playback Queue} -> (Speaker)
+ * 2. (Server) -> {Decode Queue} -> [Jitter Buffer] -> [Opus Decoder] -> {Playback Queue} -> (Speaker)
  *
- * We use one task for MIC / Speaker / Processors, and one task for Opus Encoder / Opus Decoder.
+ * We use one task for MIC / Speaker / Processors, and one task for each direction of the Opus codec
+ * (opus_encode / opus_decode), so a burst of downlink audio never delays the uplink and vice versa.
+ * Core affinity and priority of the codec tasks are set in Kconfig.
  * 
  * Decode Queue and Send Queue are the main queues, because Opus packets are quite smaller than PCM packets.
- * 
+ *
+ * Every queue is a bounded single-producer / single-consumer ring (AudioRingBuffer) that wakes
+ * only its own consumer or producer with a task notification. The encode queue has several
+ * producers (the audio processor output, recorder frames from the input task), so its producer side
+ * is serialized by encode_producer_mutex_, and that of the decode queue by decode_producer_mutex_.
+ *
+ * Local sounds do not go through the decode queue: PlaySound() queues the P3 data on an effect voice,
+ * the decode task decodes it with the voice's own decoder ahead of the speech, and the output task
+ * mixes the voices (AudioMixer) one DMA period at a time.
+ *
+ * The AudioRecorder taps the microphone, the reference or the processor output into a preallocated
+ * buffer, its Opus frames are encoded by the encode task and it is played back on an effect voice.
+ *
+ * Encoded uplink frames pass the AudioUplinkGate on their way to the send queue, which can hold back
+ * the silence between utterances (CONFIG_AUDIO_UPLINK_VAD_GATE).
+ *
+ * AudioStreamPacket and AudioTask objects come from fixed pools with preallocated payload / pcm
+ * buffers (AcquirePacket / RecyclePacket), so the per-frame path does not allocate from the heap.
  */
 
+// Default frame duration, also used by local sounds and the wake word encoder.
+// The uplink frame duration is negotiated in the hello exchange, see SetFrameDuration().
 #define OPUS_FRAME_DURATION_MS 60
-#define MAX_ENCODE_TASKS_IN_QUEUE 2
-#define MAX_PLAYBACK_TASKS_IN_QUEUE 2
-#define MAX_DECODE_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
-#define MAX_SEND_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
-#define AUDIO_TESTING_MAX_DURATION_MS 10000
-#define MAX_TIMESTAMPS_IN_QUEUE 3
+#define MIN_OPUS_FRAME_DURATION_MS 20
+#define MAX_OPUS_FRAME_DURATION_MS 60
+
+// Queue depths are given in time, the frame limit follows the current frame duration
+#define MAX_ENCODE_QUEUE_MS 120
+#define MAX_PLAYBACK_QUEUE_MS 120
+#define MAX_EFFECT_QUEUE_MS 120
+#define MAX_DECODE_QUEUE_MS 2400
+#define MAX_SEND_QUEUE_MS 2400
+#define QUEUE_FRAMES(queue_ms, frame_duration_ms) std::max<size_t>(1, (queue_ms) / (frame_duration_ms))
+// Ring capacity, enough for the shortest frame duration
+#define QUEUE_CAPACITY(queue_ms) ((queue_ms) / MIN_OPUS_FRAME_DURATION_MS)
+// Payload capacity reserved for pooled packets, a larger payload grows its buffer once and keeps it
+#define MAX_OPUS_PACKET_SIZE 512
+// Speech frames that can end in one DMA period, for the latency trace
+#define MAX_PLAYED_FRAMES_PER_PERIOD 4
 
 #define AUDIO_POWER_TIMEOUT_MS 15000
-#define AUDIO_POWER_CHECK_INTERVAL_MS 1000
 
 
-#define AS_EVENT_AUDIO_TESTING_RUNNING      (1 << 0)
+#define AS_EVENT_AUDIO_RECORDING_RUNNING    (1 << 0)
 #define AS_EVENT_WAKE_WORD_RUNNING          (1 << 1)
 #define AS_EVENT_AUDIO_PROCESSOR_RUNNING    (1 << 2)
 #define AS_EVENT_PLAYBACK_NOT_EMPTY         (1 << 3)
+#define AS_EVENT_LOOPBACK_CALIBRATION       (1 << 4)
+#define AS_EVENT_LOOPBACK_CALIBRATION_DONE  (1 << 5)
+
+// Microphone recorded around each calibration probe, and the probes played
+#define LOOPBACK_CALIBRATION_RECORD_MS 800
+#define LOOPBACK_CALIBRATION_PROBES 3
+#define LOOPBACK_CALIBRATION_MAX_DELAY_MS 400
+#define LOOPBACK_CALIBRATION_MARGIN_MS 20       // Searched before the played time, for the clock error
 
 struct AudioServiceCallbacks {
     std::function<void(void)> on_send_queue_available;
     std::function<void(const std::string&)> on_wake_word_detected;
     std::function<void(bool)> on_vad_change;
-    std::function<void(void)> on_audio_testing_queue_full;
 };
 
 
 enum AudioTaskType {
     kAudioTaskTypeEncodeToSendQueue,
-    kAudioTaskTypeEncodeToTestingQueue,
+    kAudioTaskTypeEncodeToRecorder,
     kAudioTaskTypeDecodeToPlaybackQueue,
 };
 
@@ -69,13 +119,70 @@ struct AudioTask {
     AudioTaskType type;
     std::vector<int16_t> pcm;
     uint32_t timestamp;
+    int64_t origin_time_us;     // Uplink: microphone read, downlink: network receive (0 if not traced)
+    int64_t processed_time_us;  // Uplink: audio processor output, downlink: decoder done
 };
 
+struct AudioEffectSound {
+    std::string_view data;      // P3 stream, embedded in flash
+    int64_t request_time_us;
+    std::shared_ptr<const AudioRecording> recording;    // Set when data is a recording, which is kept alive and not cached
+};
+
+// Decode side of an effect voice (UI / alert)
+struct AudioEffectVoice {
+    std::mutex mutex;
+    std::deque<AudioEffectSound> pending;   // Sounds waiting to play, guarded by mutex
+    // Decode task only
+    AudioEffectSound playing = {};
+    size_t offset = 0;
+    std::unique_ptr<OpusSpanDecoder> decoder;       // Only allocated while the voice decodes
+    AudioResampler resampler;
+    std::shared_ptr<const CachedSound> cached;      // Set when the sound plays from the cache
+    size_t cached_offset = 0;
+    std::shared_ptr<CachedSound> filling;           // Decoded frames are copied here, and cached when the sound is complete
+    size_t filled = 0;
+    // Decoded frames at the output rate, read by the mixer
+    AudioRingBuffer<std::unique_ptr<AudioTask>> queue{QUEUE_CAPACITY(MAX_EFFECT_QUEUE_MS)};
+};
+
+struct OpusBenchmarkStats {
+    uint32_t frames = 0;
+    uint64_t total_us = 0;
+    uint32_t max_us = 0;
+
+    void Add(uint32_t us) {
+        frames++;
+        total_us += us;
+        if (us > max_us) {
+            max_us = us;
+        }
+    }
+};
+
+struct LatencySnapshot {
+    uint32_t encode_frames = 0;
+    uint32_t decode_frames = 0;
+    uint64_t uplink_us = 0;
+    uint64_t downlink_us = 0;
+};
+
+struct LatencyBucket {
+    uint32_t uplink_frames = 0;
+    uint64_t uplink_us = 0;
+    uint32_t downlink_frames = 0;
+    uint64_t downlink_us = 0;
+    uint32_t prefill_ms = 0;
+};
+
+#define LATENCY_COMPARISON_BUCKETS (MAX_OPUS_FRAME_DURATION_MS / MIN_OPUS_FRAME_DURATION_MS)
+
 struct DebugStatistics {
     uint32_t input_count = 0;
     uint32_t decode_count = 0;
     uint32_t encode_count = 0;
     uint32_t playback_count = 0;
+    uint64_t input_alloc_bytes = 0;         // Bytes allocated by ReadAudioData growing its buffers
 };
 
 class AudioService {
@@ -86,7 +193,6 @@ public:
     void Initialize(AudioCodec* codec);
     void Start();
     void Stop();
-    void EncodeWakeWord();
     std::unique_ptr<AudioStreamPacket> PopWakeWordPacket();
     const std::string& GetLastWakeWord() const;
     bool IsVoiceDetected() const { return voice_detected_; }
@@ -95,7 +201,13 @@ public:
     bool IsAudioProcessorRunning() const { return xEventGroupGetBits(event_group_) & AS_EVENT_AUDIO_PROCESSOR_RUNNING; }
 
     void EnableWakeWordDetection(bool enable);
+    // Local command words of the wake word engine (CustomWakeWord only), stored in NVS and applied
+    // before the next detection. The callback runs on the detection task.
+    bool SetSpeechCommands(const std::vector<SpeechCommand>& commands);
+    std::vector<SpeechCommand> GetSpeechCommands();
+    void OnSpeechCommand(int command_id, std::function<void(const SpeechCommand& command)> callback);
     void EnableVoiceProcessing(bool enable);
+    // BOOT button audio test: records the microphone (CONFIG_AUDIO_TESTING_DURATION), and plays it back when disabled
     void EnableAudioTesting(bool enable);
     void EnableDeviceAec(bool enable);
 
@@ -103,9 +215,46 @@ public:
 
     bool PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait = false);
     std::unique_ptr<AudioStreamPacket> PopPacketFromSendQueue();
-    void PlaySound(const std::string_view& sound);
+    std::unique_ptr<AudioStreamPacket> AcquirePacket();
+    void RecyclePacket(std::unique_ptr<AudioStreamPacket>&& packet);
+    // Shared with the protocol for the incoming packets
+    inline AudioObjectPool<AudioStreamPacket>& packet_pool() { return packet_pool_; }
+    // Plays a P3 sound on an effect voice, over the speech. Returns at once.
+    void PlaySound(const std::string_view& sound, AudioVoice voice = kAudioVoiceUi);
+    // Decodes a sound into the sound cache when the decode task is idle
+    void CacheSound(const std::string_view& sound);
+    // Records a tap of the uplink, see AudioRecorder. The microphone and the reference are read even while
+    // nothing else listens, the processor output only while the audio processor runs.
+    bool StartRecording(AudioTap tap, AudioRecordFormat format, int duration_ms);
+    std::shared_ptr<const AudioRecording> StopRecording();
+    bool IsRecording() const { return recorder_.IsRecording(); }
+    std::shared_ptr<const AudioRecording> last_recording() { return recorder_.last_recording(); }
+    // Plays a recording on an effect voice, it does not go through the decode queue
+    void PlayRecording(std::shared_ptr<const AudioRecording> recording, AudioVoice voice = kAudioVoiceUi);
     bool ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples);
     void ResetDecoder();
+    // Called at every TTS sentence start, the server may pause between sentences and that is not an underrun
+    void MarkSpeechPause();
+    // Creates the speech decoder for a stream format ahead of its first packet, e.g. when the audio channel opens
+    void WarmUpDecoder(int sample_rate, int frame_duration);
+    // Powers up the codec output ahead of the first frame, e.g. when the server starts speaking
+    void PrepareOutput();
+    // Plays a short chirp and finds it in the microphone signal, to measure the delay from the speaker to
+    // the microphone. The result is saved and used for the server AEC timestamps. Blocks the caller for
+    // about 2.5 s (the input task records, the caller searches), returns the delay in microseconds or -1.
+    // Only runs on request (the MCP tool), the wake word keeps listening meanwhile.
+    int CalibrateLoopbackDelay();
+    int loopback_delay_us() const { return loopback_delay_us_; }
+    bool loopback_delay_calibrated() const { return loopback_delay_calibrated_; }
+    // Barge-in: fades out the speech over one DMA period and drops every queued and in-flight frame.
+    // trigger_time_us is when the user interrupted, the time until the speaker is silent is traced.
+    void AbortPlayback(int64_t trigger_time_us);
+    int64_t last_wake_word_time_us() const { return wake_word_time_us_; }
+    void SetFrameDuration(int frame_duration_ms);
+    int frame_duration() const { return frame_duration_; }
+    void PrintDebugStatistics();
+    AudioLatencyTracer& latency_tracer() { return latency_tracer_; }
+    OpusEncoderGovernor& encoder_governor() { return encoder_governor_; }
 
 private:
     AudioCodec* codec_ = nullptr;
@@ -113,47 +262,130 @@ private:
     std::unique_ptr<AudioProcessor> audio_processor_;
     std::unique_ptr<WakeWord> wake_word_;
     std::unique_ptr<AudioDebugger> audio_debugger_;
-    std::unique_ptr<OpusEncoderWrapper> opus_encoder_;
-    std::unique_ptr<OpusDecoderWrapper> opus_decoder_;
-    OpusResampler input_resampler_;
-    OpusResampler reference_resampler_;
-    OpusResampler output_resampler_;
+    std::unique_ptr<OpusFrameEncoder> opus_encoder_;
+    AudioDecoderPool decoder_pool_{CONFIG_AUDIO_DECODER_POOL_SIZE};
+    std::atomic<uint32_t> decoder_warmup_{0};   // sample_rate << 8 | frame_duration, for the decode task
+    AudioResampler input_resampler_;
+    AudioResampler reference_resampler_;
+    std::vector<int16_t> resample_buffer_;
+    // Input scratch, sized once in Initialize and reused by ReadAudioData / AudioInputTask for every frame
+    std::vector<int16_t> input_buffer_;
+    // Stereo through OpusResampler only: the channels apart, before and after resampling
+    std::vector<int16_t> input_mic_;
+    std::vector<int16_t> input_reference_;
+    std::vector<int16_t> input_resampled_mic_;
+    std::vector<int16_t> input_resampled_reference_;
+    std::vector<int16_t> input_frame_;
     DebugStatistics debug_statistics_;
+    int64_t last_statistics_time_us_ = 0;
+    uint64_t last_input_alloc_bytes_ = 0;
 
     EventGroupHandle_t event_group_;
 
     // Audio encode / decode
     TaskHandle_t audio_input_task_handle_ = nullptr;
     TaskHandle_t audio_output_task_handle_ = nullptr;
-    TaskHandle_t opus_codec_task_handle_ = nullptr;
-    std::mutex audio_queue_mutex_;
-    std::condition_variable audio_queue_cv_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_decode_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_send_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_testing_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_encode_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_playback_queue_;
-
-    // For server AEC
-    std::deque<uint32_t> timestamp_queue_;
-    std::mutex timestamp_mutex_;
+    TaskHandle_t opus_encode_task_handle_ = nullptr;
+    TaskHandle_t opus_decode_task_handle_ = nullptr;
+    std::mutex encode_producer_mutex_;
+    std::mutex decode_producer_mutex_;
+    OpusBenchmarkStats encode_benchmark_;
+    OpusEncoderGovernor encoder_governor_{CONFIG_AUDIO_OPUS_MAX_COMPLEXITY, CONFIG_AUDIO_OPUS_MIN_BITRATE,
+        CONFIG_AUDIO_OPUS_MAX_BITRATE};
+#if CONFIG_AUDIO_UPLINK_VAD_GATE
+    AudioUplinkGate uplink_gate_{true, CONFIG_AUDIO_UPLINK_PREROLL_MS, CONFIG_AUDIO_UPLINK_HANGOVER_MS, CONFIG_AUDIO_UPLINK_KEEPALIVE_MS};
+#else
+    AudioUplinkGate uplink_gate_{false, 0, 0, 0};
+#endif
+    OpusBenchmarkStats decode_benchmark_;
+    // Latency comparison, one bucket per frame duration (20 / 40 / 60 ms)
+    std::mutex latency_mutex_;
+    LatencySnapshot latency_snapshot_;
+    LatencyBucket latency_buckets_[LATENCY_COMPARISON_BUCKETS];
+    AudioRingBuffer<std::unique_ptr<AudioStreamPacket>> audio_decode_queue_{QUEUE_CAPACITY(MAX_DECODE_QUEUE_MS)};
+    AudioRingBuffer<std::unique_ptr<AudioStreamPacket>> audio_send_queue_{QUEUE_CAPACITY(MAX_SEND_QUEUE_MS)};
+    AudioRingBuffer<std::unique_ptr<AudioTask>> audio_encode_queue_{QUEUE_CAPACITY(MAX_ENCODE_QUEUE_MS)};
+    AudioRingBuffer<std::unique_ptr<AudioTask>> audio_playback_queue_{QUEUE_CAPACITY(MAX_PLAYBACK_QUEUE_MS)};
+    AudioObjectPool<AudioStreamPacket> packet_pool_;
+    AudioObjectPool<AudioTask> task_pool_;
+    AudioJitterBuffer jitter_buffer_{QUEUE_CAPACITY(MAX_DECODE_QUEUE_MS), [this](std::unique_ptr<AudioStreamPacket>&& packet) {
+        RecyclePacket(std::move(packet));
+    }};
+    std::atomic<bool> jitter_buffer_reset_{false};
+    std::atomic<bool> jitter_buffer_pause_{false};
+    // Bumped by every reset / abort, a frame decoded across a change is dropped
+    std::atomic<uint32_t> playback_epoch_{0};
+    std::atomic<int64_t> abort_time_us_{0};     // Pending abort, until the fade out is written
+    std::atomic<int64_t> wake_word_time_us_{0};
+    int64_t last_write_time_us_ = 0;            // Output task only
+    AudioEffectVoice effects_[kAudioVoiceCount - kAudioVoiceUi];
+    AudioMixer mixer_{[this](AudioVoice voice, std::unique_ptr<AudioTask>&& task) {
+        OnFramePlayed(voice, std::move(task));
+    }};
+    std::vector<int16_t> mix_buffer_;
+    struct PlayedFrame {
+        int64_t origin_time_us;
+        int64_t decoded_time_us;
+    };
+    std::vector<PlayedFrame> played_frames_;    // Output task only, ended in the period being written
+    AudioSoundCache sound_cache_{CONFIG_AUDIO_SOUND_CACHE_SIZE * 1024};
+    std::mutex warmup_mutex_;
+    std::deque<std::string_view> warmup_sounds_;
+    AudioLatencyTracer latency_tracer_;
+    AudioRecorder recorder_;
+    std::unique_ptr<OpusEncoderWrapper> recorder_encoder_;  // Encode task only, while a recording has Opus frames
+
+    // For server AEC: uplink frames are stamped with the server timestamp of the speech that was playing
+    // one loopback delay before they were captured
+    AudioPlaybackClock playback_clock_;
+    std::atomic<int> loopback_delay_us_{0};
+    std::atomic<bool> loopback_delay_calibrated_{false};
+    // Loopback calibration, the input task records while the output task writes the probe
+    struct LoopbackCapture {
+        std::vector<int16_t> mic;           // The samples that can hold the probe
+        int64_t first_time_us = 0;          // When mic[0] was captured
+        int64_t played_time_us = 0;         // When the probe started to play
+    };
+    std::mutex calibration_mutex_;
+    std::vector<LoopbackCapture> loopback_captures_;    // Filled by the input task, searched by the caller
+    std::vector<int16_t> probe_;
+    std::atomic<bool> probe_requested_{false};
+    std::atomic<bool> probe_playing_{false};
+    std::atomic<int64_t> probe_position_{-1};   // Playback position of the first probe sample
+    size_t probe_offset_ = 0;                   // Output task only
 
     bool wake_word_initialized_ = false;
     bool audio_processor_initialized_ = false;
     bool voice_detected_ = false;
     bool service_stopped_ = true;
     bool audio_input_need_warmup_ = false;
+    std::atomic<int> frame_duration_{OPUS_FRAME_DURATION_MS};
 
+    // One-shot, armed when a codec channel is enabled and at the deadline of the channels still enabled
     esp_timer_handle_t audio_power_timer_ = nullptr;
-    std::chrono::steady_clock::time_point last_input_time_;
-    std::chrono::steady_clock::time_point last_output_time_;
+    std::mutex codec_power_mutex_;
+    std::atomic<int64_t> last_input_time_us_{0};
+    std::atomic<int64_t> last_output_time_us_{0};
 
     void AudioInputTask();
     void AudioOutputTask();
-    void OpusCodecTask();
-    void PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm);
-    void SetDecodeSampleRate(int sample_rate, int frame_duration);
+    void OpusEncodeTask();
+    void OpusDecodeTask();
+    void DecodePacket(std::unique_ptr<AudioStreamPacket> packet, uint32_t epoch);
+    bool DecodeEffectFrame(AudioEffectVoice& effect);
+    bool DecodeSoundFrame(OpusSpanDecoder& decoder, AudioResampler& resampler, const AudioStreamPacket& packet,
+        std::vector<int16_t>& pcm);
+    bool WarmUpSound();
+    void OnFramePlayed(AudioVoice voice, std::unique_ptr<AudioTask>&& task);
+    void EncodeRecorderFrame(std::unique_ptr<AudioTask>&& task);
+    void PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm, int64_t origin_time_us,
+        int64_t capture_time_us = 0);
+    void RunLoopbackCalibration();
+    void ResizeInputBuffer(std::vector<int16_t>& buffer, size_t samples);
     void CheckAndUpdateAudioPowerState();
+    void ArmPowerTimer(int64_t timeout_us);
+    void EnableCodecInput();
+    void AccountLatency();
 };
 
 #endif
\ No newline at end of file
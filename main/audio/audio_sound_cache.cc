@@ -0,0 +1,73 @@
+#include "audio_sound_cache.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+
+#define TAG "AudioSoundCache"
+
+
+CachedSound::~CachedSound() {
+    heap_caps_free(pcm);
+}
+
+std::shared_ptr<const CachedSound> AudioSoundCache::Find(const std::string_view& sound) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = sounds_.begin(); it != sounds_.end(); ++it) {
+        if ((*it)->key == sound.data()) {
+            sounds_.splice(sounds_.begin(), sounds_, it);
+            stats_.hits++;
+            return sounds_.front();
+        }
+    }
+    stats_.misses++;
+    return nullptr;
+}
+
+std::shared_ptr<CachedSound> AudioSoundCache::Create(const std::string_view& sound, size_t samples) {
+    size_t bytes = samples * sizeof(int16_t);
+    if (samples == 0 || bytes > capacity_bytes_ / 2) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.rejected++;
+        return nullptr;
+    }
+    auto pcm = (int16_t*)heap_caps_malloc_prefer(bytes, 2, MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT);
+    if (pcm == nullptr) {
+        ESP_LOGW(TAG, "Failed to allocate %u bytes for a sound", bytes);
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.rejected++;
+        return nullptr;
+    }
+    return std::make_shared<CachedSound>(sound.data(), pcm, samples);
+}
+
+void AudioSoundCache::Insert(std::shared_ptr<CachedSound> sound) {
+    size_t bytes = sound->samples * sizeof(int16_t);
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& cached : sounds_) {
+        if (cached->key == sound->key) {
+            return;     // Decoded twice at the same time, keep the first one
+        }
+    }
+    while (!sounds_.empty() && used_bytes_ + bytes > capacity_bytes_) {
+        used_bytes_ -= sounds_.back()->samples * sizeof(int16_t);
+        sounds_.pop_back();
+        stats_.evictions++;
+    }
+    sounds_.push_front(std::move(sound));
+    used_bytes_ += bytes;
+}
+
+AudioSoundCacheStats AudioSoundCache::GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+size_t AudioSoundCache::GetUsedBytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return used_bytes_;
+}
+
+size_t AudioSoundCache::GetCount() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return sounds_.size();
+}
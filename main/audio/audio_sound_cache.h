@@ -0,0 +1,62 @@
+#ifndef AUDIO_SOUND_CACHE_H
+#define AUDIO_SOUND_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <memory>
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+
+// A sound decoded and resampled to the codec output rate
+struct CachedSound {
+    const char* key;        // The P3 data of the sound, embedded in flash
+    int16_t* pcm;
+    size_t samples;
+
+    CachedSound(const char* key, int16_t* pcm, size_t samples) : key(key), pcm(pcm), samples(samples) {}
+    ~CachedSound();
+};
+
+struct AudioSoundCacheStats {
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+    uint32_t evictions = 0;
+    uint32_t rejected = 0;      // Sounds too large for the cache, or out of memory
+};
+
+/*
+ * LRU cache of decoded local sounds, keyed by the address of their P3 data.
+ *
+ * The PCM is allocated from PSRAM when there is some. A sound is only cached if it fits in half
+ * of the cache, so one long prompt can not evict all the short UI sounds. Sounds are shared, so an
+ * evicted sound stays valid until its last player drops it.
+ *
+ * All methods may be called from any task.
+ */
+class AudioSoundCache {
+public:
+    explicit AudioSoundCache(size_t capacity_bytes) : capacity_bytes_(capacity_bytes) {}
+
+    inline size_t capacity_bytes() const { return capacity_bytes_; }
+
+    // Returns nullptr on a miss, a hit becomes the most recently used sound
+    std::shared_ptr<const CachedSound> Find(const std::string_view& sound);
+    // Allocates a sound for the caller to fill, nullptr if it can not be cached
+    std::shared_ptr<CachedSound> Create(const std::string_view& sound, size_t samples);
+    // Adds a filled sound, evicting the least recently used ones to make room
+    void Insert(std::shared_ptr<CachedSound> sound);
+
+    AudioSoundCacheStats GetStats();
+    size_t GetUsedBytes();
+    size_t GetCount();
+
+private:
+    std::mutex mutex_;
+    std::list<std::shared_ptr<const CachedSound>> sounds_;     // Most recently used first
+    size_t capacity_bytes_;
+    size_t used_bytes_ = 0;
+    AudioSoundCacheStats stats_;
+};
+
+#endif // AUDIO_SOUND_CACHE_H
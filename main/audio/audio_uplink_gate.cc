@@ -0,0 +1,141 @@
+#include "audio_uplink_gate.h"
+
+#include <esp_log.h>
+
+#define TAG "AudioUplinkGate"
+
+
+AudioUplinkGate::AudioUplinkGate(bool enabled, int preroll_ms, int hangover_ms, int keepalive_ms)
+    : enabled_(enabled), preroll_ms_(preroll_ms), hangover_ms_(hangover_ms), keepalive_ms_(keepalive_ms) {
+}
+
+void AudioUplinkGate::SetHandlers(PacketHandler send, PacketHandler release) {
+    send_ = send;
+    release_ = release;
+}
+
+void AudioUplinkGate::Send(std::unique_ptr<AudioStreamPacket>&& packet) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t size = packet->payload.size();
+        uint32_t audio_frames = session_.sent_frames - session_.dtx_frames;
+        if (size > OPUS_DTX_MAX_PACKET_SIZE) {
+            audio_bytes_ += size;
+        } else {
+            session_.dtx_frames++;
+            // Without DTX, the frame would have been about as large as the others
+            if (audio_frames > 0 && audio_bytes_ / audio_frames > size) {
+                session_.dtx_saved_bytes += audio_bytes_ / audio_frames - size;
+            }
+        }
+        session_.sent_frames++;
+        session_.sent_bytes += size;
+    }
+    send_(std::move(packet));
+}
+
+void AudioUplinkGate::Drop(std::unique_ptr<AudioStreamPacket>&& packet) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        session_.gated_frames++;
+        session_.gated_bytes += packet->payload.size();
+    }
+    release_(std::move(packet));
+}
+
+void AudioUplinkGate::DropPreroll() {
+    while (!preroll_.empty()) {
+        auto packet = std::move(preroll_.front());
+        preroll_.pop_front();
+        Drop(std::move(packet));
+    }
+    preroll_duration_ms_ = 0;
+}
+
+void AudioUplinkGate::Process(std::unique_ptr<AudioStreamPacket>&& packet, bool voice, bool vad_enabled) {
+    if (reset_.exchange(false)) {
+        DropPreroll();
+        hangover_left_ms_ = 0;
+        // The first frame of a session is sent, so the server sees the stream start
+        keepalive_elapsed_ms_ = keepalive_ms_;
+    }
+
+    if (!enabled_ || !vad_enabled) {
+        Send(std::move(packet));
+        return;
+    }
+
+    int frame_ms = packet->frame_duration;
+    if (voice) {
+        /* Speech onset: the pre-roll goes first, in order */
+        while (!preroll_.empty()) {
+            auto held = std::move(preroll_.front());
+            preroll_.pop_front();
+            Send(std::move(held));
+        }
+        preroll_duration_ms_ = 0;
+        hangover_left_ms_ = hangover_ms_;
+        keepalive_elapsed_ms_ = 0;
+        Send(std::move(packet));
+        return;
+    }
+
+    if (hangover_left_ms_ > 0) {
+        hangover_left_ms_ -= frame_ms;
+        Send(std::move(packet));
+        return;
+    }
+
+    preroll_duration_ms_ += frame_ms;
+    preroll_.push_back(std::move(packet));
+
+    /*
+     * The keep-alive is the oldest held frame, not the new one: every frame still held is newer than
+     * it, so the pre-roll sent at the next onset stays in order behind it
+     */
+    keepalive_elapsed_ms_ += frame_ms;
+    if (keepalive_elapsed_ms_ >= keepalive_ms_) {
+        keepalive_elapsed_ms_ = 0;
+        auto oldest = std::move(preroll_.front());
+        preroll_.pop_front();
+        preroll_duration_ms_ -= oldest->frame_duration;
+        Send(std::move(oldest));
+    }
+    while (preroll_duration_ms_ > preroll_ms_ && !preroll_.empty()) {
+        auto oldest = std::move(preroll_.front());
+        preroll_.pop_front();
+        preroll_duration_ms_ -= oldest->frame_duration;
+        Drop(std::move(oldest));
+    }
+}
+
+void AudioUplinkGate::EndSession() {
+    reset_ = true;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (session_.sent_frames > 0 || session_.gated_frames > 0) {
+        uint32_t total_bytes = session_.sent_bytes + session_.saved_bytes();
+        ESP_LOGI(TAG, "Uplink session: sent %lu bytes in %lu frames, saved %lu bytes (%lu%%): %lu frames gated, %lu DTX frames",
+            session_.sent_bytes, session_.sent_frames, session_.saved_bytes(),
+            total_bytes > 0 ? session_.saved_bytes() * 100 / total_bytes : 0,
+            session_.gated_frames, session_.dtx_frames);
+    }
+    total_.sent_frames += session_.sent_frames;
+    total_.sent_bytes += session_.sent_bytes;
+    total_.gated_frames += session_.gated_frames;
+    total_.gated_bytes += session_.gated_bytes;
+    total_.dtx_frames += session_.dtx_frames;
+    total_.dtx_saved_bytes += session_.dtx_saved_bytes;
+    session_ = UplinkGateStats();
+    audio_bytes_ = 0;
+}
+
+UplinkGateStats AudioUplinkGate::GetTotalStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return total_;
+}
+
+void AudioUplinkGate::PrintStatistics() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ESP_LOGI(TAG, "uplink: sent %lu bytes, saved %lu bytes (gated %lu frames, DTX %lu frames) in finished sessions",
+        total_.sent_bytes, total_.saved_bytes(), total_.gated_frames, total_.dtx_frames);
+}
@@ -0,0 +1,81 @@
+#ifndef AUDIO_UPLINK_GATE_H
+#define AUDIO_UPLINK_GATE_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <cstdint>
+
+#include "protocol.h"
+
+// An Opus DTX frame (no audio, or a comfort noise update) is at most 2 bytes
+#define OPUS_DTX_MAX_PACKET_SIZE 2
+
+struct UplinkGateStats {
+    uint32_t sent_frames = 0;
+    uint32_t sent_bytes = 0;
+    uint32_t gated_frames = 0;      // Encoded but never sent, the silence before the pre-roll
+    uint32_t gated_bytes = 0;
+    uint32_t dtx_frames = 0;        // Sent as DTX frames
+    uint32_t dtx_saved_bytes = 0;   // Estimated from the average size of the other frames
+
+    uint32_t saved_bytes() const { return gated_bytes + dtx_saved_bytes; }
+};
+
+/*
+ * Gates the uplink with the audio processor VAD, between the Opus encoder and the send queue.
+ *
+ * While the VAD hears speech, and for hangover_ms after it, every frame is sent. Then the frames are
+ * held in a pre-roll of preroll_ms; the oldest ones are dropped as new ones come in, except for one
+ * keep-alive frame every keepalive_ms, which is taken from the head of the pre-roll so the frames
+ * reach the server in capture order. At the speech onset the pre-roll is sent ahead of the frame
+ * that triggered it, so the first syllable is not clipped. The hangover gives the server VAD the
+ * trailing silence it needs to end the turn.
+ *
+ * Without a VAD (device AEC, or no audio processor), or with the gate disabled, every frame passes.
+ * Sent and saved bytes are counted either way, so Opus DTX alone is reported too.
+ *
+ * Process() is for the encode task only, the other methods may be called from any task.
+ */
+class AudioUplinkGate {
+public:
+    typedef std::function<void(std::unique_ptr<AudioStreamPacket>&&)> PacketHandler;
+
+    AudioUplinkGate(bool enabled, int preroll_ms, int hangover_ms, int keepalive_ms);
+
+    void SetHandlers(PacketHandler send, PacketHandler release);
+    void Process(std::unique_ptr<AudioStreamPacket>&& packet, bool voice, bool vad_enabled);
+    // Logs what the session saved, and drops the pre-roll before the next frame
+    void EndSession();
+
+    UplinkGateStats GetTotalStats();
+    void PrintStatistics();
+
+private:
+    bool enabled_;
+    int preroll_ms_;
+    int hangover_ms_;
+    int keepalive_ms_;
+    PacketHandler send_;
+    PacketHandler release_;
+
+    // Encode task only
+    std::deque<std::unique_ptr<AudioStreamPacket>> preroll_;
+    int preroll_duration_ms_ = 0;
+    int hangover_left_ms_ = 0;
+    int keepalive_elapsed_ms_ = 0;
+    std::atomic<bool> reset_{true};
+
+    std::mutex mutex_;
+    UplinkGateStats session_;
+    uint32_t audio_bytes_ = 0;      // Bytes of the sent frames that are not DTX, in this session
+    UplinkGateStats total_;
+
+    void Send(std::unique_ptr<AudioStreamPacket>&& packet);
+    void Drop(std::unique_ptr<AudioStreamPacket>&& packet);
+    void DropPreroll();
+};
+
+#endif // AUDIO_UPLINK_GATE_H
@@ -5,9 +5,14 @@
 
 #include <driver/gpio.h>
 #include <driver/i2s_pdm.h>
+#include <vector>
 
 class NoAudioCodec : public AudioCodec {
 private:
+    // 32-bit I2S slots, kept between calls so the hot path does not allocate
+    std::vector<int32_t> output_buffer_;
+    std::vector<int32_t> input_buffer_;
+
     virtual int Write(const int16_t* data, int samples) override;
     virtual int Read(int16_t* dest, int samples) override;
 
@@ -0,0 +1,142 @@
+#include "opus_encoder_governor.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "OpusEncoderGovernor"
+
+
+int OpusEncoderGovernor::Hysteresis::Update(bool overloaded, bool quiet, bool can_raise) {
+    if (overloaded) {
+        if (raised) {
+            // The last raise was too much, wait longer before trying again
+            hold_windows = std::min(hold_windows * 2, OPUS_GOVERNOR_MAX_HOLD_WINDOWS);
+        }
+        raised = false;
+        quiet_windows = 0;
+        return -1;
+    }
+    raised = false;
+    if (!quiet) {
+        quiet_windows = 0;
+        return 0;
+    }
+    quiet_windows++;
+    if (quiet_windows >= hold_windows && can_raise) {
+        raised = true;
+        quiet_windows = 0;
+        return 1;
+    }
+    return 0;
+}
+
+OpusEncoderGovernor::OpusEncoderGovernor(int max_complexity, int min_bitrate, int max_bitrate)
+    : max_complexity_(std::clamp(max_complexity, 0, 10)),
+      min_bitrate_(std::min(min_bitrate, max_bitrate)),
+      max_bitrate_(max_bitrate),
+      bitrate_(max_bitrate) {
+}
+
+int OpusEncoderGovernor::complexity() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return complexity_;
+}
+
+int OpusEncoderGovernor::bitrate() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bitrate_;
+}
+
+bool OpusEncoderGovernor::OnFrameEncoded(uint32_t encode_us, int frame_duration_ms, size_t bytes, bool backlog,
+    bool stalled) {
+    if (frame_duration_ms <= 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t load = (uint64_t)encode_us * 100 / (frame_duration_ms * 1000);
+    window_encode_us_ += encode_us;
+    window_audio_ms_ += frame_duration_ms;
+    window_peak_load_ = std::max(window_peak_load_, load);
+    window_bytes_ += bytes;
+    if (backlog) {
+        window_late_ = true;
+        stats_.late_frames++;
+    }
+    if (stalled) {
+        window_stalled_ = true;
+        stats_.stalled_frames++;
+    }
+    /* A frame that was late can not wait for the end of the window */
+    if (window_audio_ms_ < OPUS_GOVERNOR_WINDOW_MS && !window_late_) {
+        return false;
+    }
+
+    load_avg_ = window_encode_us_ * 100 / (window_audio_ms_ * 1000);
+    load_max_ = window_peak_load_;
+    measured_bitrate_ = (uint64_t)window_bytes_ * 8 * 1000 / window_audio_ms_;
+    bool late = window_late_;
+    bool network_stalled = window_stalled_;
+    window_encode_us_ = 0;
+    window_audio_ms_ = 0;
+    window_peak_load_ = 0;
+    window_bytes_ = 0;
+    window_late_ = false;
+    window_stalled_ = false;
+
+    int old_complexity = complexity_;
+    bool overloaded = late || load_avg_ > OPUS_GOVERNOR_LOWER_LOAD || load_max_ > OPUS_GOVERNOR_PEAK_LOAD;
+    bool quiet = load_avg_ < OPUS_GOVERNOR_RAISE_LOAD && load_max_ < OPUS_GOVERNOR_LOWER_LOAD;
+    int step = complexity_hysteresis_.Update(overloaded, quiet, complexity_ < max_complexity_);
+    if (step < 0 && complexity_ > 0) {
+        complexity_--;
+        stats_.lowers++;
+    } else if (step > 0) {
+        complexity_++;
+        stats_.raises++;
+    }
+
+    int old_bitrate = bitrate_;
+    step = bitrate_hysteresis_.Update(network_stalled, !network_stalled, bitrate_ < max_bitrate_);
+    if (step < 0 && bitrate_ > min_bitrate_) {
+        bitrate_ = std::max(OPUS_GOVERNOR_BITRATE_STEP_DOWN(bitrate_) / 1000 * 1000, min_bitrate_);
+        stats_.bitrate_lowers++;
+    } else if (step > 0) {
+        bitrate_ = std::min(OPUS_GOVERNOR_BITRATE_STEP_UP(bitrate_) / 1000 * 1000, max_bitrate_);
+        stats_.bitrate_raises++;
+    }
+
+    if (complexity_ != old_complexity) {
+        ESP_LOGI(TAG, "Complexity %d -> %d, load avg %lu%% max %lu%%%s, next raise after %d quiet windows",
+            old_complexity, complexity_, load_avg_, load_max_, late ? ", late frame" : "",
+            complexity_hysteresis_.hold_windows);
+    }
+    if (bitrate_ != old_bitrate) {
+        ESP_LOGI(TAG, "Bitrate %d -> %d%s, measured %lu, next raise after %d quiet windows",
+            old_bitrate, bitrate_, network_stalled ? ", send queue full" : "", measured_bitrate_,
+            bitrate_hysteresis_.hold_windows);
+    }
+    return complexity_ != old_complexity || bitrate_ != old_bitrate;
+}
+
+void OpusEncoderGovernor::PrintStatistics() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ESP_LOGI(TAG, "complexity: %d/%d, load avg %lu%% max %lu%%, raises %lu, lowers %lu, late frames %lu",
+        complexity_, max_complexity_, load_avg_, load_max_, stats_.raises, stats_.lowers, stats_.late_frames);
+    ESP_LOGI(TAG, "bitrate: %d (%d-%d), measured %lu, raises %lu, lowers %lu, stalled frames %lu",
+        bitrate_, min_bitrate_, max_bitrate_, measured_bitrate_, stats_.bitrate_raises, stats_.bitrate_lowers,
+        stats_.stalled_frames);
+}
+
+cJSON* OpusEncoderGovernor::GetJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "complexity", complexity_);
+    cJSON_AddNumberToObject(root, "max_complexity", max_complexity_);
+    cJSON_AddNumberToObject(root, "bitrate", bitrate_);
+    cJSON_AddNumberToObject(root, "min_bitrate", min_bitrate_);
+    cJSON_AddNumberToObject(root, "max_bitrate", max_bitrate_);
+    cJSON_AddNumberToObject(root, "load_avg", load_avg_);
+    cJSON_AddNumberToObject(root, "load_max", load_max_);
+    cJSON_AddNumberToObject(root, "measured_bitrate", measured_bitrate_);
+    return root;
+}
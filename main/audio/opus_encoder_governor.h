@@ -0,0 +1,93 @@
+#ifndef OPUS_ENCODER_GOVERNOR_H
+#define OPUS_ENCODER_GOVERNOR_H
+
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+#include <cJSON.h>
+
+// Encode time in percent of the frame duration
+#define OPUS_GOVERNOR_WINDOW_MS 2000
+#define OPUS_GOVERNOR_RAISE_LOAD 20         // Average below this (and no slow frame): the next level is affordable
+#define OPUS_GOVERNOR_LOWER_LOAD 45         // Average above this: step down
+#define OPUS_GOVERNOR_PEAK_LOAD 90          // A single frame above this: step down
+#define OPUS_GOVERNOR_MIN_HOLD_WINDOWS 3
+#define OPUS_GOVERNOR_MAX_HOLD_WINDOWS 48
+// Bitrate steps, down by a quarter, up by a third
+#define OPUS_GOVERNOR_BITRATE_STEP_DOWN(bitrate) ((bitrate) * 3 / 4)
+#define OPUS_GOVERNOR_BITRATE_STEP_UP(bitrate) ((bitrate) * 4 / 3)
+
+struct OpusGovernorStats {
+    uint32_t raises = 0;
+    uint32_t lowers = 0;
+    uint32_t late_frames = 0;       // Frames encoded while the next one was already waiting
+    uint32_t bitrate_raises = 0;
+    uint32_t bitrate_lowers = 0;
+    uint32_t stalled_frames = 0;    // Frames held back because the send queue was full
+};
+
+/*
+ * Chooses the uplink Opus encoder complexity from the measured encode time, and the bitrate from the
+ * back pressure of the network.
+ *
+ * Every encoded frame reports its encode time (wall time, so preemption by the audio processor and
+ * the other tasks counts as load) against the frame duration, and whether it had to wait for room in
+ * the send queue. Once per window the governor looks at the average and the peak load: it steps the
+ * complexity down at once when the encoder is slow or fell behind, and up one level only after several
+ * quiet windows. The bitrate follows the same scheme, stepping down in a window where the network held
+ * frames back and up after several windows where it did not. Each raise that has to be taken back
+ * doubles the number of quiet windows needed before the next one, so neither setting flaps.
+ *
+ * OnFrameEncoded() is for the encode task only, the other methods may be called from any task.
+ */
+class OpusEncoderGovernor {
+public:
+    OpusEncoderGovernor(int max_complexity, int min_bitrate, int max_bitrate);
+
+    int complexity();
+    int bitrate();
+    // Returns true when the complexity or the bitrate changed, the caller applies both to the encoder
+    bool OnFrameEncoded(uint32_t encode_us, int frame_duration_ms, size_t bytes, bool backlog, bool stalled);
+
+    void PrintStatistics();
+    // {"complexity": 3, "max_complexity": 6, "bitrate": 24000, "min_bitrate": 12000, "max_bitrate": 32000,
+    //  "load_avg": 18, "load_max": 35, "measured_bitrate": 16000}
+    cJSON* GetJson();
+
+private:
+    // Step down at once, step up after hold_windows quiet windows, and back off after a failed raise
+    struct Hysteresis {
+        int quiet_windows = 0;
+        int hold_windows = OPUS_GOVERNOR_MIN_HOLD_WINDOWS;
+        bool raised = false;        // The last change was a raise, still on probation
+
+        // Returns -1 to step down, 1 to step up and 0 to stay
+        int Update(bool overloaded, bool quiet, bool can_raise);
+    };
+
+    std::mutex mutex_;
+    int max_complexity_;
+    int complexity_ = 0;
+    int min_bitrate_;
+    int max_bitrate_;
+    int bitrate_;
+    OpusGovernorStats stats_;
+    Hysteresis complexity_hysteresis_;
+    Hysteresis bitrate_hysteresis_;
+
+    // Current window
+    uint64_t window_encode_us_ = 0;
+    uint32_t window_audio_ms_ = 0;
+    uint32_t window_peak_load_ = 0;
+    uint32_t window_bytes_ = 0;
+    bool window_late_ = false;
+    bool window_stalled_ = false;
+
+    // Last complete window
+    uint32_t load_avg_ = 0;
+    uint32_t load_max_ = 0;
+    uint32_t measured_bitrate_ = 0;
+};
+
+#endif // OPUS_ENCODER_GOVERNOR_H
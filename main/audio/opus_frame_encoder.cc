@@ -0,0 +1,71 @@
+#include "opus_frame_encoder.h"
+
+#include <esp_log.h>
+#include <opus.h>
+
+#define TAG "OpusFrameEncoder"
+
+
+OpusFrameEncoder::OpusFrameEncoder(int sample_rate, int channels, int duration_ms)
+    : sample_rate_(sample_rate), duration_ms_(duration_ms) {
+    frame_size_ = sample_rate / 1000 * channels * duration_ms;
+    int error;
+    encoder_ = opus_encoder_create(sample_rate, channels, OPUS_APPLICATION_VOIP, &error);
+    if (encoder_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", error);
+        return;
+    }
+    SetDtx(false);
+    SetComplexity(0);
+}
+
+OpusFrameEncoder::~OpusFrameEncoder() {
+    if (encoder_ != nullptr) {
+        opus_encoder_destroy(encoder_);
+    }
+}
+
+void OpusFrameEncoder::SetDtx(bool enable) {
+    if (encoder_ != nullptr) {
+        opus_encoder_ctl(encoder_, OPUS_SET_DTX(enable ? 1 : 0));
+    }
+}
+
+void OpusFrameEncoder::SetComplexity(int complexity) {
+    if (encoder_ != nullptr) {
+        opus_encoder_ctl(encoder_, OPUS_SET_COMPLEXITY(complexity));
+    }
+}
+
+void OpusFrameEncoder::SetBitrate(int bitrate) {
+    if (encoder_ == nullptr) {
+        return;
+    }
+    int ret = opus_encoder_ctl(encoder_, OPUS_SET_BITRATE(bitrate > 0 ? bitrate : OPUS_AUTO));
+    if (ret != OPUS_OK) {
+        ESP_LOGE(TAG, "Failed to set bitrate %d, error code: %d", bitrate, ret);
+    }
+}
+
+bool OpusFrameEncoder::Encode(const std::vector<int16_t>& pcm, std::vector<uint8_t>& opus) {
+    if (encoder_ == nullptr) {
+        return false;
+    }
+    if ((int)pcm.size() != frame_size_) {
+        ESP_LOGE(TAG, "Audio data size %u does not match the frame size %d", pcm.size(), frame_size_);
+        return false;
+    }
+    int ret = opus_encode(encoder_, pcm.data(), frame_size_, scratch_, sizeof(scratch_));
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
+        return false;
+    }
+    opus.assign(scratch_, scratch_ + ret);
+    return true;
+}
+
+void OpusFrameEncoder::ResetState() {
+    if (encoder_ != nullptr) {
+        opus_encoder_ctl(encoder_, OPUS_RESET_STATE);
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef OPUS_FRAME_ENCODER_H
+#define OPUS_FRAME_ENCODER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Enough for 60ms at the highest bitrate the governor uses
+#define OPUS_FRAME_ENCODER_MAX_BYTES 1500
+
+struct OpusEncoder;
+
+/*
+ * Opus encoder for whole frames, used for the uplink. OpusEncoderWrapper does not expose its encoder,
+ * so the bitrate the governor chooses could not be applied; this one sets it with opus_encoder_ctl().
+ * The PCM is only read, the caller keeps its buffer for the next frame. A frame is encoded into a
+ * scratch buffer of the encoder and then copied to the caller's payload, so a pooled payload keeps its
+ * reserved capacity and only grows for a packet larger than it.
+ */
+class OpusFrameEncoder {
+public:
+    OpusFrameEncoder(int sample_rate, int channels, int duration_ms);
+    ~OpusFrameEncoder();
+
+    inline int sample_rate() const { return sample_rate_; }
+    inline int duration_ms() const { return duration_ms_; }
+
+    void SetDtx(bool enable);
+    void SetComplexity(int complexity);
+    // Bits per second, 0 lets the encoder choose
+    void SetBitrate(int bitrate);
+    // pcm must hold exactly one frame
+    bool Encode(const std::vector<int16_t>& pcm, std::vector<uint8_t>& opus);
+    void ResetState();
+
+private:
+    OpusEncoder* encoder_ = nullptr;
+    int sample_rate_;
+    int duration_ms_;
+    int frame_size_;
+    uint8_t scratch_[OPUS_FRAME_ENCODER_MAX_BYTES];
+};
+
+#endif // OPUS_FRAME_ENCODER_H
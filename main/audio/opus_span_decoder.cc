@@ -0,0 +1,43 @@
+#include "opus_span_decoder.h"
+
+#include <esp_log.h>
+#include <opus.h>
+
+#define TAG "OpusSpanDecoder"
+
+
+OpusSpanDecoder::OpusSpanDecoder(int sample_rate, int channels, int duration_ms)
+    : sample_rate_(sample_rate), duration_ms_(duration_ms) {
+    frame_size_ = sample_rate / 1000 * channels * duration_ms;
+    int error;
+    decoder_ = opus_decoder_create(sample_rate, channels, &error);
+    if (decoder_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", error);
+    }
+}
+
+OpusSpanDecoder::~OpusSpanDecoder() {
+    if (decoder_ != nullptr) {
+        opus_decoder_destroy(decoder_);
+    }
+}
+
+bool OpusSpanDecoder::Decode(const uint8_t* data, size_t size, std::vector<int16_t>& pcm) {
+    if (decoder_ == nullptr) {
+        return false;
+    }
+    pcm.resize(frame_size_);
+    int ret = opus_decode(decoder_, size > 0 ? data : nullptr, size, pcm.data(), frame_size_, 0);
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Failed to decode audio, error code: %d", ret);
+        return false;
+    }
+    pcm.resize(ret);
+    return true;
+}
+
+void OpusSpanDecoder::ResetState() {
+    if (decoder_ != nullptr) {
+        opus_decoder_ctl(decoder_, OPUS_RESET_STATE);
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef OPUS_SPAN_DECODER_H
+#define OPUS_SPAN_DECODER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+struct OpusDecoder;
+
+/*
+ * Opus decoder that reads the packet in place. OpusDecoderWrapper takes the payload as an owned
+ * std::vector, so data that already sits in memory (the P3 sounds mapped from flash) would have to be
+ * copied first; this one decodes straight from the pointer.
+ */
+class OpusSpanDecoder {
+public:
+    OpusSpanDecoder(int sample_rate, int channels, int duration_ms);
+    ~OpusSpanDecoder();
+
+    inline int sample_rate() const { return sample_rate_; }
+    inline int duration_ms() const { return duration_ms_; }
+
+    // size 0 runs packet loss concealment for one frame
+    bool Decode(const uint8_t* data, size_t size, std::vector<int16_t>& pcm);
+    void ResetState();
+
+private:
+    OpusDecoder* decoder_ = nullptr;
+    int sample_rate_;
+    int duration_ms_;
+    int frame_size_;
+};
+
+#endif // OPUS_SPAN_DECODER_H
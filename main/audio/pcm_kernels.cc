@@ -0,0 +1,422 @@
+#include "pcm_kernels.h"
+#include "sdkconfig.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+#include <cstring>
+
+#define TAG "PcmKernels"
+
+#define PCM_SIMD_ALIGN 16
+#define PCM_SIMD_BLOCK 8                // 16-bit samples per 128-bit vector
+#define PCM_BENCHMARK_SAMPLES 960       // One 60ms frame at 16kHz
+#define PCM_BENCHMARK_ITERATIONS 200
+
+
+static inline int16_t Saturate16(int32_t value) {
+    return value > INT16_MAX ? INT16_MAX : (value < INT16_MIN ? INT16_MIN : (int16_t)value);
+}
+
+/* Scalar kernels, used on every target and as the reference for the vector path */
+
+static void ScalarConvertS32ToS16(const int32_t* src, int16_t* dst, size_t samples, int shift) {
+    for (size_t i = 0; i < samples; i++) {
+        dst[i] = Saturate16(src[i] >> shift);
+    }
+}
+
+static void ScalarConvertS16ToS32(const int16_t* src, int32_t* dst, size_t samples, int16_t gain) {
+    // |src * gain| < 2^30, so doubling it stays within 32 bits
+    for (size_t i = 0; i < samples; i++) {
+        dst[i] = (int32_t)src[i] * gain * 2;
+    }
+}
+
+static void ScalarApplyGain(int16_t* data, size_t samples, int16_t gain) {
+    for (size_t i = 0; i < samples; i++) {
+        data[i] = Saturate16(((int32_t)data[i] * gain) >> 15);
+    }
+}
+
+static void ScalarDeinterleave(const int16_t* src, int16_t* left, int16_t* right, size_t frames) {
+    if (right == nullptr) {
+        for (size_t i = 0; i < frames; i++) {
+            left[i] = src[2 * i];
+        }
+        return;
+    }
+    for (size_t i = 0; i < frames; i++) {
+        left[i] = src[2 * i];
+        right[i] = src[2 * i + 1];
+    }
+}
+
+static void ScalarInterleave(const int16_t* left, const int16_t* right, int16_t* dst, size_t frames) {
+    for (size_t i = 0; i < frames; i++) {
+        dst[2 * i] = left[i];
+        dst[2 * i + 1] = right[i];
+    }
+}
+
+static void ScalarMix(int16_t* dst, const int16_t* src, size_t samples, int16_t gain) {
+    for (size_t i = 0; i < samples; i++) {
+        // The gained sample is saturated first, the same way the vector multiply does it
+        dst[i] = Saturate16((int32_t)dst[i] + Saturate16(((int32_t)src[i] * gain) >> 15));
+    }
+}
+
+#if CONFIG_AUDIO_PCM_KERNELS_SIMD
+/*
+ * ESP32-S3 PIE kernels. Every block handles 8 samples (one q register of 16-bit lanes), and all
+ * pointers must be 16-byte aligned. EE.VMUL.S16 shifts the 32-bit products right by SAR, so the
+ * Q15 kernels load 15 into SAR. SAR is only used within a single asm statement, the compiler does
+ * not keep anything in it across statements.
+ */
+
+static inline bool IsAligned(const void* pointer) {
+    return ((uintptr_t)pointer & (PCM_SIMD_ALIGN - 1)) == 0;
+}
+
+// Samples to process one by one before pointer is aligned
+static inline size_t HeadSamples(const void* pointer, size_t sample_size, size_t samples) {
+    size_t bytes = (PCM_SIMD_ALIGN - ((uintptr_t)pointer & (PCM_SIMD_ALIGN - 1))) & (PCM_SIMD_ALIGN - 1);
+    return std::min(samples, bytes / sample_size);
+}
+
+static void SimdConvertS32ToS16(const int32_t* src, int16_t* dst, size_t blocks, int shift) {
+    const int32_t max_value = INT16_MAX;
+    const int32_t min_value = INT16_MIN;
+    for (size_t i = 0; i < blocks; i++) {
+        asm volatile(
+            "wsr.sar %[shift]\n"
+            "ee.vldbc.32 q4, %[max]\n"
+            "ee.vldbc.32 q5, %[min]\n"
+            "ee.vld.128.ip q0, %[src], 16\n"
+            "ee.vld.128.ip q1, %[src], 16\n"
+            "ee.vsr.32 q0, q0\n"
+            "ee.vsr.32 q1, q1\n"
+            "ee.vmin.s32 q0, q0, q4\n"
+            "ee.vmin.s32 q1, q1, q4\n"
+            "ee.vmax.s32 q0, q0, q5\n"
+            "ee.vmax.s32 q1, q1, q5\n"
+            // The low halves are the even 16-bit lanes
+            "ee.vunzip.16 q0, q1\n"
+            "ee.vst.128.ip q0, %[dst], 16\n"
+            : [src] "+r"(src), [dst] "+r"(dst)
+            : [shift] "r"(shift), [max] "r"(&max_value), [min] "r"(&min_value)
+            : "memory");
+    }
+}
+
+/*
+ * The 32-bit result is built from two 16-bit products, since EE.VMUL.S16 keeps the low 16 bits of
+ * (x * y) >> SAR: the high half is src * gain >> 15, and the low half is the low 16 bits of
+ * src * (2 * gain), taken with a gain that wraps the same way modulo 2^16.
+ */
+static void SimdConvertS16ToS32(const int16_t* src, int32_t* dst, size_t blocks, int16_t gain) {
+    const int16_t gain_low = (int16_t)(uint16_t)((uint32_t)gain << 1);
+    for (size_t i = 0; i < blocks; i++) {
+        asm volatile(
+            "ee.vldbc.16 q2, %[gain]\n"
+            "ee.vldbc.16 q3, %[gain_low]\n"
+            "ee.vld.128.ip q0, %[src], 16\n"
+            "wsr.sar %[shift]\n"
+            "ee.vmul.s16 q1, q0, q2\n"
+            "wsr.sar %[zero]\n"
+            "ee.vmul.s16 q0, q0, q3\n"
+            // Zipping the low halves below the high halves gives the products in 32-bit lanes
+            "ee.vzip.16 q0, q1\n"
+            "ee.vst.128.ip q0, %[dst], 16\n"
+            "ee.vst.128.ip q1, %[dst], 16\n"
+            : [src] "+r"(src), [dst] "+r"(dst)
+            : [shift] "r"(15), [zero] "r"(0), [gain] "r"(&gain), [gain_low] "r"(&gain_low)
+            : "memory");
+    }
+}
+
+static void SimdApplyGain(int16_t* data, size_t blocks, int16_t gain) {
+    int16_t* out = data;
+    for (size_t i = 0; i < blocks; i++) {
+        asm volatile(
+            "wsr.sar %[shift]\n"
+            "ee.vldbc.16 q2, %[gain]\n"
+            "ee.vld.128.ip q0, %[in], 16\n"
+            "ee.vmul.s16 q0, q0, q2\n"
+            "ee.vst.128.ip q0, %[out], 16\n"
+            : [in] "+r"(data), [out] "+r"(out)
+            : [shift] "r"(15), [gain] "r"(&gain)
+            : "memory");
+    }
+}
+
+static void SimdDeinterleave(const int16_t* src, int16_t* left, int16_t* right, size_t blocks) {
+    if (right == nullptr) {
+        for (size_t i = 0; i < blocks; i++) {
+            asm volatile(
+                "ee.vld.128.ip q0, %[src], 16\n"
+                "ee.vld.128.ip q1, %[src], 16\n"
+                "ee.vunzip.16 q0, q1\n"
+                "ee.vst.128.ip q0, %[left], 16\n"
+                : [src] "+r"(src), [left] "+r"(left)
+                :
+                : "memory");
+        }
+        return;
+    }
+    for (size_t i = 0; i < blocks; i++) {
+        asm volatile(
+            "ee.vld.128.ip q0, %[src], 16\n"
+            "ee.vld.128.ip q1, %[src], 16\n"
+            "ee.vunzip.16 q0, q1\n"
+            "ee.vst.128.ip q0, %[left], 16\n"
+            "ee.vst.128.ip q1, %[right], 16\n"
+            : [src] "+r"(src), [left] "+r"(left), [right] "+r"(right)
+            :
+            : "memory");
+    }
+}
+
+static void SimdInterleave(const int16_t* left, const int16_t* right, int16_t* dst, size_t blocks) {
+    for (size_t i = 0; i < blocks; i++) {
+        asm volatile(
+            "ee.vld.128.ip q0, %[left], 16\n"
+            "ee.vld.128.ip q1, %[right], 16\n"
+            "ee.vzip.16 q0, q1\n"
+            "ee.vst.128.ip q0, %[dst], 16\n"
+            "ee.vst.128.ip q1, %[dst], 16\n"
+            : [left] "+r"(left), [right] "+r"(right), [dst] "+r"(dst)
+            :
+            : "memory");
+    }
+}
+
+static void SimdMix(int16_t* dst, const int16_t* src, size_t blocks, int16_t gain) {
+    const int16_t* in = dst;
+    for (size_t i = 0; i < blocks; i++) {
+        asm volatile(
+            "wsr.sar %[shift]\n"
+            "ee.vldbc.16 q2, %[gain]\n"
+            "ee.vld.128.ip q0, %[src], 16\n"
+            "ee.vmul.s16 q0, q0, q2\n"
+            "ee.vld.128.ip q1, %[in], 16\n"
+            "ee.vadds.s16 q1, q1, q0\n"
+            "ee.vst.128.ip q1, %[dst], 16\n"
+            : [src] "+r"(src), [in] "+r"(in), [dst] "+r"(dst)
+            : [shift] "r"(15), [gain] "r"(&gain)
+            : "memory");
+    }
+}
+#endif // CONFIG_AUDIO_PCM_KERNELS_SIMD
+
+
+void PcmKernels::ConvertS32ToS16(const int32_t* src, int16_t* dst, size_t samples, int shift) {
+#if CONFIG_AUDIO_PCM_KERNELS_SIMD
+    size_t head = HeadSamples(dst, sizeof(int16_t), samples);
+    if (IsAligned(src + head)) {
+        size_t blocks = (samples - head) / PCM_SIMD_BLOCK;
+        ScalarConvertS32ToS16(src, dst, head, shift);
+        SimdConvertS32ToS16(src + head, dst + head, blocks, shift);
+        size_t done = head + blocks * PCM_SIMD_BLOCK;
+        src += done;
+        dst += done;
+        samples -= done;
+    }
+#endif
+    ScalarConvertS32ToS16(src, dst, samples, shift);
+}
+
+void PcmKernels::ConvertS16ToS32(const int16_t* src, int32_t* dst, size_t samples, int16_t gain) {
+#if CONFIG_AUDIO_PCM_KERNELS_SIMD
+    size_t head = HeadSamples(src, sizeof(int16_t), samples);
+    if (IsAligned(dst + head)) {
+        size_t blocks = (samples - head) / PCM_SIMD_BLOCK;
+        ScalarConvertS16ToS32(src, dst, head, gain);
+        SimdConvertS16ToS32(src + head, dst + head, blocks, gain);
+        size_t done = head + blocks * PCM_SIMD_BLOCK;
+        src += done;
+        dst += done;
+        samples -= done;
+    }
+#endif
+    ScalarConvertS16ToS32(src, dst, samples, gain);
+}
+
+void PcmKernels::ApplyGain(int16_t* data, size_t samples, int16_t gain) {
+#if CONFIG_AUDIO_PCM_KERNELS_SIMD
+    size_t head = HeadSamples(data, sizeof(int16_t), samples);
+    size_t blocks = (samples - head) / PCM_SIMD_BLOCK;
+    ScalarApplyGain(data, head, gain);
+    SimdApplyGain(data + head, blocks, gain);
+    size_t done = head + blocks * PCM_SIMD_BLOCK;
+    data += done;
+    samples -= done;
+#endif
+    ScalarApplyGain(data, samples, gain);
+}
+
+void PcmKernels::Deinterleave(const int16_t* src, int16_t* left, int16_t* right, size_t frames) {
+#if CONFIG_AUDIO_PCM_KERNELS_SIMD
+    size_t head = HeadSamples(left, sizeof(int16_t), frames);
+    if (IsAligned(src + 2 * head) && (right == nullptr || IsAligned(right + head))) {
+        size_t blocks = (frames - head) / PCM_SIMD_BLOCK;
+        ScalarDeinterleave(src, left, right, head);
+        SimdDeinterleave(src + 2 * head, left + head, right ? right + head : nullptr, blocks);
+        size_t done = head + blocks * PCM_SIMD_BLOCK;
+        src += 2 * done;
+        left += done;
+        right = right ? right + done : nullptr;
+        frames -= done;
+    }
+#endif
+    ScalarDeinterleave(src, left, right, frames);
+}
+
+void PcmKernels::Interleave(const int16_t* left, const int16_t* right, int16_t* dst, size_t frames) {
+#if CONFIG_AUDIO_PCM_KERNELS_SIMD
+    size_t head = HeadSamples(left, sizeof(int16_t), frames);
+    if (IsAligned(right + head) && IsAligned(dst + 2 * head)) {
+        size_t blocks = (frames - head) / PCM_SIMD_BLOCK;
+        ScalarInterleave(left, right, dst, head);
+        SimdInterleave(left + head, right + head, dst + 2 * head, blocks);
+        size_t done = head + blocks * PCM_SIMD_BLOCK;
+        left += done;
+        right += done;
+        dst += 2 * done;
+        frames -= done;
+    }
+#endif
+    ScalarInterleave(left, right, dst, frames);
+}
+
+void PcmKernels::Mix(int16_t* dst, const int16_t* src, size_t samples, int16_t gain) {
+#if CONFIG_AUDIO_PCM_KERNELS_SIMD
+    size_t head = HeadSamples(dst, sizeof(int16_t), samples);
+    if (IsAligned(src + head)) {
+        size_t blocks = (samples - head) / PCM_SIMD_BLOCK;
+        ScalarMix(dst, src, head, gain);
+        SimdMix(dst + head, src + head, blocks, gain);
+        size_t done = head + blocks * PCM_SIMD_BLOCK;
+        dst += done;
+        src += done;
+        samples -= done;
+    }
+#endif
+    ScalarMix(dst, src, samples, gain);
+}
+
+PcmLevel PcmKernels::Measure(const int16_t* data, size_t samples) {
+    // The sum of squares needs 64 bits for a full frame, more than the 40-bit vector accumulator
+    PcmLevel level;
+    if (samples == 0) {
+        return level;
+    }
+    int32_t peak = 0;
+    uint64_t energy = 0;
+    for (size_t i = 0; i < samples; i++) {
+        int32_t value = data[i];
+        int32_t magnitude = value < 0 ? -value : value;
+        peak = std::max(peak, magnitude);
+        energy += (uint64_t)(value * value);
+    }
+    level.peak = Saturate16(peak);
+    level.rms = Saturate16((int32_t)std::sqrt((double)energy / samples));
+    return level;
+}
+
+int16_t PcmKernels::VolumeToGain(int volume) {
+    volume = std::clamp(volume, 0, 100);
+    return (int16_t)(volume * volume * INT16_MAX / 10000);
+}
+
+void PcmKernels::RunBenchmark() {
+    const size_t samples = PCM_BENCHMARK_SAMPLES;
+    auto allocate = [](size_t bytes) {
+        return heap_caps_aligned_alloc(PCM_SIMD_ALIGN, bytes, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    };
+    auto input16 = (int16_t*)allocate(samples * 2 * sizeof(int16_t));
+    auto other16 = (int16_t*)allocate(samples * 2 * sizeof(int16_t));
+    auto input32 = (int32_t*)allocate(samples * sizeof(int32_t));
+    auto expected = (int16_t*)allocate(samples * 2 * sizeof(int32_t));
+    auto actual = (int16_t*)allocate(samples * 2 * sizeof(int32_t));
+    if (!input16 || !other16 || !input32 || !expected || !actual) {
+        ESP_LOGE(TAG, "Failed to allocate benchmark buffers");
+        heap_caps_free(input16);
+        heap_caps_free(other16);
+        heap_caps_free(input32);
+        heap_caps_free(expected);
+        heap_caps_free(actual);
+        return;
+    }
+
+    // Loud pseudo-random signal, so the saturation paths are exercised as well
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < samples * 2; i++) {
+        seed = seed * 1103515245 + 12345;
+        input16[i] = (int16_t)(seed >> 16);
+        other16[i] = (int16_t)(seed >> 8);
+    }
+    for (size_t i = 0; i < samples; i++) {
+        seed = seed * 1103515245 + 12345;
+        input32[i] = (int32_t)seed;
+    }
+
+    const int16_t gain = VolumeToGain(80);
+    bool all_match = true;
+    // reference and kernel write their result to expected / actual, bytes of which are compared
+    auto run = [&](const char* name, size_t bytes, const std::function<void(int16_t*)>& reference,
+        const std::function<void(int16_t*)>& kernel) {
+        memset(expected, 0, bytes);
+        memset(actual, 0, bytes);
+        reference(expected);
+        kernel(actual);
+        bool match = memcmp(expected, actual, bytes) == 0;
+        all_match = all_match && match;
+
+        int64_t start_time = esp_timer_get_time();
+        for (int i = 0; i < PCM_BENCHMARK_ITERATIONS; i++) {
+            reference(expected);
+        }
+        int64_t scalar_us = esp_timer_get_time() - start_time;
+        start_time = esp_timer_get_time();
+        for (int i = 0; i < PCM_BENCHMARK_ITERATIONS; i++) {
+            kernel(actual);
+        }
+        int64_t kernel_us = esp_timer_get_time() - start_time;
+        ESP_LOGI(TAG, "%-16s scalar %4lldus kernel %4lldus per %u samples, speedup %.1fx%s", name,
+            scalar_us / PCM_BENCHMARK_ITERATIONS, kernel_us / PCM_BENCHMARK_ITERATIONS, samples,
+            kernel_us > 0 ? (double)scalar_us / kernel_us : 0.0, match ? "" : ", RESULT MISMATCH");
+    };
+
+    run("convert s32>s16", samples * sizeof(int16_t),
+        [&](int16_t* out) { ScalarConvertS32ToS16(input32, out, samples, 12); },
+        [&](int16_t* out) { ConvertS32ToS16(input32, out, samples, 12); });
+    run("convert s16>s32", samples * sizeof(int32_t),
+        [&](int16_t* out) { ScalarConvertS16ToS32(input16, (int32_t*)out, samples, gain); },
+        [&](int16_t* out) { ConvertS16ToS32(input16, (int32_t*)out, samples, gain); });
+    run("gain", samples * sizeof(int16_t),
+        [&](int16_t* out) { memcpy(out, input16, samples * sizeof(int16_t)); ScalarApplyGain(out, samples, gain); },
+        [&](int16_t* out) { memcpy(out, input16, samples * sizeof(int16_t)); ApplyGain(out, samples, gain); });
+    run("deinterleave", samples * 2 * sizeof(int16_t),
+        [&](int16_t* out) { ScalarDeinterleave(input16, out, out + samples, samples); },
+        [&](int16_t* out) { Deinterleave(input16, out, out + samples, samples); });
+    run("interleave", samples * 2 * sizeof(int16_t),
+        [&](int16_t* out) { ScalarInterleave(input16, other16, out, samples); },
+        [&](int16_t* out) { Interleave(input16, other16, out, samples); });
+    run("mix", samples * sizeof(int16_t),
+        [&](int16_t* out) { memcpy(out, input16, samples * sizeof(int16_t)); ScalarMix(out, other16, samples, gain); },
+        [&](int16_t* out) { memcpy(out, input16, samples * sizeof(int16_t)); Mix(out, other16, samples, gain); });
+
+#if CONFIG_AUDIO_PCM_KERNELS_SIMD
+    ESP_LOGI(TAG, "PIE vector kernels %s the scalar reference", all_match ? "match" : "DO NOT match");
+#endif
+
+    heap_caps_free(input16);
+    heap_caps_free(other16);
+    heap_caps_free(input32);
+    heap_caps_free(expected);
+    heap_caps_free(actual);
+}
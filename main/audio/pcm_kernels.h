@@ -0,0 +1,43 @@
+#ifndef PCM_KERNELS_H
+#define PCM_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+struct PcmLevel {
+    int16_t peak = 0;
+    int16_t rms = 0;
+};
+
+/*
+ * PCM sample kernels for the I2S and audio service hot paths.
+ *
+ * On ESP32-S3 (CONFIG_AUDIO_PCM_KERNELS_SIMD) the kernels run 8 samples per instruction with the
+ * PIE vector unit, everywhere else they use the portable scalar loops. Both paths give bit-identical
+ * results. The vector path needs the buffers of a call to share their 16-byte alignment, otherwise
+ * the call falls back to the scalar loop, so hot-path callers should keep their buffers aligned.
+ *
+ * Gains are Q15 (32767 is unity).
+ */
+class PcmKernels {
+public:
+    // 32-bit I2S samples to 16-bit: arithmetic shift right, saturated
+    static void ConvertS32ToS16(const int32_t* src, int16_t* dst, size_t samples, int shift);
+    // 16-bit to 32-bit I2S samples with a gain: dst = src * gain << 1, the full product (unity is src << 16).
+    // It cannot overflow, and at low volume the bits below the 16-bit sample are kept.
+    static void ConvertS16ToS32(const int16_t* src, int32_t* dst, size_t samples, int16_t gain);
+    static void ApplyGain(int16_t* data, size_t samples, int16_t gain);
+    // Split stereo frames. right may be nullptr to keep the left channel only, left may alias src
+    static void Deinterleave(const int16_t* src, int16_t* left, int16_t* right, size_t frames);
+    static void Interleave(const int16_t* left, const int16_t* right, int16_t* dst, size_t frames);
+    // dst = saturate16(dst + (src * gain >> 15))
+    static void Mix(int16_t* dst, const int16_t* src, size_t samples, int16_t gain);
+    static PcmLevel Measure(const int16_t* data, size_t samples);
+
+    // Volume 0-100 on a squared curve, as a Q15 gain
+    static int16_t VolumeToGain(int volume);
+    // Times every kernel against the scalar loops, and checks that both give the same result
+    static void RunBenchmark();
+};
+
+#endif // PCM_KERNELS_H
@@ -3,11 +3,13 @@
 
 #if CONFIG_USE_AUDIO_DEBUGGER
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
 #include <cstring>
 #include <string>
+#include <algorithm>
 #endif
 
 #define TAG "AudioDebugger"
@@ -31,6 +33,18 @@ AudioDebugger::AudioDebugger() {
             inet_pton(AF_INET, ip.c_str(), &udp_server_addr_.sin_addr);
             
             ESP_LOGI(TAG, "Initialized server address: %s", CONFIG_AUDIO_DEBUG_UDP_SERVER);
+#if CONFIG_AUDIO_DEBUG_TAP_INPUT
+            enabled_taps_ |= 1 << kAudioDebugTapInput;
+#endif
+#if CONFIG_AUDIO_DEBUG_TAP_PROCESSED
+            enabled_taps_ |= 1 << kAudioDebugTapProcessed;
+#endif
+#if CONFIG_AUDIO_DEBUG_TAP_ENCODER
+            enabled_taps_ |= 1 << kAudioDebugTapEncoderInput;
+#endif
+#if CONFIG_AUDIO_DEBUG_TAP_DECODER
+            enabled_taps_ |= 1 << kAudioDebugTapDecoderOutput;
+#endif
         } else {
             ESP_LOGW(TAG, "Invalid server address: %s, should be IP:PORT", CONFIG_AUDIO_DEBUG_UDP_SERVER);
             close(udp_sockfd_);
@@ -45,24 +59,83 @@ AudioDebugger::AudioDebugger() {
 AudioDebugger::~AudioDebugger() {
 #if CONFIG_USE_AUDIO_DEBUGGER
     if (udp_sockfd_ >= 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Flush();
         close(udp_sockfd_);
         ESP_LOGI(TAG, "Closed UDP socket");
     }
 #endif
 }
 
-void AudioDebugger::Feed(const std::vector<int16_t>& data) {
+void AudioDebugger::Feed(AudioDebugTap tap, const int16_t* data, size_t frames, int channels, int sample_rate) {
 #if CONFIG_USE_AUDIO_DEBUGGER
-    if (udp_sockfd_ >= 0) {
-        ssize_t sent = sendto(udp_sockfd_, data.data(), data.size() * sizeof(int16_t), 0,
-                             (struct sockaddr*)&udp_server_addr_, sizeof(udp_server_addr_));
-        if (sent < 0) {
-            ESP_LOGW(TAG, "Failed to send audio data to %s: %d", CONFIG_AUDIO_DEBUG_UDP_SERVER, errno);
-        } else {
-            ESP_LOGD(TAG, "Sent %d bytes audio data to %s", sent, CONFIG_AUDIO_DEBUG_UDP_SERVER);
+    if (!IsEnabled(tap) || channels <= 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = esp_timer_get_time();
+    if (datagram_size_ > 0 && now - datagram_time_us_ >= AUDIO_DEBUG_FLUSH_MS * 1000) {
+        Flush();
+    }
+
+    size_t frame_bytes = channels * sizeof(int16_t);
+    while (frames > 0) {
+        /* 数据报放不下一个块头和至少一帧时先发出去 */
+        if (datagram_size_ + sizeof(AudioDebugChunkHeader) + frame_bytes > sizeof(datagram_)
+            || (datagram_size_ > 0 && ((AudioDebugDatagramHeader*)datagram_)->chunks == UINT8_MAX)) {
+            Flush();
+        }
+        if (datagram_size_ == 0) {
+            datagram_size_ = sizeof(AudioDebugDatagramHeader);
+            datagram_time_us_ = now;
         }
+
+        size_t count = (sizeof(datagram_) - datagram_size_ - sizeof(AudioDebugChunkHeader)) / frame_bytes;
+        count = std::min({count, frames, (size_t)UINT16_MAX});
+        AudioDebugChunkHeader chunk;
+        chunk.tap = tap;
+        chunk.channels = channels;
+        chunk.frames = count;
+        chunk.sample_rate = sample_rate;
+        chunk.position = positions_[tap];
+        chunk.timestamp_us = (uint32_t)now;
+        memcpy(datagram_ + datagram_size_, &chunk, sizeof(chunk));
+        datagram_size_ += sizeof(chunk);
+        memcpy(datagram_ + datagram_size_, data, count * frame_bytes);
+        datagram_size_ += count * frame_bytes;
+        ((AudioDebugDatagramHeader*)datagram_)->chunks++;
+
+        positions_[tap] += count;
+        data += count * channels;
+        frames -= count;
+    }
+    if (datagram_size_ + sizeof(AudioDebugChunkHeader) + frame_bytes > sizeof(datagram_)) {
+        Flush();
     }
 #endif
 }
 
- 
\ No newline at end of file
+void AudioDebugger::Flush() {
+#if CONFIG_USE_AUDIO_DEBUGGER
+    if (datagram_size_ == 0) {
+        return;
+    }
+    auto header = (AudioDebugDatagramHeader*)datagram_;
+    header->magic = AUDIO_DEBUG_MAGIC;
+    header->version = AUDIO_DEBUG_VERSION;
+    header->sequence = datagram_sequence_++;
+    ssize_t sent = sendto(udp_sockfd_, datagram_, datagram_size_, 0,
+                         (struct sockaddr*)&udp_server_addr_, sizeof(udp_server_addr_));
+    if (sent < 0) {
+        /* 发送失败的数据报也占用序号，服务端按丢包统计 */
+        if (send_errors_++ % 100 == 0) {
+            ESP_LOGW(TAG, "Failed to send audio data to %s: %d (%lu errors)", CONFIG_AUDIO_DEBUG_UDP_SERVER, errno,
+                send_errors_);
+        }
+    } else {
+        ESP_LOGD(TAG, "Sent %d bytes audio data to %s", sent, CONFIG_AUDIO_DEBUG_UDP_SERVER);
+    }
+    datagram_size_ = 0;
+    memset(datagram_, 0, sizeof(AudioDebugDatagramHeader));
+#endif
+}
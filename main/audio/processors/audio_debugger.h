@@ -2,21 +2,81 @@
 #define AUDIO_DEBUGGER_H
 
 #include <vector>
+#include <mutex>
 #include <cstdint>
+#include <cstddef>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+// Points of the pipeline streamed by the debugger, the IDs are on the wire
+enum AudioDebugTap {
+    kAudioDebugTapInput = 0,            // ReadAudioData() result, 16 kHz, microphone (and reference) interleaved
+    kAudioDebugTapProcessed = 1,        // Audio processor (AFE) output
+    kAudioDebugTapEncoderInput = 2,     // Frames as the uplink encoder takes them, after the encode queue
+    kAudioDebugTapDecoderOutput = 3,    // Speech decoder output, at the server sample rate before resampling
+    kAudioDebugTapCount,
+};
+
+// Little endian, see scripts/audio_debug_server.py
+#define AUDIO_DEBUG_MAGIC 0x4441    // "AD"
+#define AUDIO_DEBUG_VERSION 1
+// Datagram size that is not fragmented on Wi-Fi / Ethernet
+#define AUDIO_DEBUG_MAX_DATAGRAM 1400
+// A datagram that is not full is sent once its oldest chunk is this old
+#define AUDIO_DEBUG_FLUSH_MS 20
+
+struct AudioDebugDatagramHeader {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t chunks;
+    uint32_t sequence;          // Per datagram, a gap is a lost datagram
+} __attribute__((packed));
+
+struct AudioDebugChunkHeader {
+    uint8_t tap;
+    uint8_t channels;
+    uint16_t frames;            // Sample frames (per channel) that follow
+    uint32_t sample_rate;
+    uint32_t position;          // Index of the first frame in the tap's stream, a gap is lost audio
+    uint32_t timestamp_us;      // esp_timer time (low 32 bits) when the chunk was fed
+} __attribute__((packed));
+
+/*
+ * Streams PCM from several taps of the pipeline to a UDP server (CONFIG_AUDIO_DEBUG_UDP_SERVER).
+ *
+ * Every Feed() becomes one or more chunks, each with its tap, format, sample position and time. Chunks
+ * of all taps are packed into datagrams of up to AUDIO_DEBUG_MAX_DATAGRAM bytes, a frame that does not
+ * fit is split across datagrams. A datagram is sent when it is full or AUDIO_DEBUG_FLUSH_MS after its
+ * first chunk. The taps are enabled with CONFIG_AUDIO_DEBUG_TAP_*.
+ *
+ * Feed() may be called from any task.
+ */
 class AudioDebugger {
 public:
     AudioDebugger();
     ~AudioDebugger();
 
-    void Feed(const std::vector<int16_t>& data);
+    inline bool IsEnabled(AudioDebugTap tap) const { return udp_sockfd_ >= 0 && (enabled_taps_ & (1 << tap)); }
+    void Feed(AudioDebugTap tap, const int16_t* data, size_t frames, int channels, int sample_rate);
+    void Feed(AudioDebugTap tap, const std::vector<int16_t>& data, int channels, int sample_rate) {
+        Feed(tap, data.data(), data.size() / channels, channels, sample_rate);
+    }
 
 private:
     int udp_sockfd_ = -1;
     struct sockaddr_in udp_server_addr_;
+    uint32_t enabled_taps_ = 0;
+
+    std::mutex mutex_;
+    uint8_t datagram_[AUDIO_DEBUG_MAX_DATAGRAM] = {};
+    size_t datagram_size_ = 0;
+    int64_t datagram_time_us_ = 0;      // When the first chunk was added
+    uint32_t datagram_sequence_ = 0;
+    uint32_t positions_[kAudioDebugTapCount] = {};
+    uint32_t send_errors_ = 0;
+
+    void Flush();
 };
 
-#endif 
\ No newline at end of file
+#endif
@@ -1,4 +1,5 @@
 #include "no_audio_processor.h"
+#include "pcm_kernels.h"
 #include <esp_log.h>
 
 #define TAG "NoAudioProcessor"
@@ -8,6 +9,10 @@ void NoAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms) {
     frame_samples_ = frame_duration_ms * 16000 / 1000;
 }
 
+void NoAudioProcessor::SetFrameDuration(int frame_duration_ms) {
+    frame_samples_ = frame_duration_ms * 16000 / 1000;
+}
+
 void NoAudioProcessor::Feed(std::vector<int16_t>&& data) {
     if (!is_running_ || !output_callback_) {
         return;
@@ -19,12 +24,11 @@ void NoAudioProcessor::Feed(std::vector<int16_t>&& data) {
     }
 
     if (codec_->input_channels() == 2) {
-        // If input channels is 2, we need to fetch the left channel data
-        auto mono_data = std::vector<int16_t>(data.size() / 2);
-        for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-            mono_data[i] = data[j];
-        }
-        output_callback_(std::move(mono_data));
+        // If input channels is 2, we need to fetch the left channel data (in place, the frame is ours)
+        size_t mono_samples = data.size() / 2;
+        PcmKernels::Deinterleave(data.data(), data.data(), nullptr, mono_samples);
+        data.resize(mono_samples);
+        output_callback_(std::move(data));
     } else {
         output_callback_(std::move(data));
     }
@@ -50,6 +54,10 @@ void NoAudioProcessor::OnVadStateChange(std::function<void(bool speaking)> callb
     vad_state_change_callback_ = callback;
 }
 
+bool NoAudioProcessor::IsVadEnabled() {
+    return false;
+}
+
 size_t NoAudioProcessor::GetFeedSize() {
     if (!codec_) {
         return 0;
@@ -0,0 +1,90 @@
+#include "speech_commands.h"
+#include "settings.h"
+
+#include <esp_log.h>
+#include <cstring>
+
+#define TAG "SpeechCommands"
+
+
+std::vector<SpeechCommand> SpeechCommandList::Defaults() {
+    return {
+        {2, "MAKE A COFFEE"},
+        {3, "HI KEY"},
+        {4, "HELLO KEY"},
+    };
+}
+
+std::vector<SpeechCommand> SpeechCommandList::Load() {
+    Settings settings("wake_word", false);
+    auto json = settings.GetString("commands");
+    if (json.empty()) {
+        return Defaults();
+    }
+
+    std::vector<SpeechCommand> commands;
+    std::string error;
+    if (!Parse(json, commands, error)) {
+        ESP_LOGE(TAG, "Invalid stored commands (%s), using the built-in ones", error.c_str());
+        return Defaults();
+    }
+    return commands;
+}
+
+void SpeechCommandList::Save(const std::vector<SpeechCommand>& commands) {
+    auto json = ToJson(commands);
+    char* str = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+
+    Settings settings("wake_word", true);
+    settings.SetString("commands", str);
+    cJSON_free(str);
+}
+
+bool SpeechCommandList::Parse(const std::string& json, std::vector<SpeechCommand>& commands, std::string& error) {
+    cJSON* root = cJSON_Parse(json.c_str());
+    if (!cJSON_IsArray(root)) {
+        cJSON_Delete(root);
+        error = "Expected a JSON array of {\"id\", \"text\"} objects";
+        return false;
+    }
+
+    commands.clear();
+    error.clear();
+    cJSON* item;
+    cJSON_ArrayForEach(item, root) {
+        auto id = cJSON_GetObjectItem(item, "id");
+        auto text = cJSON_GetObjectItem(item, "text");
+        if (!cJSON_IsNumber(id) || !cJSON_IsString(text)) {
+            error = "Every command needs a numeric `id` and a string `text`";
+            break;
+        }
+        if (id->valueint <= SPEECH_COMMAND_WAKE_WORD_ID || id->valueint > SPEECH_COMMAND_MAX_ID) {
+            error = "Command IDs range from 2 to " + std::to_string(SPEECH_COMMAND_MAX_ID) + ", 1 is the wake word";
+            break;
+        }
+        size_t length = strlen(text->valuestring);
+        if (length == 0 || length > SPEECH_COMMAND_MAX_LENGTH) {
+            error = "Command text must be 1 to " + std::to_string(SPEECH_COMMAND_MAX_LENGTH) + " bytes";
+            break;
+        }
+        if (commands.size() == SPEECH_COMMAND_MAX_COUNT) {
+            error = "At most " + std::to_string(SPEECH_COMMAND_MAX_COUNT) + " commands";
+            break;
+        }
+        commands.push_back({id->valueint, text->valuestring});
+    }
+    cJSON_Delete(root);
+    return error.empty();
+}
+
+cJSON* SpeechCommandList::ToJson(const std::vector<SpeechCommand>& commands) {
+    auto array = cJSON_CreateArray();
+    for (auto& command : commands) {
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "id", command.id);
+        cJSON_AddStringToObject(item, "text", command.text.c_str());
+        cJSON_AddItemToArray(array, item);
+    }
+    return array;
+}
@@ -0,0 +1,39 @@
+#ifndef SPEECH_COMMANDS_H
+#define SPEECH_COMMANDS_H
+
+#include <string>
+#include <vector>
+#include <cJSON.h>
+
+// Command ID 1 is the custom wake word itself (CONFIG_CUSTOM_WAKE_WORD)
+#define SPEECH_COMMAND_WAKE_WORD_ID     1
+#define SPEECH_COMMAND_MAX_ID           255
+#define SPEECH_COMMAND_MAX_COUNT        32
+#define SPEECH_COMMAND_MAX_LENGTH       63  // Bytes, the multinet phrase limit
+
+// A local command word recognized by multinet. Several phrases may share an ID (synonyms).
+struct SpeechCommand {
+    int id;
+    std::string text;
+};
+
+/*
+ * The local command vocabulary of CustomWakeWord, besides the wake word.
+ *
+ * It is stored in the "wake_word" NVS namespace as a JSON array ([{"id": 2, "text": "MAKE A COFFEE"}, ...]),
+ * so it can be changed at runtime (MCP self.voice_commands.set) instead of with a firmware build.
+ * Without a stored list the built-in commands are used.
+ */
+class SpeechCommandList {
+public:
+    // The stored commands, or the built-in ones
+    static std::vector<SpeechCommand> Load();
+    static void Save(const std::vector<SpeechCommand>& commands);
+    static std::vector<SpeechCommand> Defaults();
+
+    // Parses and validates a JSON array, returns false with a message on error
+    static bool Parse(const std::string& json, std::vector<SpeechCommand>& commands, std::string& error);
+    static cJSON* ToJson(const std::vector<SpeechCommand>& commands);
+};
+
+#endif // SPEECH_COMMANDS_H
@@ -6,6 +6,7 @@
 #include <functional>
 
 #include "audio_codec.h"
+#include "speech_commands.h"
 
 class WakeWord {
 public:
@@ -17,9 +18,16 @@ public:
     virtual void Start() = 0;
     virtual void Stop() = 0;
     virtual size_t GetFeedSize() = 0;
+    // Called by the detection task when a wake word fires, GetWakeWordOpus() returns the packets as they are encoded
     virtual void EncodeWakeWordData() = 0;
     virtual bool GetWakeWordOpus(std::vector<uint8_t>& opus) = 0;
     virtual const std::string& GetLastDetectedWakeWord() const = 0;
+
+    // Local command words besides the wake word, only CustomWakeWord (multinet) has them
+    virtual bool SetCommands(const std::vector<SpeechCommand>& commands) { return false; }
+    virtual std::vector<SpeechCommand> GetCommands() { return {}; }
+    // Called on the detection task when a phrase of the command ID is recognized
+    virtual void OnCommandDetected(int command_id, std::function<void(const SpeechCommand& command)> callback) {}
 };
 
 #endif
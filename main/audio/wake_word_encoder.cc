@@ -0,0 +1,129 @@
+#include "wake_word_encoder.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <opus.h>
+#include <algorithm>
+
+#define TAG "WakeWordEncoder"
+
+#define WAKE_WORD_ENCODE_TASK_STACK_SIZE (4096 * 8)
+#define WAKE_WORD_MAX_PACKET_SIZE 512
+
+
+WakeWordEncoder::~WakeWordEncoder() {
+    // The task lives as long as the wake word, which is never destroyed while running
+    if (encoder_ != nullptr) {
+        opus_encoder_destroy(encoder_);
+    }
+}
+
+bool WakeWordEncoder::Initialize(AudioPrerollBuffer* preroll, int frame_duration_ms) {
+    preroll_ = preroll;
+    frame_samples_ = 16000 * frame_duration_ms / 1000;
+
+    int error;
+    encoder_ = opus_encoder_create(16000, 1, OPUS_APPLICATION_VOIP, &error);
+    if (encoder_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", error);
+        return false;
+    }
+    opus_encoder_ctl(encoder_, OPUS_SET_COMPLEXITY(0)); // 0 is the fastest
+
+    task_stack_ = (StackType_t*)heap_caps_malloc(WAKE_WORD_ENCODE_TASK_STACK_SIZE, MALLOC_CAP_SPIRAM);
+    if (task_stack_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the encode task stack");
+        return false;
+    }
+    task_ = xTaskCreateStatic([](void* arg) {
+        auto this_ = (WakeWordEncoder*)arg;
+        this_->EncodeTask();
+        vTaskDelete(NULL);
+    }, "encode_detect_packets", WAKE_WORD_ENCODE_TASK_STACK_SIZE, this, 2, task_stack_, &task_buffer_);
+    return true;
+}
+
+void WakeWordEncoder::Start() {
+    if (task_ == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Frames are aligned to the end, so the newest audio (the wake word itself) is not cut off
+        uint64_t begin = std::max(preroll_->begin(), end_position_);
+        end_position_ = preroll_->end();
+        start_position_ = end_position_ - (end_position_ - begin) / frame_samples_ * frame_samples_;
+        packets_.clear();
+        done_ = false;
+        generation_++;
+    }
+    xTaskNotifyGive(task_);
+}
+
+bool WakeWordEncoder::GetPacket(std::vector<uint8_t>& opus) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() {
+        return !packets_.empty() || done_;
+    });
+    if (packets_.empty()) {
+        return false;
+    }
+    opus.swap(packets_.front());
+    packets_.pop_front();
+    return true;
+}
+
+void WakeWordEncoder::EncodeTask() {
+    uint8_t buffer[WAKE_WORD_MAX_PACKET_SIZE];
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        uint32_t generation;
+        uint64_t position, end;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            generation = generation_;
+            position = start_position_;
+            end = end_position_;
+        }
+        auto start_time = esp_timer_get_time();
+        opus_encoder_ctl(encoder_, OPUS_RESET_STATE);
+
+        int packets = 0;
+        bool stopped = false;
+        for (; position + frame_samples_ <= end; position += frame_samples_) {
+            const int16_t* frame = preroll_->Peek(position, frame_samples_);
+            if (frame == nullptr) {
+                break;
+            }
+            int size = opus_encode(encoder_, frame, frame_samples_, buffer, sizeof(buffer));
+            if (size < 0) {
+                ESP_LOGE(TAG, "Failed to encode audio, error code: %d", size);
+                break;
+            }
+            if (!preroll_->IsValid(position)) {
+                break;  // Detection restarted and overwrote the frame while it was encoded
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (generation != generation_) {
+                stopped = true;
+                break;
+            }
+            packets_.emplace_back(buffer, buffer + size);
+            packets++;
+            cv_.notify_all();
+        }
+        if (stopped) {
+            continue;   // Start() was called again, its notification is pending
+        }
+
+        ESP_LOGI(TAG, "Encode wake word opus %d packets in %ld ms", packets, (long)((esp_timer_get_time() - start_time) / 1000));
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (generation == generation_) {
+            done_ = true;
+            cv_.notify_all();
+        }
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef WAKE_WORD_ENCODER_H
+#define WAKE_WORD_ENCODER_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+#include "audio_preroll_buffer.h"
+
+struct OpusEncoder;
+
+/*
+ * Encodes the wake word pre-roll to Opus for the server, shared by the wake word implementations.
+ *
+ * The task and the encoder are created once in Initialize(). Start() is called by the detection
+ * task the moment a wake word fires, so the encoding runs while the application is still opening
+ * the audio channel; packets are handed out with GetPacket() as soon as each one is encoded. The
+ * frames are read in place from the pre-roll ring, libopus is used directly for that (the wrapper
+ * only takes an owned vector).
+ */
+class WakeWordEncoder {
+public:
+    WakeWordEncoder() = default;
+    ~WakeWordEncoder();
+
+    bool Initialize(AudioPrerollBuffer* preroll, int frame_duration_ms);
+    // Encodes the pre-roll as it is now, dropping what is left of the previous detection
+    void Start();
+    // Blocks until the next packet is encoded, false after the last one
+    bool GetPacket(std::vector<uint8_t>& opus);
+
+private:
+    AudioPrerollBuffer* preroll_ = nullptr;
+    OpusEncoder* encoder_ = nullptr;
+    size_t frame_samples_ = 0;
+    TaskHandle_t task_ = nullptr;
+    StaticTask_t task_buffer_;
+    StackType_t* task_stack_ = nullptr;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::vector<uint8_t>> packets_;
+    bool done_ = true;
+    uint32_t generation_ = 0;       // Bumped by Start(), an older encoding run stops
+    uint64_t start_position_ = 0;
+    uint64_t end_position_ = 0;     // Also where the next detection starts, its audio is not sent twice
+
+    void EncodeTask();
+};
+
+#endif // WAKE_WORD_ENCODER_H
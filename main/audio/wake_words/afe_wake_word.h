@@ -8,15 +8,14 @@
 #include <esp_afe_sr_models.h>
 #include <esp_nsn_models.h>
 
-#include <list>
 #include <string>
 #include <vector>
 #include <functional>
-#include <mutex>
-#include <condition_variable>
 
 #include "audio_codec.h"
 #include "wake_word.h"
+#include "audio_preroll_buffer.h"
+#include "wake_word_encoder.h"
 
 class AfeWakeWord : public WakeWord {
 public:
@@ -43,13 +42,8 @@ private:
     AudioCodec* codec_ = nullptr;
     std::string last_detected_wake_word_;
 
-    TaskHandle_t wake_word_encode_task_ = nullptr;
-    StaticTask_t wake_word_encode_task_buffer_;
-    StackType_t* wake_word_encode_task_stack_ = nullptr;
-    std::list<std::vector<int16_t>> wake_word_pcm_;
-    std::list<std::vector<uint8_t>> wake_word_opus_;
-    std::mutex wake_word_mutex_;
-    std::condition_variable wake_word_cv_;
+    AudioPrerollBuffer wake_word_preroll_;
+    WakeWordEncoder wake_word_encoder_;
 
     void StoreWakeWordData(const int16_t* data, size_t size);
     void AudioDetectionTask();
@@ -19,11 +19,11 @@
 
 
 CustomWakeWord::CustomWakeWord()
-    : afe_data_(nullptr),
-      wake_word_pcm_(),
-      wake_word_opus_() {
+    : afe_data_(nullptr) {
 
     event_group_ = xEventGroupCreate();
+    // 命令词从 NVS 读取（没有则使用内置的），可通过 MCP 在运行时修改
+    commands_ = SpeechCommandList::Load();
 }
 
 CustomWakeWord::~CustomWakeWord() {
@@ -37,10 +37,6 @@ CustomWakeWord::~CustomWakeWord() {
         multinet_model_data_ = nullptr;
     }
 
-    if (wake_word_encode_task_stack_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_stack_);
-    }
-
     vEventGroupDelete(event_group_);
 }
 
@@ -65,15 +61,11 @@ bool CustomWakeWord::Initialize(AudioCodec* codec) {
     multinet_ = esp_mn_handle_from_name(mn_name_);
     multinet_model_data_ = multinet_->create(mn_name_, 2000);  // 2秒超时
     multinet_->set_det_threshold(multinet_model_data_, 0.5);
-    esp_mn_commands_clear();
-    esp_mn_commands_add(1, CONFIG_CUSTOM_WAKE_WORD);  // 添加自定义唤醒词作为命令词
-    esp_mn_commands_add(2, "MAKE A COFFEE");
-    esp_mn_commands_add(3, "HI KEY");
-    esp_mn_commands_add(4, "HELLO KEY");
-    esp_mn_commands_update();
-    
-    // 打印所有的命令词
-    multinet_->print_active_speech_commands(multinet_model_data_);
+    if (!ApplyCommands(commands_)) {
+        // 保存的命令词表 multinet 不接受，改用内置的
+        commands_ = SpeechCommandList::Defaults();
+        ApplyCommands(commands_);
+    }
     ESP_LOGI(TAG, "Custom wake word: %s", CONFIG_CUSTOM_WAKE_WORD);
 
     // 初始化 afe
@@ -96,6 +88,14 @@ bool CustomWakeWord::Initialize(AudioCodec* codec) {
     afe_iface_ = esp_afe_handle_from_config(afe_config);
     afe_data_ = afe_iface_->create_from_config(afe_config);
 
+    // 唤醒词前的音频保存在预分配的环形缓冲区中（优先 PSRAM）
+    if (!wake_word_preroll_.Initialize(16 * CONFIG_WAKE_WORD_PREROLL_MS, 16000 * OPUS_FRAME_DURATION_MS / 1000)) {
+        return false;
+    }
+    if (!wake_word_encoder_.Initialize(&wake_word_preroll_, OPUS_FRAME_DURATION_MS)) {
+        return false;
+    }
+
     xTaskCreate([](void* arg) {
         auto this_ = (CustomWakeWord*)arg;
         this_->AudioDetectionTask();
@@ -164,47 +164,51 @@ void CustomWakeWord::AudioDetectionTask() {
         // 存储音频数据用于语音识别
         StoreWakeWordData(res->data, res->data_size / sizeof(int16_t));
 
-        // 直接使用multinet检测自定义唤醒词
-        esp_mn_state_t mn_state = multinet_->detect(multinet_model_data_, res->data);
+        // 直接使用multinet检测自定义唤醒词，结果在锁内取出，回调在锁外执行
+        // SetCommands() 在两次 detect 之间更新命令词，无需重启 AFE
+        esp_mn_state_t mn_state;
+        int command_id = 0;
+        std::string command_text;
+        {
+            std::lock_guard<std::mutex> lock(multinet_mutex_);
+            mn_state = multinet_->detect(multinet_model_data_, res->data);
+            if (mn_state == ESP_MN_STATE_DETECTED) {
+                esp_mn_results_t *mn_result = multinet_->get_results(multinet_model_data_);
+                ESP_LOGI(TAG, "Custom wake word detected: command_id=%d, string=%s, prob=%f", 
+                        mn_result->command_id[0], mn_result->string, mn_result->prob[0]);
+                command_id = mn_result->command_id[0];
+                command_text = mn_result->string;
+            }
+            // 检测到或超时后清理 multinet 状态，准备下次检测
+            if (mn_state != ESP_MN_STATE_DETECTING) {
+                multinet_->clean(multinet_model_data_);
+            }
+        }
         
         if (mn_state == ESP_MN_STATE_DETECTING) {
             // 仍在检测中，继续
             continue;
         } else if (mn_state == ESP_MN_STATE_DETECTED) {
-            // 检测到自定义唤醒词
-            esp_mn_results_t *mn_result = multinet_->get_results(multinet_model_data_);
-            ESP_LOGI(TAG, "Custom wake word detected: command_id=%d, string=%s, prob=%f", 
-                    mn_result->command_id[0], mn_result->string, mn_result->prob[0]);
-            
-            if (mn_result->command_id[0] == 1) {  // 自定义唤醒词
+            if (command_id == SPEECH_COMMAND_WAKE_WORD_ID) {  // 自定义唤醒词
                 ESP_LOGI(TAG, "Custom wake word '%s' detected successfully!", CONFIG_CUSTOM_WAKE_WORD);
                 
                 // 停止检测
                 Stop();
+                // 立即开始编码唤醒词音频，与应用打开音频通道并行进行
+                EncodeWakeWordData();
                 last_detected_wake_word_ = CONFIG_CUSTOM_WAKE_WORD_DISPLAY;
                 
                 // 调用回调
                 if (wake_word_detected_callback_) {
                     wake_word_detected_callback_(last_detected_wake_word_);
                 }
-                
-                // 清理multinet状态，准备下次检测
-                multinet_->clean(multinet_model_data_);
                 ESP_LOGI(TAG, "Ready for next detection");
-            } else if (mn_result->command_id[0] == 2) {
-                ESP_LOGI(TAG, "MAKE A COFFEE");
-                multinet_->clean(multinet_model_data_);
-            } else if (mn_result->command_id[0] == 3) {
-                ESP_LOGI(TAG, "HI KEY");
-                multinet_->clean(multinet_model_data_);
-            } else if (mn_result->command_id[0] == 4) {
-                ESP_LOGI(TAG, "HELLO KEY");
-                multinet_->clean(multinet_model_data_);
+            } else {
+                HandleCommand(command_id, command_text.c_str());
             }
         } else if (mn_state == ESP_MN_STATE_TIMEOUT) {
-            // 超时，清理状态继续检测
+            // 超时，状态已清理，继续检测
             ESP_LOGD(TAG, "Command word detection timeout, cleaning state");
-            multinet_->clean(multinet_model_data_);
             continue;
         }
     }
@@ -212,55 +216,83 @@ void CustomWakeWord::AudioDetectionTask() {
     ESP_LOGI(TAG, "Audio detection task ended");
 }
 
-void CustomWakeWord::StoreWakeWordData(const int16_t* data, size_t samples) {
-    // store audio data to wake_word_pcm_
-    wake_word_pcm_.emplace_back(std::vector<int16_t>(data, data + samples));
-    // keep about 2 seconds of data, detect duration is 30ms (sample_rate == 16000, chunksize == 512)
-    while (wake_word_pcm_.size() > 2000 / 30) {
-        wake_word_pcm_.pop_front();
+bool CustomWakeWord::SetCommands(const std::vector<SpeechCommand>& commands) {
+    if (multinet_ == nullptr || multinet_model_data_ == nullptr) {
+        return false;
+    }
+    // 先应用，multinet 接受后才保存，拒绝时恢复原来的命令词
+    std::lock_guard<std::mutex> lock(multinet_mutex_);
+    if (!ApplyCommands(commands)) {
+        ApplyCommands(GetCommands());
+        multinet_->clean(multinet_model_data_);
+        return false;
+    }
+    multinet_->clean(multinet_model_data_);
+    {
+        std::lock_guard<std::mutex> commands_lock(commands_mutex_);
+        commands_ = commands;
     }
+    SpeechCommandList::Save(commands);
+    return true;
 }
 
-void CustomWakeWord::EncodeWakeWordData() {
-    wake_word_opus_.clear();
-    if (wake_word_encode_task_stack_ == nullptr) {
-        wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(4096 * 8, MALLOC_CAP_SPIRAM);
+std::vector<SpeechCommand> CustomWakeWord::GetCommands() {
+    std::lock_guard<std::mutex> lock(commands_mutex_);
+    return commands_;
+}
+
+void CustomWakeWord::OnCommandDetected(int command_id, std::function<void(const SpeechCommand& command)> callback) {
+    std::lock_guard<std::mutex> lock(commands_mutex_);
+    command_callbacks_[command_id] = callback;
+}
+
+// 调用者持有 multinet_mutex_（Initialize 时检测任务尚未创建），multinet 拒绝任一命令词时返回 false
+bool CustomWakeWord::ApplyCommands(const std::vector<SpeechCommand>& commands) {
+    esp_mn_commands_clear();
+    esp_mn_commands_add(SPEECH_COMMAND_WAKE_WORD_ID, CONFIG_CUSTOM_WAKE_WORD);  // 添加自定义唤醒词作为命令词
+    for (auto& command : commands) {
+        esp_mn_commands_add(command.id, command.text.c_str());
+    }
+    esp_mn_error_t* error = esp_mn_commands_update();
+    if (error != nullptr) {
+        for (int i = 0; i < error->num; i++) {
+            ESP_LOGE(TAG, "Invalid command phrase: %d %s", error->phrases[i]->command_id, error->phrases[i]->string);
+        }
+        return false;
     }
-    wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
-        auto this_ = (CustomWakeWord*)arg;
-        {
-            auto start_time = esp_timer_get_time();
-            auto encoder = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
-            encoder->SetComplexity(0); // 0 is the fastest
-
-            int packets = 0;
-            for (auto& pcm: this_->wake_word_pcm_) {
-                encoder->Encode(std::move(pcm), [this_](std::vector<uint8_t>&& opus) {
-                    std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                    this_->wake_word_opus_.emplace_back(std::move(opus));
-                    this_->wake_word_cv_.notify_all();
-                });
-                packets++;
-            }
-            this_->wake_word_pcm_.clear();
 
-            auto end_time = esp_timer_get_time();
-            ESP_LOGI(TAG, "Encode wake word opus %d packets in %ld ms", packets, (long)((end_time - start_time) / 1000));
+    // 打印所有的命令词
+    multinet_->print_active_speech_commands(multinet_model_data_);
+    return true;
+}
 
-            std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-            this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-            this_->wake_word_cv_.notify_all();
+void CustomWakeWord::HandleCommand(int command_id, const char* text) {
+    SpeechCommand command = {command_id, text};
+    std::function<void(const SpeechCommand& command)> callback;
+    {
+        std::lock_guard<std::mutex> lock(commands_mutex_);
+        auto it = command_callbacks_.find(command_id);
+        if (it != command_callbacks_.end()) {
+            callback = it->second;
         }
-        vTaskDelete(NULL);
-    }, "encode_detect_packets", 4096 * 8, this, 2, wake_word_encode_task_stack_, &wake_word_encode_task_buffer_);
+    }
+
+    if (callback) {
+        callback(command);
+    } else {
+        ESP_LOGI(TAG, "No action for command %d: %s", command_id, text);
+    }
+}
+
+void CustomWakeWord::StoreWakeWordData(const int16_t* data, size_t samples) {
+    // Keep the last CONFIG_WAKE_WORD_PREROLL_MS of audio (16kHz mono), the ring never allocates
+    wake_word_preroll_.Write(data, samples);
+}
+
+void CustomWakeWord::EncodeWakeWordData() {
+    wake_word_encoder_.Start();
 }
 
 bool CustomWakeWord::GetWakeWordOpus(std::vector<uint8_t>& opus) {
-    std::unique_lock<std::mutex> lock(wake_word_mutex_);
-    wake_word_cv_.wait(lock, [this]() {
-        return !wake_word_opus_.empty();
-    });
-    opus.swap(wake_word_opus_.front());
-    wake_word_opus_.pop_front();
-    return !opus.empty();
+    return wake_word_encoder_.GetPacket(opus);
 }
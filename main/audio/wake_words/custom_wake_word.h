@@ -13,15 +13,16 @@
 #include <esp_mn_iface.h>
 #include <esp_mn_models.h>
 
-#include <list>
 #include <string>
 #include <vector>
 #include <functional>
+#include <map>
 #include <mutex>
-#include <condition_variable>
 
 #include "audio_codec.h"
 #include "wake_word.h"
+#include "audio_preroll_buffer.h"
+#include "wake_word_encoder.h"
 
 class CustomWakeWord : public WakeWord {
 public:
@@ -37,6 +38,9 @@ public:
     void EncodeWakeWordData();
     bool GetWakeWordOpus(std::vector<uint8_t>& opus);
     const std::string& GetLastDetectedWakeWord() const { return last_detected_wake_word_; }
+    bool SetCommands(const std::vector<SpeechCommand>& commands);
+    std::vector<SpeechCommand> GetCommands();
+    void OnCommandDetected(int command_id, std::function<void(const SpeechCommand& command)> callback);
 
 private:
     esp_afe_sr_iface_t* afe_iface_ = nullptr;
@@ -47,6 +51,13 @@ private:
     esp_mn_iface_t* multinet_ = nullptr;
     model_iface_data_t* multinet_model_data_ = nullptr;
     char* mn_name_ = nullptr;
+
+    // multinet 的检测与命令词更新互斥，SetCommands() 在调用者任务中直接应用，成功后才保存
+    std::mutex multinet_mutex_;
+    // 命令词表与命令回调
+    std::mutex commands_mutex_;
+    std::vector<SpeechCommand> commands_;
+    std::map<int, std::function<void(const SpeechCommand& command)>> command_callbacks_;
  
     char* wakenet_model_ = NULL;
     std::vector<std::string> wake_words_;
@@ -55,15 +66,12 @@ private:
     AudioCodec* codec_ = nullptr;
     std::string last_detected_wake_word_;
 
-    TaskHandle_t wake_word_encode_task_ = nullptr;
-    StaticTask_t wake_word_encode_task_buffer_;
-    StackType_t* wake_word_encode_task_stack_ = nullptr;
-    std::list<std::vector<int16_t>> wake_word_pcm_;
-    std::list<std::vector<uint8_t>> wake_word_opus_;
-    std::mutex wake_word_mutex_;
-    std::condition_variable wake_word_cv_;
+    AudioPrerollBuffer wake_word_preroll_;
+    WakeWordEncoder wake_word_encoder_;
 
     void StoreWakeWordData(const int16_t* data, size_t size);
+    bool ApplyCommands(const std::vector<SpeechCommand>& commands);
+    void HandleCommand(int command_id, const char* text);
     void AudioDetectionTask();
 };
 
@@ -182,6 +182,20 @@ std::string WifiBoard::GetDeviceStatusJson() {
      *     "audio_speaker": {
      *         "volume": 70
      *     },
+     *     "audio_latency": {
+     *         "uplink": { "total": { "p50": 180, "p95": 240, "p99": 300, "frames": 120 }, ... },
+     *         "downlink": { "total": { "p50": 150, "p95": 260, "p99": 380, "frames": 300 }, ... }
+     *     },
+     *     "audio_encoder": {
+     *         "complexity": 3,
+     *         "max_complexity": 6,
+     *         "bitrate": 24000,
+     *         "min_bitrate": 12000,
+     *         "max_bitrate": 32000,
+     *         "load_avg": 18,
+     *         "load_max": 35,
+     *         "measured_bitrate": 16000
+     *     },
      *     "screen": {
      *         "brightness": 100,
      *         "theme": "light"
@@ -211,6 +225,12 @@ std::string WifiBoard::GetDeviceStatusJson() {
     }
     cJSON_AddItemToObject(root, "audio_speaker", audio_speaker);
 
+    // Audio latency per pipeline stage
+    cJSON_AddItemToObject(root, "audio_latency", Application::GetInstance().GetAudioService().latency_tracer().GetJson());
+
+    // Uplink Opus encoder, complexity chosen by the governor and encode time in percent of the frame
+    cJSON_AddItemToObject(root, "audio_encoder", Application::GetInstance().GetAudioService().encoder_governor().GetJson());
+
     // Screen brightness
     auto backlight = board.GetBacklight();
     auto screen = cJSON_CreateObject();
@@ -112,6 +112,11 @@ void Display::UpdateStatusBar(bool update_all) {
         }
     }
 
+    // A recording can be started remotely, so it is shown for as long as it runs
+    if (app.GetAudioService().IsRecording()) {
+        ShowNotification(Lang::Strings::RECORDING, 1500);
+    }
+
     // Update time
     if (app.GetDeviceState() == kDeviceStateIdle) {
         if (last_status_update_time_ + std::chrono::seconds(10) < std::chrono::system_clock::now()) {
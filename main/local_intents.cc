@@ -0,0 +1,171 @@
+#include "local_intents.h"
+#include "application.h"
+#include "mcp_server.h"
+#include "settings.h"
+#include "assets/lang_config.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "LocalIntents"
+
+
+void LocalIntents::Initialize() {
+    Settings settings("wake_word", false);
+    auto json = settings.GetString("intents");
+    if (json.empty()) {
+        return;
+    }
+
+    std::vector<LocalIntent> intents;
+    std::string error;
+    if (!Parse(json, intents, error)) {
+        ESP_LOGE(TAG, "Invalid stored intents: %s", error.c_str());
+        return;
+    }
+    Bind(intents);
+}
+
+bool LocalIntents::Set(const std::string& json, std::string& error) {
+    std::vector<LocalIntent> intents;
+    if (!Parse(json, intents, error)) {
+        return false;
+    }
+
+    auto array = ToJson(intents);
+    char* str = cJSON_PrintUnformatted(array);
+    cJSON_Delete(array);
+    {
+        Settings settings("wake_word", true);
+        settings.SetString("intents", str);
+    }
+    cJSON_free(str);
+
+    Bind(intents);
+    return true;
+}
+
+cJSON* LocalIntents::GetJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return ToJson(intents_);
+}
+
+bool LocalIntents::Parse(const std::string& json, std::vector<LocalIntent>& intents, std::string& error) {
+    cJSON* root = cJSON_Parse(json.c_str());
+    if (!cJSON_IsArray(root)) {
+        cJSON_Delete(root);
+        error = "Expected a JSON array of {\"id\", \"tool\", \"arguments\"} objects";
+        return false;
+    }
+
+    intents.clear();
+    error.clear();
+    cJSON* item;
+    cJSON_ArrayForEach(item, root) {
+        auto id = cJSON_GetObjectItem(item, "id");
+        auto tool = cJSON_GetObjectItem(item, "tool");
+        auto arguments = cJSON_GetObjectItem(item, "arguments");
+        if (!cJSON_IsNumber(id) || !cJSON_IsString(tool)) {
+            error = "Every intent needs a numeric `id` and a string `tool`";
+            break;
+        }
+        if (id->valueint <= SPEECH_COMMAND_WAKE_WORD_ID || id->valueint > SPEECH_COMMAND_MAX_ID) {
+            error = "Command IDs range from 2 to " + std::to_string(SPEECH_COMMAND_MAX_ID) + ", 1 is the wake word";
+            break;
+        }
+        if (arguments != nullptr && !cJSON_IsObject(arguments)) {
+            error = "`arguments` must be an object";
+            break;
+        }
+        if (intents.size() == SPEECH_COMMAND_MAX_COUNT) {
+            error = "At most " + std::to_string(SPEECH_COMMAND_MAX_COUNT) + " intents";
+            break;
+        }
+
+        LocalIntent intent = {id->valueint, tool->valuestring, "{}"};
+        if (arguments != nullptr) {
+            char* str = cJSON_PrintUnformatted(arguments);
+            intent.arguments = str;
+            cJSON_free(str);
+        }
+        intents.push_back(intent);
+    }
+    cJSON_Delete(root);
+    return error.empty();
+}
+
+cJSON* LocalIntents::ToJson(const std::vector<LocalIntent>& intents) {
+    auto array = cJSON_CreateArray();
+    for (auto& intent : intents) {
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "id", intent.id);
+        cJSON_AddStringToObject(item, "tool", intent.tool.c_str());
+        cJSON_AddItemToObject(item, "arguments", cJSON_Parse(intent.arguments.c_str()));
+        cJSON_AddItemToArray(array, item);
+    }
+    return array;
+}
+
+void LocalIntents::Bind(const std::vector<LocalIntent>& intents) {
+    auto& audio_service = Application::GetInstance().GetAudioService();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& intent : intents_) {
+        audio_service.OnSpeechCommand(intent.id, nullptr);
+    }
+    intents_ = intents;
+    for (auto& intent : intents_) {
+        // Runs on the detection task, the tool is called on a tool_call thread like tools/call
+        audio_service.OnSpeechCommand(intent.id, [this, intent](const SpeechCommand& command) {
+            Execute(intent, command, esp_timer_get_time());
+        });
+    }
+    ESP_LOGI(TAG, "%u local intents", intents_.size());
+}
+
+void LocalIntents::Execute(const LocalIntent& intent, const SpeechCommand& command, int64_t detected_time_us) {
+    cJSON* arguments = cJSON_Parse(intent.arguments.c_str());
+    McpServer::GetInstance().CallTool(intent.tool, arguments,
+        [intent, command, detected_time_us](bool success, const std::string& result) {
+            Finish(intent, command, detected_time_us, success, result);
+        });
+    cJSON_Delete(arguments);
+}
+
+void LocalIntents::Finish(const LocalIntent& intent, const SpeechCommand& command, int64_t detected_time_us,
+    bool success, const std::string& result) {
+    auto& app = Application::GetInstance();
+    auto& audio_service = app.GetAudioService();
+
+    // The confirmation sounds are in the sound cache warm-up list, so they start at the next DMA period
+    audio_service.PlaySound(success ? Lang::Sounds::P3_SUCCESS : Lang::Sounds::P3_EXCLAMATION);
+    int64_t done_time_us = esp_timer_get_time();
+    audio_service.latency_tracer().Record(kLatencyStageCommandToAction, detected_time_us, done_time_us);
+    if (success) {
+        ESP_LOGI(TAG, "Command %d '%s': %s done in %lld ms", command.id, command.text.c_str(), intent.tool.c_str(),
+            (done_time_us - detected_time_us) / 1000);
+    } else {
+        ESP_LOGE(TAG, "Command %d '%s': %s failed: %s", command.id, command.text.c_str(), intent.tool.c_str(), result.c_str());
+    }
+
+#if CONFIG_LOCAL_INTENT_NOTIFY_SERVER
+    /* Tell the server what was done locally, so the conversation can refer to it */
+    auto params = cJSON_CreateObject();
+    cJSON_AddNumberToObject(params, "id", command.id);
+    cJSON_AddStringToObject(params, "text", command.text.c_str());
+    cJSON_AddStringToObject(params, "name", intent.tool.c_str());
+    cJSON_AddItemToObject(params, "arguments", cJSON_Parse(intent.arguments.c_str()));
+    if (success) {
+        cJSON_AddItemToObject(params, "result", cJSON_Parse(result.c_str()));
+    } else {
+        cJSON_AddStringToObject(params, "error", result.c_str());
+    }
+    auto root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "jsonrpc", "2.0");
+    cJSON_AddStringToObject(root, "method", "notifications/local_command");
+    cJSON_AddItemToObject(root, "params", params);
+    char* payload = cJSON_PrintUnformatted(root);
+    app.SendMcpNotification(payload);
+    cJSON_free(payload);
+    cJSON_Delete(root);
+#endif
+}
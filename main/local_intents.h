@@ -0,0 +1,61 @@
+#ifndef LOCAL_INTENTS_H
+#define LOCAL_INTENTS_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+
+#include <cJSON.h>
+
+#include "speech_commands.h"
+
+// A local command bound to an MCP tool call with fixed arguments
+struct LocalIntent {
+    int id;                 // Speech command ID
+    std::string tool;       // MCP tool name, e.g. self.set_car_status
+    std::string arguments;  // JSON object, e.g. {"light2": true}
+};
+
+/*
+ * Local intent table: runs an MCP tool on the device when a local command word is recognized,
+ * without the round trip through the server (uplink audio, STT, LLM, tools/call).
+ *
+ * The table is stored in the "wake_word" NVS namespace next to the command words and replaced with
+ * the MCP tool self.voice_commands.set_intents. A recognized command calls the tool on a tool_call
+ * thread, like a server tools/call, so neither the detection task nor the main task waits for it, then
+ * plays the cached success (or exclamation) sound. With CONFIG_LOCAL_INTENT_NOTIFY_SERVER the server is
+ * told afterwards with an MCP notification, only while it can be reached.
+ * The time from recognition to the end of the tool call is traced as wake_word.command_to_action.
+ *
+ * Set() / GetJson() may be called from any task.
+ */
+class LocalIntents {
+public:
+    static LocalIntents& GetInstance() {
+        static LocalIntents instance;
+        return instance;
+    }
+
+    // Loads the table and binds its command IDs, after AudioService::Initialize()
+    void Initialize();
+    // Parses, validates, saves and binds a JSON array, returns false with a message on error
+    bool Set(const std::string& json, std::string& error);
+    cJSON* GetJson();
+
+private:
+    LocalIntents() = default;
+
+    std::mutex mutex_;
+    std::vector<LocalIntent> intents_;
+
+    static bool Parse(const std::string& json, std::vector<LocalIntent>& intents, std::string& error);
+    static cJSON* ToJson(const std::vector<LocalIntent>& intents);
+    void Bind(const std::vector<LocalIntent>& intents);
+    void Execute(const LocalIntent& intent, const SpeechCommand& command, int64_t detected_time_us);
+    // On the tool_call thread when the tool returns
+    static void Finish(const LocalIntent& intent, const SpeechCommand& command, int64_t detected_time_us,
+        bool success, const std::string& result);
+};
+
+#endif // LOCAL_INTENTS_H
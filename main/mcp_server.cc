@@ -9,10 +9,13 @@
 #include <algorithm>
 #include <cstring>
 #include <esp_pthread.h>
+#include <thread>
 
 #include "application.h"
 #include "display.h"
 #include "board.h"
+#include "local_intents.h"
+#include "system_info.h"
 
 #define TAG "MCP"
 
@@ -37,6 +40,49 @@ inline std::string SafeJsonToString(cJSON* root) {
     return result;
 }
 
+#if CONFIG_AUDIO_RECORDER_MCP_TOOLS
+static cJSON* RecordingToJson(const AudioRecording& recording) {
+    auto json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "tap", AudioTapName(recording.tap));
+    cJSON_AddStringToObject(json, "format", recording.format == kAudioRecordFormatOpus ? "opus" : "pcm");
+    cJSON_AddNumberToObject(json, "duration_ms", recording.duration_ms());
+    cJSON_AddNumberToObject(json, "bytes", recording.size);
+    cJSON_AddNumberToObject(json, "dropped_frames", recording.dropped_frames);
+    return json;
+}
+
+// POSTs the recording as a WAV file (PCM) or a P3 stream (Opus), in chunks straight from its buffer
+static bool UploadRecording(const AudioRecording& recording, const std::string& url) {
+    auto http = Board::GetInstance().GetNetwork()->CreateHttp(3);
+    http->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
+    http->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
+    http->SetHeader("Content-Type", recording.format == kAudioRecordFormatOpus ? "application/octet-stream" : "audio/wav");
+    http->SetHeader("X-Audio-Tap", AudioTapName(recording.tap));
+    http->SetHeader("X-Audio-Format", recording.format == kAudioRecordFormatOpus ? "p3" : "wav");
+    http->SetHeader("Transfer-Encoding", "chunked");
+    if (!http->Open("POST", url)) {
+        ESP_LOGE(TAG, "Failed to connect to %s", url.c_str());
+        return false;
+    }
+    auto header = recording.FileHeader();
+    if (!header.empty()) {
+        http->Write(header.data(), header.size());
+    }
+    auto data = recording.view();
+    for (size_t offset = 0; offset < data.size(); offset += 4096) {
+        http->Write(data.data() + offset, std::min<size_t>(4096, data.size() - offset));
+    }
+    http->Write("", 0);
+    int status = http->GetStatusCode();
+    http->Close();
+    if (status != 200) {
+        ESP_LOGE(TAG, "Failed to upload the recording, status code: %d", status);
+        return false;
+    }
+    ESP_LOGI(TAG, "Uploaded %u bytes of recording to %s", data.size() + header.size(), url.c_str());
+    return true;
+}
+#endif
 
 void McpServer::AddCommonTools() {
     // To speed up the response time, we add the common tools to the beginning of
@@ -130,6 +176,168 @@ void McpServer::AddCommonTools() {
             return board.GetDeviceStatusJson();
         });
 
+    AddTool("self.get_audio_latency",
+        "Provides the audio latency of every pipeline stage in milliseconds (p50 / p95 / p99 over the traced frames).\n"
+        "Uplink: microphone -> audio processor -> encoder -> sent. Downlink: received -> decoder -> speaker.\n"
+        "Set `reset` to true to clear the statistics after reading them.",
+        PropertyList({
+            Property("reset", kPropertyTypeBoolean, false)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& tracer = Application::GetInstance().GetAudioService().latency_tracer();
+            auto json = tracer.GetJson();
+            if (properties["reset"].value<bool>()) {
+                tracer.Reset();
+            }
+            return SafeJsonToString(json);
+        });
+
+#if CONFIG_AUDIO_RECORDER_MCP_TOOLS
+    AddTool("self.audio_recorder.start",
+        "Start recording the audio that the device hears, for diagnostics (e.g. a sample of the noise in the car).\n"
+        "Args:\n"
+        "  `tap`: `microphone` (raw), `reference` (the speaker signal, if the board has it) or `processed` (after echo\n"
+        "    cancellation and noise suppression, only while the device listens).\n"
+        "  `format`: `opus` (small) or `pcm` (raw 16 kHz).\n"
+        "  `duration`: The length in seconds, the recording stops by itself.",
+        PropertyList({
+            Property("tap", kPropertyTypeString, std::string("microphone")),
+            Property("format", kPropertyTypeString, std::string("opus")),
+            Property("duration", kPropertyTypeInteger, 10, 1, CONFIG_AUDIO_RECORDER_MAX_DURATION)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            AudioTap tap;
+            if (!ParseAudioTap(properties["tap"].value<std::string>(), tap)) {
+                throw std::invalid_argument("Unknown tap: " + properties["tap"].value<std::string>());
+            }
+            auto format_name = properties["format"].value<std::string>();
+            if (format_name != "opus" && format_name != "pcm") {
+                throw std::invalid_argument("Unknown format: " + format_name);
+            }
+            auto format = format_name == "opus" ? kAudioRecordFormatOpus : kAudioRecordFormatPcm;
+            if (tap == kAudioTapReference && Board::GetInstance().GetAudioCodec()->input_channels() < 2) {
+                throw std::invalid_argument("This board has no reference channel");
+            }
+            auto& audio_service = Application::GetInstance().GetAudioService();
+            return audio_service.StartRecording(tap, format, properties["duration"].value<int>() * 1000);
+        });
+
+    AddTool("self.audio_recorder.stop",
+        "Stop the recording, or get the last recording if it already stopped.\n"
+        "Return:\n"
+        "  A JSON object with `tap`, `format`, `duration_ms` and `bytes`, or null if there is no recording.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& audio_service = Application::GetInstance().GetAudioService();
+            auto recording = audio_service.StopRecording();
+            if (!recording) {
+                recording = audio_service.last_recording();
+            }
+            if (!recording) {
+                return "null";
+            }
+            return SafeJsonToString(RecordingToJson(*recording));
+        });
+
+    AddTool("self.audio_recorder.play",
+        "Play the last recording on the speaker.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& audio_service = Application::GetInstance().GetAudioService();
+            auto recording = audio_service.last_recording();
+            if (!recording) {
+                return false;
+            }
+            audio_service.PlayRecording(recording);
+            return true;
+        });
+
+    AddTool("self.audio_recorder.upload",
+        "Upload the last recording with an HTTP POST, as a WAV file (pcm) or a P3 stream (opus).\n"
+        "Args:\n"
+        "  `url`: The URL to post the recording to.",
+        PropertyList({
+            Property("url", kPropertyTypeString)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto recording = Application::GetInstance().GetAudioService().last_recording();
+            if (!recording) {
+                throw std::runtime_error("No recording");
+            }
+            return UploadRecording(*recording, properties["url"].value<std::string>());
+        });
+#endif
+
+#if CONFIG_USE_SERVER_AEC
+    AddTool("self.audio_speaker.calibrate_echo_delay",
+        "Measure the delay from the speaker to the microphone with a short chirp, for the server echo cancellation.\n"
+        "Call it when the user says the echo cancellation does not work well (e.g. the device hears itself). Keep the room quiet.\n"
+        "Return:\n"
+        "  A JSON object with `delay_ms`, the delay that is used from now on, and `calibrated`, false if the chirp was not heard.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& audio_service = Application::GetInstance().GetAudioService();
+            int result = audio_service.CalibrateLoopbackDelay();
+            auto json = cJSON_CreateObject();
+            cJSON_AddNumberToObject(json, "delay_ms", audio_service.loopback_delay_us() / 1000.0);
+            cJSON_AddBoolToObject(json, "calibrated", result >= 0);
+            return SafeJsonToString(json);
+        });
+#endif
+
+#if CONFIG_USE_CUSTOM_WAKE_WORD
+    AddTool("self.voice_commands.get",
+        "Get the wake word and the local voice commands that the device recognizes offline.\n"
+        "Return:\n"
+        "  A JSON object with `wake_word` (command ID 1), `commands`, an array of {`id`, `text`},\n"
+        "  and `intents`, the tools that the device calls itself for a command ID.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto commands = Application::GetInstance().GetAudioService().GetSpeechCommands();
+            auto root = cJSON_CreateObject();
+            cJSON_AddStringToObject(root, "wake_word", CONFIG_CUSTOM_WAKE_WORD);
+            cJSON_AddItemToObject(root, "commands", SpeechCommandList::ToJson(commands));
+            cJSON_AddItemToObject(root, "intents", LocalIntents::GetInstance().GetJson());
+            return SafeJsonToString(root);
+        });
+
+    AddTool("self.voice_commands.set",
+        "Replace the local voice commands (the wake word stays). The list is applied at once and saved on the device; "
+        "if the speech recognizer rejects a phrase, nothing is changed and an error is returned.\n"
+        "Args:\n"
+        "  `commands`: A JSON array of {\"id\": 2-255, \"text\": \"PHRASE\"}, at most 32. Several phrases may share an ID.",
+        PropertyList({
+            Property("commands", kPropertyTypeString)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            std::vector<SpeechCommand> commands;
+            std::string error;
+            if (!SpeechCommandList::Parse(properties["commands"].value<std::string>(), commands, error)) {
+                throw std::invalid_argument(error);
+            }
+            if (!Application::GetInstance().GetAudioService().SetSpeechCommands(commands)) {
+                throw std::runtime_error("The speech recognizer rejected the commands, see the device log");
+            }
+            return true;
+        });
+
+    AddTool("self.voice_commands.set_intents",
+        "Replace the local intents: the device calls the tool with the fixed arguments itself when a command ID is recognized,\n"
+        "without asking the server. Use it for frequent commands that need a fast answer (e.g. turning on a light).\n"
+        "Args:\n"
+        "  `intents`: A JSON array of {\"id\": 2-255, \"tool\": \"self.xxx\", \"arguments\": {...}}, at most 32.",
+        PropertyList({
+            Property("intents", kPropertyTypeString)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            std::string error;
+            if (!LocalIntents::GetInstance().Set(properties["intents"].value<std::string>(), error)) {
+                throw std::invalid_argument(error);
+            }
+            return true;
+        });
+#endif
+
     AddTool("self.audio_speaker.set_volume", 
         "Set the volume of the audio speaker. If the current volume is unknown, you must call `self.get_device_status` tool first and then call this tool.",
         PropertyList({
@@ -390,48 +598,54 @@ void McpServer::GetToolsList(int id, const std::string& cursor) {
     ReplyResult(id, json);
 }
 
-void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, int stack_size) {
-    auto tool_iter = std::find_if(tools_.begin(), tools_.end(), 
-                                 [&tool_name](const McpTool* tool) { 
-                                     return tool->name() == tool_name; 
+PropertyList McpServer::ParseArguments(const McpTool* tool, const cJSON* tool_arguments) {
+    PropertyList arguments = tool->properties();
+    for (auto& argument : arguments) {
+        bool found = false;
+        if (cJSON_IsObject(tool_arguments)) {
+            auto value = cJSON_GetObjectItem(tool_arguments, argument.name().c_str());
+            if (argument.type() == kPropertyTypeBoolean && cJSON_IsBool(value)) {
+                argument.set_value<bool>(value->valueint == 1);
+                found = true;
+            } else if (argument.type() == kPropertyTypeInteger && cJSON_IsNumber(value)) {
+                argument.set_value<int>(value->valueint);
+                found = true;
+            } else if (argument.type() == kPropertyTypeString && cJSON_IsString(value)) {
+                argument.set_value<std::string>(value->valuestring);
+                found = true;
+            }
+        }
+
+        if (!argument.has_default_value() && !found) {
+            throw std::invalid_argument("Missing valid argument: " + argument.name());
+        }
+    }
+    return arguments;
+}
+
+void McpServer::CallTool(const std::string& tool_name, const cJSON* tool_arguments,
+    std::function<void(bool success, const std::string& result)> done) {
+    auto tool_iter = std::find_if(tools_.begin(), tools_.end(),
+                                 [&tool_name](const McpTool* tool) {
+                                     return tool->name() == tool_name;
                                  });
-    
     if (tool_iter == tools_.end()) {
-        ESP_LOGE(TAG, "tools/call: Unknown tool: %s", tool_name.c_str());
-        ReplyError(id, "Unknown tool: " + tool_name);
+        done(false, "Unknown tool: " + tool_name);
         return;
     }
 
-    PropertyList arguments = (*tool_iter)->properties();
+    PropertyList arguments;
     try {
-        for (auto& argument : arguments) {
-            bool found = false;
-            if (cJSON_IsObject(tool_arguments)) {
-                auto value = cJSON_GetObjectItem(tool_arguments, argument.name().c_str());
-                if (argument.type() == kPropertyTypeBoolean && cJSON_IsBool(value)) {
-                    argument.set_value<bool>(value->valueint == 1);
-                    found = true;
-                } else if (argument.type() == kPropertyTypeInteger && cJSON_IsNumber(value)) {
-                    argument.set_value<int>(value->valueint);
-                    found = true;
-                } else if (argument.type() == kPropertyTypeString && cJSON_IsString(value)) {
-                    argument.set_value<std::string>(value->valuestring);
-                    found = true;
-                }
-            }
-
-            if (!argument.has_default_value() && !found) {
-                ESP_LOGE(TAG, "tools/call: Missing valid argument: %s", argument.name().c_str());
-                ReplyError(id, "Missing valid argument: " + argument.name());
-                return;
-            }
-        }
+        arguments = ParseArguments(*tool_iter, tool_arguments);
     } catch (const std::exception& e) {
-        ESP_LOGE(TAG, "tools/call: %s", e.what());
-        ReplyError(id, e.what());
+        done(false, e.what());
         return;
     }
+    StartToolCallThread(*tool_iter, std::move(arguments), DEFAULT_TOOLCALL_STACK_SIZE, done);
+}
 
+void McpServer::StartToolCallThread(McpTool* tool, PropertyList&& arguments, int stack_size,
+    std::function<void(bool success, const std::string& result)> done) {
     // Start a task to receive data with stack size
     esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
     cfg.thread_name = "tool_call";
@@ -439,14 +653,49 @@ void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* to
     cfg.prio = 1;
     esp_pthread_set_cfg(&cfg);
 
-    // Use a thread to call the tool to avoid blocking the main thread
-    tool_call_thread_ = std::thread([this, id, tool_iter, arguments = std::move(arguments)]() {
+    // Use a thread to call the tool to avoid blocking the main thread. Tools are called from the main task and
+    // from the local commands, so each call owns its detached thread, nothing is shared between them
+    std::thread tool_call_thread([tool, arguments = std::move(arguments), done]() {
+        std::string result;
+        bool success = true;
         try {
-            ReplyResult(id, (*tool_iter)->Call(arguments));
+            result = tool->Call(arguments);
         } catch (const std::exception& e) {
             ESP_LOGE(TAG, "tools/call: %s", e.what());
-            ReplyError(id, e.what());
+            result = e.what();
+            success = false;
+        }
+        done(success, result);
+    });
+    tool_call_thread.detach();
+}
+
+void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, int stack_size) {
+    auto tool_iter = std::find_if(tools_.begin(), tools_.end(), 
+                                 [&tool_name](const McpTool* tool) { 
+                                     return tool->name() == tool_name; 
+                                 });
+    
+    if (tool_iter == tools_.end()) {
+        ESP_LOGE(TAG, "tools/call: Unknown tool: %s", tool_name.c_str());
+        ReplyError(id, "Unknown tool: " + tool_name);
+        return;
+    }
+
+    PropertyList arguments;
+    try {
+        arguments = ParseArguments(*tool_iter, tool_arguments);
+    } catch (const std::exception& e) {
+        ESP_LOGE(TAG, "tools/call: %s", e.what());
+        ReplyError(id, e.what());
+        return;
+    }
+
+    StartToolCallThread(*tool_iter, std::move(arguments), stack_size, [this, id](bool success, const std::string& result) {
+        if (success) {
+            ReplyResult(id, result);
+        } else {
+            ReplyError(id, result);
         }
     });
-    tool_call_thread_.detach();
 }
\ No newline at end of file
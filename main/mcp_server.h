@@ -8,7 +8,6 @@
 #include <variant>
 #include <optional>
 #include <stdexcept>
-#include <thread>
 
 #include <cJSON.h>
 
@@ -261,6 +260,11 @@ public:
     void AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
     void ParseMessage(const cJSON* json);
     void ParseMessage(const std::string& message);
+    // Calls a tool without a JSON-RPC request (local commands), on a tool_call thread like tools/call.
+    // done(success, result) gets the tools/call result or the error message; it runs on that thread,
+    // or on the calling task for an unknown tool or invalid arguments.
+    void CallTool(const std::string& tool_name, const cJSON* tool_arguments,
+        std::function<void(bool success, const std::string& result)> done);
 
 private:
     McpServer();
@@ -273,9 +277,11 @@ private:
 
     void GetToolsList(int id, const std::string& cursor);
     void DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, int stack_size);
+    void StartToolCallThread(McpTool* tool, PropertyList&& arguments, int stack_size,
+        std::function<void(bool success, const std::string& result)> done);
+    PropertyList ParseArguments(const McpTool* tool, const cJSON* tool_arguments);
 
     std::vector<McpTool*> tools_;
-    std::thread tool_call_thread_;
 };
 
 #endif // MCP_SERVER_H
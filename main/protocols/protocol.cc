@@ -24,6 +24,52 @@ void Protocol::OnNetworkError(std::function<void(const std::string& message)> ca
     on_network_error_ = callback;
 }
 
+void Protocol::SetPreferredFrameDuration(int frame_duration) {
+    preferred_frame_duration_ = frame_duration;
+}
+
+void Protocol::SetPacketPool(AudioObjectPool<AudioStreamPacket>* packet_pool) {
+    packet_pool_ = packet_pool;
+}
+
+std::unique_ptr<AudioStreamPacket> Protocol::AcquirePacket() {
+    if (packet_pool_ == nullptr) {
+        return std::make_unique<AudioStreamPacket>();
+    }
+    auto packet = packet_pool_->Acquire();
+    packet->Reset();
+    return packet;
+}
+
+void Protocol::RecyclePacket(std::unique_ptr<AudioStreamPacket>&& packet) {
+    if (packet_pool_ != nullptr) {
+        packet_pool_->Release(std::move(packet));
+    }
+}
+
+/*
+ * The hello message requests preferred_frame_duration_ for the uplink. The frame_duration of the
+ * server's answer is its TTS (downlink) frame duration and says nothing about the uplink, so the
+ * request stands unless the server answers with its own uplink_frame_duration. A server that only
+ * supports another duration answers with that one, and we follow it as long as it is one we can
+ * encode (20 / 40 / 60 ms).
+ */
+void Protocol::NegotiateFrameDuration(const cJSON* audio_params) {
+    uplink_frame_duration_ = preferred_frame_duration_;
+    auto frame_duration = cJSON_GetObjectItem(audio_params, "uplink_frame_duration");
+    if (!cJSON_IsNumber(frame_duration) || frame_duration->valueint == preferred_frame_duration_) {
+        return;
+    }
+    int duration = frame_duration->valueint;
+    if (duration >= 20 && duration <= 60 && duration % 20 == 0) {
+        uplink_frame_duration_ = duration;
+    } else {
+        uplink_frame_duration_ = 60;
+    }
+    ESP_LOGI(TAG, "Requested %d ms frames, server answered %d ms, using %d ms",
+        preferred_frame_duration_, duration, uplink_frame_duration_);
+}
+
 void Protocol::SetError(const std::string& message) {
     error_occurred_ = true;
     if (on_network_error_ != nullptr) {
@@ -6,12 +6,40 @@
 #include <functional>
 #include <chrono>
 #include <vector>
+#include <memory>
+
+#include "audio_object_pool.h"
 
 struct AudioStreamPacket {
     int sample_rate = 0;
     int frame_duration = 0;
     uint32_t timestamp = 0;
+    uint32_t sequence = 0;      // Transport sequence number, 0 if the transport has none
+    // Latency tracing stamps (esp_timer_get_time), 0 if not stamped
+    int64_t origin_time_us = 0;     // Uplink: microphone read, downlink: network receive
+    int64_t processed_time_us = 0;  // Uplink: audio processor output
+    int64_t encoded_time_us = 0;    // Uplink: Opus encoder done
     std::vector<uint8_t> payload;
+    // Set instead of payload when the bytes already live in memory that outlives the packet,
+    // such as the P3 sounds mapped from flash, so they are read in place
+    const uint8_t* span_data = nullptr;
+    size_t span_size = 0;
+
+    inline const uint8_t* data() const { return span_data != nullptr ? span_data : payload.data(); }
+    inline size_t size() const { return span_data != nullptr ? span_size : payload.size(); }
+    // Clears a recycled packet, the payload keeps its storage
+    void Reset() {
+        sample_rate = 0;
+        frame_duration = 0;
+        timestamp = 0;
+        sequence = 0;
+        origin_time_us = 0;
+        processed_time_us = 0;
+        encoded_time_us = 0;
+        payload.clear();
+        span_data = nullptr;
+        span_size = 0;
+    }
 };
 
 struct BinaryProtocol2 {
@@ -51,6 +79,12 @@ public:
     inline int server_frame_duration() const {
         return server_frame_duration_;
     }
+    inline int uplink_frame_duration() const {
+        return uplink_frame_duration_;
+    }
+    inline int preferred_frame_duration() const {
+        return preferred_frame_duration_;
+    }
     inline const std::string& session_id() const {
         return session_id_;
     }
@@ -60,12 +94,18 @@ public:
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
+    void SetPreferredFrameDuration(int frame_duration);
+    // Incoming audio packets are taken from this pool (the AudioService one), plain heap packets when none is set
+    void SetPacketPool(AudioObjectPool<AudioStreamPacket>* packet_pool);
 
     virtual bool Start() = 0;
     virtual bool OpenAudioChannel() = 0;
     virtual void CloseAudioChannel() = 0;
     virtual bool IsAudioChannelOpened() const = 0;
-    virtual bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) = 0;
+    // The server can be reached without opening a session: always while the audio channel is open,
+    // and for MQTT while the broker connection is up
+    virtual bool IsConnected() const { return IsAudioChannelOpened(); }
+    virtual bool SendAudio(const AudioStreamPacket& packet) = 0;
     virtual void SendWakeWordDetected(const std::string& wake_word);
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
@@ -78,9 +118,12 @@ protected:
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
     std::function<void(const std::string& message)> on_network_error_;
+    AudioObjectPool<AudioStreamPacket>* packet_pool_ = nullptr;
 
     int server_sample_rate_ = 24000;
     int server_frame_duration_ = 60;
+    int preferred_frame_duration_ = 60;    // Uplink frame duration requested in the hello message
+    int uplink_frame_duration_ = 60;       // Uplink frame duration after the hello exchange
     bool error_occurred_ = false;
     std::string session_id_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
@@ -88,6 +131,9 @@ protected:
     virtual bool SendText(const std::string& text) = 0;
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
+    void NegotiateFrameDuration(const cJSON* audio_params);
+    std::unique_ptr<AudioStreamPacket> AcquirePacket();
+    void RecyclePacket(std::unique_ptr<AudioStreamPacket>&& packet);
 };
 
 #endif // PROTOCOL_H
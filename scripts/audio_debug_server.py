@@ -1,54 +1,170 @@
 import socket
+import struct
+import time
 import wave
 import argparse
 
 
 '''
-  Create a UDP socket and bind it to the server's IP:8000.
-  Listen for incoming messages and print them to the console.
-  Save the audio to a WAV file.
+  Create a UDP socket and bind it to the server's IP:PORT.
+  Receive the framed stream of the audio debugger (main/audio/processors/audio_debugger.h),
+  save every tap to its own WAV file and report lost datagrams and samples.
 '''
-def main(samplerate, channels):
+
+# Little endian, must match AudioDebugDatagramHeader / AudioDebugChunkHeader
+DATAGRAM_HEADER = struct.Struct('<HBBI')    # magic, version, chunks, sequence
+CHUNK_HEADER = struct.Struct('<BBHIII')     # tap, channels, frames, sample_rate, position, timestamp_us
+MAGIC = 0x4441
+VERSION = 1
+
+TAP_NAMES = {
+    0: 'input',
+    1: 'processed',
+    2: 'encoder',
+    3: 'decoder',
+}
+
+
+class TapWriter:
+    '''One tap, a new file is started when its format changes or its position restarts (device reboot)'''
+
+    def __init__(self, tap, fill_gaps):
+        self.name = TAP_NAMES.get(tap, f'tap{tap}')
+        self.fill_gaps = fill_gaps
+        self.wav_file = None
+        self.files = 0
+        self.format = None
+        self.position = None
+        self.frames = 0
+        self.lost_frames = 0
+
+    def open(self, sample_rate, channels):
+        self.close()
+        suffix = f'_{self.files}' if self.files > 0 else ''
+        self.filename = f'{self.name}_{sample_rate}_{channels}{suffix}.wav'
+        self.files += 1
+        self.wav_file = wave.open(self.filename, 'wb')
+        self.wav_file.setnchannels(channels)
+        self.wav_file.setsampwidth(2)
+        self.wav_file.setframerate(sample_rate)
+        self.format = (sample_rate, channels)
+        print(f'[{self.name}] Saving {sample_rate} Hz, {channels} channel(s) to {self.filename}')
+
+    def write(self, sample_rate, channels, position, pcm):
+        frame_bytes = channels * 2
+        if self.format != (sample_rate, channels) or (self.position is not None and position < self.position):
+            if self.position is not None and position < self.position:
+                print(f'[{self.name}] Stream restarted at position {position}')
+            self.open(sample_rate, channels)
+            self.position = position
+
+        if self.position is not None and position > self.position:
+            gap = position - self.position
+            self.lost_frames += gap
+            if self.fill_gaps:
+                self.wav_file.writeframes(b'\x00' * (gap * frame_bytes))
+        self.wav_file.writeframes(pcm)
+        count = len(pcm) // frame_bytes
+        self.frames += count
+        self.position = position + count
+
+    def report(self):
+        if self.format is None:
+            return
+        total = self.frames + self.lost_frames
+        loss = self.lost_frames * 100.0 / total if total > 0 else 0
+        seconds = self.frames / self.format[0]
+        print(f'[{self.name}] {seconds:.2f} s received, {self.lost_frames} samples lost ({loss:.2f}%)')
+
+    def close(self):
+        if self.wav_file is not None:
+            self.wav_file.close()
+            self.wav_file = None
+            print(f"WAV file '{self.filename}' saved successfully")
+
+
+def main(port, fill_gaps, report_interval):
     # Create a UDP socket
     server_socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
-    server_socket.bind(('0.0.0.0', 8000))
+    server_socket.bind(('0.0.0.0', port))
+    server_socket.settimeout(1.0)
+    print(f'Receiving audio debug stream on 0.0.0.0:{port}...')
 
-    # Create WAV file with parameters
-    filename = f"{samplerate}_{channels}.wav"
-    wav_file = wave.open(filename, "wb")
-    wav_file.setnchannels(channels)     # channels parameter
-    wav_file.setsampwidth(2)            # 2 bytes per sample (16-bit)
-    wav_file.setframerate(samplerate)   # samplerate parameter
+    writers = {}
+    next_sequence = None
+    datagrams = 0
+    lost_datagrams = 0
+    invalid_datagrams = 0
+    last_report = time.time()
 
-    print(f"Start saving audio from 0.0.0.0:8000 to {filename}...")
+    def report():
+        total = datagrams + lost_datagrams
+        loss = lost_datagrams * 100.0 / total if total > 0 else 0
+        print(f'{datagrams} datagrams received, {lost_datagrams} lost ({loss:.2f}%), {invalid_datagrams} invalid')
+        for writer in writers.values():
+            writer.report()
 
     try:
         while True:
-            # Receive a message from the client
-            message, address = server_socket.recvfrom(8000)
-            
-            # Write PCM data to WAV file
-            wav_file.writeframes(message)
-
-            # Print length of the message
-            print(f"Received {len(message)} bytes from {address}")
-    
+            try:
+                message, address = server_socket.recvfrom(2048)
+            except socket.timeout:
+                message = None
+
+            if message is not None:
+                if len(message) < DATAGRAM_HEADER.size:
+                    invalid_datagrams += 1
+                    continue
+                magic, version, chunks, sequence = DATAGRAM_HEADER.unpack_from(message, 0)
+                if magic != MAGIC or version != VERSION:
+                    invalid_datagrams += 1
+                    continue
+
+                # A sequence below the expected one is a device reboot, not a loss
+                if next_sequence is not None and sequence > next_sequence:
+                    lost_datagrams += sequence - next_sequence
+                next_sequence = sequence + 1
+                datagrams += 1
+
+                offset = DATAGRAM_HEADER.size
+                for _ in range(chunks):
+                    if offset + CHUNK_HEADER.size > len(message):
+                        invalid_datagrams += 1
+                        break
+                    tap, channels, frames, sample_rate, position, timestamp_us = CHUNK_HEADER.unpack_from(message, offset)
+                    offset += CHUNK_HEADER.size
+                    size = frames * channels * 2
+                    if channels == 0 or offset + size > len(message):
+                        invalid_datagrams += 1
+                        break
+                    if tap not in writers:
+                        writers[tap] = TapWriter(tap, fill_gaps)
+                    writers[tap].write(sample_rate, channels, position, message[offset:offset + size])
+                    offset += size
+
+            if report_interval > 0 and time.time() - last_report >= report_interval:
+                last_report = time.time()
+                report()
+
     except KeyboardInterrupt:
-        print("\nStopping recording...")
-    
+        print('\nStopping recording...')
+
     finally:
         # Close files and socket
-        wav_file.close()
+        report()
+        for writer in writers.values():
+            writer.close()
         server_socket.close()
-        print(f"WAV file '{filename}' saved successfully")
 
 
 if __name__ == "__main__":
-    parser = argparse.ArgumentParser(description='UDP音频数据接收器，保存为WAV文件')
-    parser.add_argument('--samplerate', '-s', type=int, default=16000, 
-                        help='采样率 (默认: 16000)')
-    parser.add_argument('--channels', '-c', type=int, default=2, 
-                        help='声道数 (默认: 2)')
-    
+    parser = argparse.ArgumentParser(description='UDP音频调试数据接收器，按数据源分别保存为WAV文件并统计丢包')
+    parser.add_argument('--port', '-p', type=int, default=8000,
+                        help='监听端口 (默认: 8000)')
+    parser.add_argument('--no-fill', action='store_true',
+                        help='丢失的采样不补静音 (默认补静音以保持各路时间对齐)')
+    parser.add_argument('--report-interval', '-r', type=float, default=5,
+                        help='丢包统计的打印间隔秒数，0 表示只在退出时打印 (默认: 5)')
+
     args = parser.parse_args()
-    main(args.samplerate, args.channels)
+    main(args.port, not args.no_fill, args.report_interval)
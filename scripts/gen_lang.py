@@ -24,6 +24,12 @@ namespace Lang {{
     // 音效资源
     namespace Sounds {{
 {sounds}
+
+        // 按文件名（不含 .p3）查找音效，未找到时返回空
+        static inline std::string_view Find(std::string_view name) {{
+{sound_lookup}
+            return {{}};
+        }}
     }}
 }}
 """
@@ -41,6 +47,7 @@ def generate_header(input_path, output_path):
     # 生成字符串常量
     strings = []
     sounds = []
+    sound_names = []
     for key, value in data['strings'].items():
         value = value.replace('"', '\\"')
         strings.append(f'        constexpr const char* {key.upper()} = "{value}";')
@@ -49,6 +56,7 @@ def generate_header(input_path, output_path):
     for file in os.listdir(os.path.dirname(input_path)):
         if file.endswith('.p3'):
             base_name = os.path.splitext(file)[0]
+            sound_names.append(base_name)
             sounds.append(f'''
         extern const char p3_{base_name}_start[] asm("_binary_{base_name}_p3_start");
         extern const char p3_{base_name}_end[] asm("_binary_{base_name}_p3_end");
@@ -61,6 +69,7 @@ def generate_header(input_path, output_path):
     for file in os.listdir(os.path.join(os.path.dirname(output_path), 'common')):
         if file.endswith('.p3'):
             base_name = os.path.splitext(file)[0]
+            sound_names.append(base_name)
             sounds.append(f'''
         extern const char p3_{base_name}_start[] asm("_binary_{base_name}_p3_start");
         extern const char p3_{base_name}_end[] asm("_binary_{base_name}_p3_end");
@@ -74,7 +83,8 @@ def generate_header(input_path, output_path):
         lang_code=lang_code,
         lang_code_for_font=lang_code.replace('-', '_').lower(),
         strings="\n".join(sorted(strings)),
-        sounds="\n".join(sorted(sounds))
+        sounds="\n".join(sorted(sounds)),
+        sound_lookup="\n".join(f'            if (name == "{name}") return P3_{name.upper()};' for name in sorted(sound_names))
     )
 
     # 写入文件